@@ -99,11 +99,13 @@ int main(int argc, char **argv)
     int z, c;
     const char *map = "default";
     char *tile_dir = HASH_PATH;
+    char *metatile = NULL;
 
     while (1) {
         int option_index = 0;
         static struct option long_options[] = {
             {"map", 1, 0, 'm'},
+            {"metatile", 1, 0, 'M'},
             {"min-zoom", 1, 0, 'z'},
             {"max-zoom", 1, 0, 'Z'},
             {"unpack", 0, 0, 'u'},
@@ -113,7 +115,7 @@ int main(int argc, char **argv)
             {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "uhvz:Z:m:t:", long_options, &option_index);
+        c = getopt_long(argc, argv, "uhvz:Z:m:M:t:", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -135,6 +137,9 @@ int main(int argc, char **argv)
             case 'm':
                 map=strdup(optarg);
                 break;
+            case 'M':
+                metatile=strdup(optarg);
+                break;
             case 't':
                 tile_dir=strdup(optarg);
                 break;
@@ -148,6 +153,7 @@ int main(int argc, char **argv)
                 fprintf(stderr, "Usage: convert_meta [OPTION] ...\n");
                 fprintf(stderr, "Convert the rendered PNGs into the more efficient .meta format\n");
                 fprintf(stderr, "  -m, --map       convert tiles in this map (default is 'default')\n");
+                fprintf(stderr, "  -M, --metatile  metatile sizes of the map, as METATILE in renderd.conf (default is %d)\n", METATILE);
                 fprintf(stderr, "  -t, --tile-dir  tile cache directory (default is '" HASH_PATH "')\n");
                 fprintf(stderr, "  -u, --unpack    unpack the .meta files back to PNGs\n");
                 fprintf(stderr, "  -z, --min-zoom  only process tiles greater or equal to this zoom level (default is 0)\n");
@@ -164,6 +170,11 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (metatile && !metatile_size_parse(map, metatile)) {
+        fprintf(stderr, "Invalid metatile sizes: %s\n", metatile);
+        return 1;
+    }
+
     fprintf(stderr, "Converting tiles in map %s\n", map);
 
     gettimeofday(&start, NULL);
@@ -5,11 +5,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <poll.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
@@ -22,6 +22,11 @@
 #include "gen_tile.h"
 #include "protocol.h"
 #include "dir_utils.h"
+#include "request_queue.h"
+#include "slave.h"
+#include "shm_ring.h"
+#include "render_stats.h"
+#include "metrics.h"
 
 #define PIDFILE "/var/run/renderd/renderd.pid"
 
@@ -30,211 +35,15 @@ extern "C" {
 }
 
 static pthread_t *render_threads;
-static pthread_t *slave_threads;
 static struct sigaction sigPipeAction;
 
-static struct item reqHead, reqPrioHead, reqBulkHead, dirtyHead, renderHead;
-static struct item_idx * item_hashidx;
-static int reqNum, reqPrioNum, reqBulkNum, dirtyNum;
-static pthread_mutex_t qLock;
-static pthread_cond_t qCond;
 static int exit_pipe_fd;
 
-static stats_struct stats;
 static pthread_t stats_thread;
 
 static renderd_config config;
 
 int noSlaveRenders;
-int hashidxSize;
-
-void statsRenderFinish(int z, long time) {
-    pthread_mutex_lock(&qLock);
-    if ((z >= 0) && (z <= MAX_ZOOM)) {
-        stats.noZoomRender[z]++;
-        stats.timeZoomRender[z] += time;
-    }
-    pthread_mutex_unlock(&qLock);
-}
-
-struct item *fetch_request(void)
-{
-    struct item *item = NULL;
-
-    pthread_mutex_lock(&qLock);
-
-    while ((reqNum == 0) && (dirtyNum == 0) && (reqPrioNum == 0) && (reqBulkNum == 0)) {
-        pthread_cond_wait(&qCond, &qLock);
-    }
-    if (reqPrioNum) {
-        item = reqPrioHead.next;
-        reqPrioNum--;
-        stats.noReqPrioRender++;
-    } else if (reqNum) {
-        item = reqHead.next;
-        reqNum--;
-        stats.noReqRender++;
-    } else if (dirtyNum) {
-        item = dirtyHead.next;
-        dirtyNum--;
-        stats.noDirtyRender++;
-    } else if (reqBulkNum) {
-        item = reqBulkHead.next;
-        reqBulkNum--;
-        stats.noReqBulkRender++;
-    }
-    if (item) {
-        item->next->prev = item->prev;
-        item->prev->next = item->next;
-
-        item->prev = &renderHead;
-        item->next = renderHead.next;
-        renderHead.next->prev = item;
-        renderHead.next = item;
-        item->inQueue = queueRender;
-    }
-
-
-    pthread_mutex_unlock(&qLock);
-
-    return item;
-}
-
-void clear_requests(int fd)
-{
-    struct item *item, *dupes, *queueHead;
-
-    /**Only need to look up on the shorter request and render queue
-      * so using the linear list shouldn't be a problem
-      */
-    pthread_mutex_lock(&qLock);
-    for (int i = 0; i < 4; i++) {
-        switch (i) {
-        case 0: { queueHead = &reqHead; break;}
-        case 1: { queueHead = &renderHead; break;}
-        case 2: { queueHead = &reqPrioHead; break;}
-        case 3: { queueHead = &reqBulkHead; break;}
-        }
-
-        item = queueHead->next;
-        while (item != queueHead) {
-            if (item->fd == fd)
-                item->fd = FD_INVALID;
-
-            dupes = item->duplicates;
-            while (dupes) {
-                if (dupes->fd == fd)
-                    dupes->fd = FD_INVALID;
-                dupes = dupes->duplicates;
-            }
-            item = item->next;
-        }
-    }
-
-    pthread_mutex_unlock(&qLock);
-}
-
-
-static int calcHashKey(struct item *item) {
-    uint64_t xmlnameHash = 0;
-    uint64_t key;
-    for (int i = 0; item->req.xmlname[i] != 0; i++) {
-        xmlnameHash += item->req.xmlname[i];
-    }
-    key = ((uint64_t)(xmlnameHash & 0x1FF) << 52) + ((uint64_t)(item->req.z) << 48) + ((uint64_t)(item->mx & 0xFFFFFF) << 24) + (item->my & 0xFFFFFF);
-    return key % hashidxSize;
-}
-
-void insert_item_idx(struct item *item) {
-    struct item_idx * nextItem;
-    struct item_idx * prevItem;
-
-    int key = calcHashKey(item);
-
-    if (item_hashidx[key].item == NULL) {
-        item_hashidx[key].item = item;
-    } else {
-        prevItem = &(item_hashidx[key]);
-        nextItem = item_hashidx[key].next;
-        while(nextItem) {
-            prevItem = nextItem;
-            nextItem = nextItem->next;
-        }
-        nextItem = (struct item_idx *)malloc(sizeof(struct item_idx));
-        nextItem->item = item;
-        nextItem->next = NULL;
-        prevItem->next = nextItem;
-    }
-}
-
-void remove_item_idx(struct item * item) {
-    int key = calcHashKey(item);
-    struct item_idx * nextItem;
-    struct item_idx * prevItem;
-    struct item * test;
-    if (item_hashidx[key].item == NULL) {
-        //item not in index;
-        return;
-    }
-    prevItem = &(item_hashidx[key]);
-    nextItem = &(item_hashidx[key]);
-
-    while (nextItem != NULL) {
-        test = nextItem->item;
-        if ((item->mx == test->mx) && (item->my == test->my) && (item->req.z
-                == test->req.z) && (!strcmp(item->req.xmlname,
-                test->req.xmlname))) {
-            /*
-             * Found item, removing it from list
-             */
-            nextItem->item = NULL;
-            if (nextItem->next != NULL) {
-                if (nextItem == &(item_hashidx[key])) {
-                    prevItem = nextItem->next;
-                    memcpy(&(item_hashidx[key]), nextItem->next,
-                            sizeof(struct item_idx));
-                    free(prevItem);
-                } else {
-                    prevItem->next = nextItem->next;
-                }
-            } else {
-                prevItem->next = NULL;
-            }
-
-            if (nextItem != &(item_hashidx[key])) {
-                free(nextItem);
-            }
-            return;
-        } else {
-            prevItem = nextItem;
-            nextItem = nextItem->next;
-        }
-    }
-}
-
-struct item * lookup_item_idx(struct item * item) {
-    struct item_idx * nextItem;
-    struct item * test;
-
-    int key = calcHashKey(item);
-
-    if (item_hashidx[key].item == NULL) {
-        return NULL;
-    } else {
-        nextItem = &(item_hashidx[key]);
-        while (nextItem != NULL) {
-            test = nextItem->item;
-            if ((item->mx == test->mx) && (item->my == test->my)
-                    && (item->req.z == test->req.z) && (!strcmp(
-                    item->req.xmlname, test->req.xmlname))) {
-                return test;
-            } else {
-                nextItem = nextItem->next;
-            }
-        }
-    }
-    return NULL;
-}
 
 static inline const char *cmdStr(enum protoCmd c)
 {
@@ -246,74 +55,24 @@ static inline const char *cmdStr(enum protoCmd c)
         case cmdDirty:   return "Dirty";
         case cmdDone:    return "Done";
         case cmdNotDone: return "NotDone";
+        case cmdCredit:  return "Credit";
+        case cmdBusy:    return "Busy";
         default:         return "unknown";
     }
 }
 
-void send_response(struct item *item, enum protoCmd rsp)
-{
-    struct protocol *req = &item->req;
-    int ret;
-
-    pthread_mutex_lock(&qLock);
-    item->next->prev = item->prev;
-    item->prev->next = item->next;
-    remove_item_idx(item);
-    pthread_mutex_unlock(&qLock);
-
-    while (item) {
-        struct item *prev = item;
-        req = &item->req;
-        if ((item->fd != FD_INVALID) && ((req->cmd == cmdRender) || (req->cmd == cmdRenderPrio) || (req->cmd == cmdRenderBulk))) {
-            req->cmd = rsp;
-            //fprintf(stderr, "Sending message %s to %d\n", cmdStr(rsp), item->fd);
-            ret = send(item->fd, req, sizeof(*req), 0);
-            if (ret != sizeof(*req))
-                perror("send error during send_done");
-        }
-        item = item->duplicates;
-        free(prev);
-    }
-}
-
-
-enum protoCmd pending(struct item *test)
+enum protoCmd rx_request(const struct protocol *req, int id, int popularity, int timeout, int fd, struct waiter_list *waiters, int *retry_after)
 {
-    // check all queues and render list to see if this request already queued
-    // If so, add this new request as a duplicate
-    // call with qLock held
+    struct protocol reqnew;
     struct item *item;
 
-    item = lookup_item_idx(test);
-    if (item != NULL) {
-        if ((item->inQueue == queueRender) || (item->inQueue == queueRequest) || (item->inQueue == queueRequestPrio)) {
-            test->duplicates = item->duplicates;
-            item->duplicates = test;
-            test->inQueue = queueDuplicate;
-            return cmdIgnore;
-        } else if ((item->inQueue == queueDirty) || (item->inQueue == queueRequestBulk)){
-            return cmdNotDone;
-        }
-    }
-
-    return cmdRender;
-}
-
-
-enum protoCmd rx_request(const struct protocol *req, int fd)
-{
-    struct protocol *reqnew;
-    struct item *list = NULL, *item;
-    enum protoCmd pend;
-
     // Upgrade version 1 to version 2
     if (req->ver == 1) {
-        reqnew = (struct protocol *)malloc(sizeof(protocol));
-        memcpy(reqnew, req, sizeof(protocol_v1));
-        reqnew->xmlname[0] = 0;
-        req = reqnew;
+        memcpy(&reqnew, req, sizeof(protocol_v1));
+        reqnew.xmlname[0] = 0;
+        req = &reqnew;
     }
-    else if (req->ver != 2) {
+    else if ((req->ver != 2) && (req->ver != PROTO_VER_BATCH)) {
         syslog(LOG_ERR, "Bad protocol version %d", req->ver);
         return cmdIgnore;
     }
@@ -327,13 +86,16 @@ enum protoCmd rx_request(const struct protocol *req, int fd)
     if (check_xyz(req->x, req->y, req->z))
         return cmdNotDone;
 
-    item = (struct item *)malloc(sizeof(*item));
+    item = item_alloc();
     if (!item) {
             syslog(LOG_ERR, "malloc failed");
             return cmdNotDone;
     }
 
     item->req = *req;
+    item->id = id;
+    item->popularity = popularity;
+    item->timeout = timeout;
     item->duplicates = NULL;
     item->fd = (req->cmd == cmdDirty) ? FD_INVALID : fd;
 
@@ -342,89 +104,236 @@ enum protoCmd rx_request(const struct protocol *req, int fd)
      * Note: request path is no longer consistent but this will be recalculated
      * when the metatile is being rendered.
      */
-    item->mx = item->req.x & ~(METATILE-1);
-    item->my = item->req.y & ~(METATILE-1);
+    int size = metatile_size(item->req.xmlname, item->req.z);
+    item->mx = item->req.x & ~(size-1);
+    item->my = item->req.y & ~(size-1);
 #else
     item->mx = item->req.x;
     item->my = item->req.y;
 #endif
 
-    pthread_mutex_lock(&qLock);
+    return request_queue_add(item, waiters, retry_after);
+}
 
-    // Check for a matching request in the current rendering or dirty queues
-    pend = pending(item);
-    if (pend == cmdNotDone) {
-        // We found a match in the dirty queue, can not wait for it
-        pthread_mutex_unlock(&qLock);
-        free(item);
-        return cmdNotDone;
-    }
-    if (pend == cmdIgnore) {
-        // Found a match in render queue, item added as duplicate
-        pthread_mutex_unlock(&qLock);
-        return cmdIgnore;
+void request_exit(void)
+{
+  // Any write to the exit pipe will trigger a graceful exit
+  char c=0;
+  write(exit_pipe_fd, &c, sizeof(c));
+}
+
+/* Per client connection state. Requests arrive on a byte stream, so a
+ * partially received command is kept here until the rest of it arrives.
+ * For version 3 clients batch counts the items of the current frame that
+ * have not been received yet.
+ */
+#define CONNECTION_BUF_SIZE 4096
+
+struct connection {
+    int fd;
+    struct waiter_list waiters; // Requests still to be answered
+    int batch;
+    int itemsize;
+    size_t len;
+    char buf[CONNECTION_BUF_SIZE];
+};
+
+/* Tell a master renderd how many requests it may keep outstanding with us.
+ * It gets SLAVE_WINDOW_FACTOR requests per render thread, less whatever other
+ * clients have queued. cmd->x is the number of requests the master already has
+ * outstanding, those not being rendered are part of our queue depth.
+ */
+static void send_credit(int fd, struct protocol *cmd, int id)
+{
+    struct protocol rsp = *cmd;
+    int waiting = request_queue_waiting();
+    int ours = cmd->x - config.num_threads;
+    int others, window;
+
+    if (ours < 0)
+        ours = 0;
+    others = waiting - ours;
+    if (others < 0)
+        others = 0;
+    window = SLAVE_WINDOW_FACTOR * config.num_threads - others;
+    if (window < 1)
+        window = 1;
+
+    rsp.x = window;
+    rsp.y = waiting;
+    rsp.z = 0;
+    send_reply(fd, &rsp, id, cmdCredit);
+}
+
+/* Handle a command from the client on fd, which is waiting for the requests
+ * on waiters
+ */
+static void process_request(int fd, struct waiter_list *waiters, struct protocol *cmd, int id, int popularity, int timeout)
+{
+    enum protoCmd rsp;
+    int retry_after = 0;
+
+    if (cmd->cmd == cmdCredit) {
+        send_credit(fd, cmd, id);
+        return;
     }
 
-    // New request, add it to render or dirty queue
-    if ((req->cmd == cmdRender) && (reqNum < REQ_LIMIT)) {
-        list = &reqHead;
-        item->inQueue = queueRequest;
-        reqNum++;
-    } else if ((req->cmd == cmdRenderPrio) && (reqPrioNum < REQ_LIMIT)) {
-        list = &reqPrioHead;
-        item->inQueue = queueRequestPrio;
-        reqPrioNum++;
-    } else if ((req->cmd == cmdRenderBulk) && (reqBulkNum < REQ_LIMIT)) {
-        list = &reqBulkHead;
-        item->inQueue = queueRequestBulk;
-        reqBulkNum++;
-    } else if (dirtyNum < DIRTY_LIMIT) {
-        list = &dirtyHead;
-        item->inQueue = queueDirty;
-        dirtyNum++;
-        item->fd = FD_INVALID; // No response after render
-    } else {
-        // The queue is severely backlogged. Drop request
-        stats.noReqDroped++;
-        pthread_mutex_unlock(&qLock);
-        free(item);
-        return cmdNotDone;
+    rsp = rx_request(cmd, id, popularity, timeout, fd, waiters, &retry_after);
+
+    if (rsp == cmdBusy) {
+        syslog(LOG_DEBUG, "DEBUG: Sending Busy response, retry after %d ms\n", retry_after);
+        send_busy(fd, cmd, id, retry_after);
+    } else if (((cmd->cmd == cmdRender) || (cmd->cmd == cmdRenderPrio) || (cmd->cmd == cmdRenderBulk)) && (rsp == cmdNotDone)) {
+        syslog(LOG_DEBUG, "DEBUG: Sending NotDone response(%d)\n", rsp);
+        send_reply(fd, cmd, id, rsp);
     }
+}
+
+static void process_item(int fd, struct waiter_list *waiters, const struct protocol_v3_item *item)
+{
+    struct protocol cmd;
+
+    bzero(&cmd, sizeof(cmd));
+    cmd.ver = PROTO_VER_BATCH;
+    cmd.cmd = item->cmd;
+    cmd.x = item->x;
+    cmd.y = item->y;
+    cmd.z = item->z;
+    memcpy(cmd.xmlname, item->xmlname, sizeof(cmd.xmlname));
+    cmd.xmlname[sizeof(cmd.xmlname) - 1] = 0;
+    process_request(fd, waiters, &cmd, item->id, item->popularity, item->timeout);
+}
+
+/* Handle all complete commands in the connection buffer and keep whatever
+ * is left over for the next read. Returns 0 on a protocol error.
+ */
+static int process_buffer(struct connection *conn)
+{
+    size_t pos = 0;
+
+    while (1) {
+        const char *p = conn->buf + pos;
+        size_t avail = conn->len - pos;
 
-    if (list) {
-        item->next = list;
-        item->prev = list->prev;
-        item->prev->next = item;
-        list->prev = item;
-        /* In addition to the linked list, add item to a hash table index
-         * for faster lookup of pending requests.
-         */
-        insert_item_idx(item);
+        if (conn->batch > 0) {
+            struct protocol_v3_item item;
 
-        pthread_cond_signal(&qCond);
-    } else
-        free(item);
+            if (avail < (size_t)conn->itemsize)
+                break;
+            // Newer clients may send longer items, older ones shorter items
+            bzero(&item, sizeof(item));
+            memcpy(&item, p, (conn->itemsize < (int)sizeof(item)) ? conn->itemsize : sizeof(item));
+            pos += conn->itemsize;
+            conn->batch--;
+            process_item(conn->fd, &conn->waiters, &item);
+        } else {
+            int ver;
 
-    pthread_mutex_unlock(&qLock);
+            if (avail < sizeof(ver))
+                break;
+            memcpy(&ver, p, sizeof(ver));
+            if (ver == PROTO_VER_BATCH) {
+                struct protocol_v3 hdr;
 
-    return (list == &reqHead)?cmdIgnore:cmdNotDone;
+                if (avail < sizeof(hdr))
+                    break;
+                memcpy(&hdr, p, sizeof(hdr));
+                if ((hdr.count < 0) || (hdr.count > PROTO_BATCH_MAX) ||
+                        (hdr.itemsize < (int)PROTO_ITEM_MIN) || (hdr.itemsize > PROTO_ITEM_MAX)) {
+                    syslog(LOG_ERR, "Bad batch from fd %d: count(%d) itemsize(%d)", conn->fd, hdr.count, hdr.itemsize);
+                    return 0;
+                }
+                pos += sizeof(hdr);
+                conn->batch = hdr.count;
+                conn->itemsize = hdr.itemsize;
+            } else {
+                struct protocol cmd;
+
+                // Version 1 and 2 commands are always sent as a full struct protocol
+                if (avail < sizeof(cmd))
+                    break;
+                memcpy(&cmd, p, sizeof(cmd));
+                pos += sizeof(cmd);
+                // Older clients only mark tiles dirty that someone looked at
+                process_request(conn->fd, &conn->waiters, &cmd, 0, 1, 0);
+            }
+        }
+    }
+
+    if (pos > 0) {
+        memmove(conn->buf, conn->buf + pos, conn->len - pos);
+        conn->len -= pos;
+    }
+    return 1;
 }
 
-void request_exit(void)
+/* Read everything currently available on the connection. The sockets are
+ * registered edge triggered, so we must keep going until we hit EAGAIN.
+ * Returns 0 if the connection has been closed by the client or failed.
+ */
+static int process_connection(struct connection *conn)
 {
-  // Any write to the exit pipe will trigger a graceful exit
-  char c=0;
-  write(exit_pipe_fd, &c, sizeof(c));
+    while (1) {
+        int ret = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+        if (ret > 0) {
+            conn->len += ret;
+            if (!process_buffer(conn))
+                return 0;
+        } else if (ret == 0) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            syslog(LOG_ERR, "Recv Error on fd %d: %s", conn->fd, strerror(errno));
+            return 0;
+        }
+    }
+}
+
+/* Serve the clients of the shared memory ring. Each client slot has its own
+ * waiter list, just like a socket connection.
+ */
+static void *ring_thread(void *arg)
+{
+    struct shm_ring *ring = (struct shm_ring *)arg;
+    struct waiter_list *waiters;
+
+    waiters = (struct waiter_list *)calloc(SHM_RING_CLIENTS, sizeof(struct waiter_list));
+    if (!waiters) {
+        syslog(LOG_ERR, "malloc failed, not serving the shared memory ring");
+        return NULL;
+    }
+
+    while (1) {
+        struct protocol_v3_item item;
+        int slot;
+
+        if (!shm_ring_next(ring, &slot, &item, 1000))
+            continue;
+        if ((slot < 0) || (slot >= SHM_RING_CLIENTS)) {
+            syslog(LOG_ERR, "Bad client slot %d in shared memory ring", slot);
+            continue;
+        }
+        if (item.cmd == SHM_RING_RELEASE)
+            clear_requests(&waiters[slot]);
+        else
+            process_item(SHM_RING_FD(slot), &waiters[slot], &item);
+    }
+    return NULL;
 }
 
+#define EPOLL_EVENTS_MAX 64
+
 void process_loop(int listen_fd)
 {
     int num_connections = 0;
-    int connections[MAX_CONNECTIONS];
     int pipefds[2];
     int exit_pipe_read;
-
-    bzero(connections, sizeof(connections));
+    int epoll_fd;
+    struct epoll_event ev, events[EPOLL_EVENTS_MAX];
+    // The listening socket and the exit pipe are told apart from client
+    // connections by the address of these place holders
+    struct connection listen_conn, exit_conn;
 
     // A pipe is used to allow the render threads to request an exit by the main process
     if (pipe(pipefds)) {
@@ -434,94 +343,123 @@ void process_loop(int listen_fd)
     exit_pipe_fd = pipefds[1];
     exit_pipe_read = pipefds[0];
 
+    epoll_fd = epoll_create(EPOLL_EVENTS_MAX);
+    if (epoll_fd < 0) {
+        perror("epoll_create()");
+        return;
+    }
+
+    bzero(&listen_conn, sizeof(listen_conn));
+    listen_conn.fd = listen_fd;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl(listen)");
+        close(epoll_fd);
+        return;
+    }
+
+    bzero(&exit_conn, sizeof(exit_conn));
+    exit_conn.fd = exit_pipe_read;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &exit_conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, exit_pipe_read, &ev) < 0) {
+        perror("epoll_ctl(pipe)");
+        close(epoll_fd);
+        return;
+    }
+
     while (1) {
-        struct sockaddr_un in_addr;
-        socklen_t in_addrlen = sizeof(in_addr);
-        fd_set rd;
-        int incoming, num, nfds, i;
-
-        FD_ZERO(&rd);
-        FD_SET(listen_fd, &rd);
-        nfds = listen_fd+1;
-
-        for (i=0; i<num_connections; i++) {
-            FD_SET(connections[i], &rd);
-            nfds = MAX(nfds, connections[i]+1);
+        int num, i;
+
+        num = epoll_wait(epoll_fd, events, EPOLL_EVENTS_MAX, -1);
+        if (num == -1) {
+            if (errno != EINTR)
+                perror("epoll_wait()");
+            continue;
         }
 
-	FD_SET(exit_pipe_read, &rd);
-	nfds = MAX(nfds, exit_pipe_read+1);
-
-        num = select(nfds, &rd, NULL, NULL, NULL);
-        if (num == -1)
-            perror("select()");
-        else if (num) {
-	    if (FD_ISSET(exit_pipe_read, &rd)) {
-	      // A render thread wants us to exit
-	      break;
-	    }
-
-            //printf("Data is available now on %d fds\n", num);
-            if (FD_ISSET(listen_fd, &rd)) {
-                num--;
-                incoming = accept(listen_fd, (struct sockaddr *) &in_addr, &in_addrlen);
-                if (incoming < 0) {
-                    perror("accept()");
-                } else {
-                    if (num_connections == MAX_CONNECTIONS) {
-                        syslog(LOG_WARNING, "Connection limit(%d) reached. Dropping connection\n", MAX_CONNECTIONS);
-                        close(incoming);
-                    } else {
-                        connections[num_connections++] = incoming;
-                        syslog(LOG_DEBUG, "DEBUG: Got incoming connection, fd %d, number %d\n", incoming, num_connections);
-                    }
-                }
+        for (i = 0; i < num; i++) {
+            struct connection *conn = (struct connection *)events[i].data.ptr;
+
+            if (conn == &exit_conn) {
+                // A render thread wants us to exit
+                close(epoll_fd);
+                return;
             }
-            for (i=0; num && (i<num_connections); i++) {
-                int fd = connections[i];
-                if (FD_ISSET(fd, &rd)) {
-                    struct protocol cmd;
-                    int ret;
-
-                    // TODO: to get highest performance we should loop here until we get EAGAIN
-                    ret = recv(fd, &cmd, sizeof(cmd), MSG_DONTWAIT);
-                    if (ret == sizeof(cmd)) {
-                        enum protoCmd rsp = rx_request(&cmd, fd);
-
-                        if ((cmd.cmd == cmdRender) && (rsp == cmdNotDone)) {
-                            cmd.cmd = rsp;
-                            syslog(LOG_DEBUG, "DEBUG: Sending NotDone response(%d)\n", rsp);
-                            ret = send(fd, &cmd, sizeof(cmd), 0);
-                            if (ret != sizeof(cmd))
-                                perror("response send error");
-                        }
-                    } else if (!ret) {
-                        int j;
 
+            if (conn == &listen_conn) {
+                while (1) {
+                    struct sockaddr_un in_addr;
+                    socklen_t in_addrlen = sizeof(in_addr);
+                    int incoming = accept(listen_fd, (struct sockaddr *) &in_addr, &in_addrlen);
+                    if (incoming < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                            perror("accept()");
+                        if (errno != EINTR)
+                            break;
+                        continue;
+                    }
+                    conn = (struct connection *)malloc(sizeof(struct connection));
+                    if (!conn) {
+                        syslog(LOG_ERR, "malloc failed, dropping connection");
+                        close(incoming);
+                        continue;
+                    }
+                    conn->fd = incoming;
+                    conn->batch = 0;
+                    conn->len = 0;
+                    conn->waiters.head = NULL;
+                    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = conn;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, incoming, &ev) < 0) {
+                        perror("epoll_ctl(connection)");
+                        close(incoming);
+                        free(conn);
+                        continue;
+                    }
+                    num_connections++;
+                    syslog(LOG_DEBUG, "DEBUG: Got incoming connection, fd %d, number %d\n", incoming, num_connections);
+                    // Requests may already be waiting, and with edge triggering
+                    // we will not be told about them again
+                    if (!process_connection(conn)) {
                         num_connections--;
-                        syslog(LOG_DEBUG, "DEBUG: Connection %d, fd %d closed, now %d left\n", i, fd, num_connections);
-                        for (j=i; j < num_connections; j++)
-                            connections[j] = connections[j+1];
-                        clear_requests(fd);
-                        close(fd);
-                    } else {
-                        syslog(LOG_ERR, "Recv Error on fd %d", fd);
-                        break;
+                        clear_requests(&conn->waiters);
+                        close(conn->fd);
+                        free(conn);
                     }
                 }
+                continue;
+            }
+
+            if (!process_connection(conn)) {
+                num_connections--;
+                syslog(LOG_DEBUG, "DEBUG: Connection fd %d closed, now %d left\n", conn->fd, num_connections);
+                // Closing the fd also removes it from the epoll set
+                clear_requests(&conn->waiters);
+                close(conn->fd);
+                free(conn);
             }
-        } else {
-            syslog(LOG_ERR, "Select timeout");
         }
     }
 }
 
+static void write_percentiles(FILE *statfile, const char *name, const struct stats_histogram *hist)
+{
+    fprintf(statfile, "%sP50: %li\n", name, stats_histogram_percentile(hist, 0.5));
+    fprintf(statfile, "%sP99: %li\n", name, stats_histogram_percentile(hist, 0.99));
+}
+
 /**
  * Periodically write out current stats to a stats file. This information
  * can then be used to monitor performance of renderd e.g. with a munin plugin
  */
 void *stats_writeout_thread(void * arg) {
+    static const char *queueNames[STATS_QUEUES] = { "Req", "ReqPrio", "ReqBulk", "Dirty" };
     stats_struct lStats;
+    struct render_stats *rStats;
+    char name[64];
     int dirtQueueLength;
     int reqQueueLength;
     int reqPrioQueueLength;
@@ -533,15 +471,18 @@ void *stats_writeout_thread(void * arg) {
 
     snprintf(tmpName, sizeof(tmpName), "%s.tmp", config.stats_filename);
 
+    rStats = (struct render_stats *)malloc(sizeof(struct render_stats));
+    if (!rStats) {
+        syslog(LOG_ERR, "malloc failed, not writing stats");
+        return NULL;
+    }
+
     syslog(LOG_DEBUG, "Starting stats thread");
     while (1) {
-        pthread_mutex_lock(&qLock);
-        memcpy(&lStats, &stats, sizeof(stats_struct));
-        dirtQueueLength = dirtyNum;
-        reqQueueLength = reqNum;
-        reqPrioQueueLength = reqPrioNum;
-        reqBulkQueueLength = reqBulkNum;
-        pthread_mutex_unlock(&qLock);
+        bzero(&lStats, sizeof(lStats));
+        render_stats_collect(rStats);
+        request_queue_stats(&lStats, &reqQueueLength, &reqPrioQueueLength,
+                &reqBulkQueueLength, &dirtQueueLength);
 
         FILE * statfile = fopen(tmpName, "w");
         if (statfile == NULL) {
@@ -558,17 +499,59 @@ void *stats_writeout_thread(void * arg) {
             fprintf(statfile, "ReqPrioQueueLength: %i\n", reqPrioQueueLength);
             fprintf(statfile, "ReqBulkQueueLength: %i\n", reqBulkQueueLength);
             fprintf(statfile, "DirtQueueLength: %i\n", dirtQueueLength);
+            fprintf(statfile, "DirtQueueAgeP50: %li\n", lStats.dirtyAgeP50);
+            fprintf(statfile, "DirtQueueAgeP90: %li\n", lStats.dirtyAgeP90);
+            fprintf(statfile, "DirtQueueAgeP99: %li\n", lStats.dirtyAgeP99);
+            fprintf(statfile, "DirtQueueAgeMax: %li\n", lStats.dirtyAgeMax);
             fprintf(statfile, "DropedRequest: %li\n", lStats.noReqDroped);
+            fprintf(statfile, "BusyRequest: %li\n", lStats.noReqBusy);
+            fprintf(statfile, "ExpiredRequest: %li\n", lStats.noReqExpired);
             fprintf(statfile, "ReqRendered: %li\n", lStats.noReqRender);
             fprintf(statfile, "ReqPrioRendered: %li\n", lStats.noReqPrioRender);
             fprintf(statfile, "ReqBulkRendered: %li\n", lStats.noReqBulkRender);
             fprintf(statfile, "DirtyRendered: %li\n", lStats.noDirtyRender);
+            fprintf(statfile, "ItemPoolSize: %li\n", lStats.itemPoolSize);
+            fprintf(statfile, "ItemPoolFree: %li\n", lStats.itemPoolFree);
+            fprintf(statfile, "ItemPoolRefills: %li\n", lStats.itemPoolRefills);
+            fprintf(statfile, "ItemPoolFlushes: %li\n", lStats.itemPoolFlushes);
+            fprintf(statfile, "ItemPoolGrowths: %li\n", lStats.itemPoolGrowths);
             for (i = 0; i <= MAX_ZOOM; i++) {
-                fprintf(statfile,"ZoomRendered%02i: %li\n", i, lStats.noZoomRender[i]);
+                fprintf(statfile,"ZoomRendered%02i: %li\n", i, rStats->noZoomRender[i]);
             }
             for (i = 0; i <= MAX_ZOOM; i++) {
-                fprintf(statfile,"TimeRenderedZoom%02i: %li\n", i, lStats.timeZoomRender[i]);
+                fprintf(statfile,"TimeRenderedZoom%02i: %li\n", i, rStats->timeZoomRender[i]);
             }
+            // Latency percentiles in ms, waiting in the queues and rendering
+            for (i = 0; i <= MAX_ZOOM; i++) {
+                snprintf(name, sizeof(name), "WaitTimeZoom%02i", i);
+                write_percentiles(statfile, name, &rStats->waitZoom[i]);
+                snprintf(name, sizeof(name), "RenderTimeZoom%02i", i);
+                write_percentiles(statfile, name, &rStats->renderZoom[i]);
+            }
+            for (i = 0; i < STATS_QUEUES; i++) {
+                snprintf(name, sizeof(name), "WaitTime%s", queueNames[i]);
+                write_percentiles(statfile, name, &rStats->waitQueue[i]);
+                snprintf(name, sizeof(name), "RenderTime%s", queueNames[i]);
+                write_percentiles(statfile, name, &rStats->renderQueue[i]);
+            }
+            for (i = 0; render_stats_style(i); i++) {
+                snprintf(name, sizeof(name), "WaitTimeStyle_%s_", render_stats_style(i));
+                write_percentiles(statfile, name, &rStats->waitStyle[i]);
+                snprintf(name, sizeof(name), "RenderTimeStyle_%s_", render_stats_style(i));
+                write_percentiles(statfile, name, &rStats->renderStyle[i]);
+            }
+            // Where the render time went, see enum renderPhase
+            for (int p = 0; p < STATS_PHASES; p++) {
+                for (i = 0; i <= MAX_ZOOM; i++) {
+                    snprintf(name, sizeof(name), "%sTimeZoom%02i", render_stats_phase(p), i);
+                    write_percentiles(statfile, name, &rStats->phaseZoom[p][i]);
+                }
+                for (i = 0; render_stats_style(i); i++) {
+                    snprintf(name, sizeof(name), "%sTimeStyle_%s_", render_stats_phase(p), render_stats_style(i));
+                    write_percentiles(statfile, name, &rStats->phaseStyle[p][i]);
+                }
+            }
+            slaves_write_stats(statfile);
             fclose(statfile);
             if (rename(tmpName, config.stats_filename)) {
                 syslog(LOG_WARNING, "Failed to overwrite stats file: %i", errno);
@@ -585,62 +568,6 @@ void *stats_writeout_thread(void * arg) {
     return NULL;
 }
 
-int client_socket_init(renderd_config * sConfig) {
-    int fd;
-    struct sockaddr_un * addrU;
-    struct sockaddr_in * addrI;
-    struct hostent *server;
-    if (sConfig->ipport > 0) {
-        syslog(LOG_INFO, "Initialising TCP/IP client socket to %s:%i",
-                sConfig->iphostname, sConfig->ipport);
-        addrI = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-        fd = socket(PF_INET, SOCK_STREAM, 0);
-        server = gethostbyname(sConfig->iphostname);
-        if (server == NULL) {
-            syslog(LOG_WARNING, "Could not resolve hostname: %s",
-                    sConfig->iphostname);
-            return FD_INVALID;
-        }
-        bzero((char *) addrI, sizeof(struct sockaddr_in));
-        addrI->sin_family = AF_INET;
-        bcopy((char *) server->h_addr, (char *) &addrI->sin_addr.s_addr,
-                server->h_length);
-        addrI->sin_port = htons(sConfig->ipport);
-        if (connect(fd, (struct sockaddr *) addrI, sizeof(struct sockaddr_in)) < 0) {
-            syslog(LOG_WARNING, "Could not connect to %s:%i",
-                    sConfig->iphostname, sConfig->ipport);
-            return FD_INVALID;
-        }
-        free(addrI);
-        syslog(LOG_INFO, "socket %s:%i initialised to fd %i", sConfig->iphostname, sConfig->ipport,
-                fd);
-    } else {
-        syslog(LOG_INFO, "Initialising unix client socket on %s",
-                sConfig->socketname);
-        addrU = (struct sockaddr_un *)malloc(sizeof(struct sockaddr_un));
-        fd = socket(PF_UNIX, SOCK_STREAM, 0);
-        if (fd < 0) {
-            syslog(LOG_WARNING, "Could not obtain socket: %i", fd);
-            return FD_INVALID;
-        }
-
-        bzero(addrU, sizeof(struct sockaddr_un));
-        addrU->sun_family = AF_UNIX;
-        strncpy(addrU->sun_path, sConfig->socketname, sizeof(addrU->sun_path));
-
-        if (connect(fd, (struct sockaddr *) addrU, sizeof(struct sockaddr_un)) < 0) {
-            syslog(LOG_WARNING, "socket connect failed for: %s",
-                    sConfig->socketname);
-            close(fd);
-            return FD_INVALID;
-        }
-        free(addrU);
-        syslog(LOG_INFO, "socket %s initialised to fd %i", sConfig->socketname,
-                fd);
-    }
-    return fd;
-}
-
 int server_socket_init(renderd_config *sConfig) {
     struct sockaddr_un addrU;
     struct sockaddr_in addrI;
@@ -702,151 +629,11 @@ int server_socket_init(renderd_config *sConfig) {
 
 }
 
-/**
- * This function is used as a the start function for the slave renderer thread.
- * It pulls a request from the central queue of requests and dispatches it to
- * the slave renderer. It then blocks and waits for the response with no timeout.
- * As it only sends one request at a time (there are as many slave_thread threads as there
- * are rendering threads on the slaves) nothing gets queued on the slave and should get
- * rendererd immediately. Thus overall, requests should be nicely load balanced between
- * all the rendering threads available both locally and in the slaves.
- */
-void *slave_thread(void * arg) {
-    renderd_config * sConfig = (renderd_config *) arg;
-
-    int pfd = FD_INVALID;
-    int retry;
-    size_t ret_size;
-
-    struct protocol * resp;
-    struct protocol * req_slave;
-
-    req_slave = (struct protocol *)malloc(sizeof(protocol));
-    resp = (struct protocol *)malloc(sizeof(protocol));
-    bzero(req_slave, sizeof(struct protocol));
-    bzero(resp, sizeof(struct protocol));
-
-    while (1) {
-        if (pfd == FD_INVALID) {
-            pfd = client_socket_init(sConfig);
-            if (pfd == FD_INVALID) {
-                if (sConfig->ipport > 0) {
-                    syslog(LOG_ERR,
-                        "Failed to connect to render slave %s:%i, trying again in 30 seconds",
-                        sConfig->iphostname, sConfig->ipport);
-                } else {
-                    syslog( LOG_ERR,
-                            "Failed to connect to render slave %s, trying again in 30 seconds",
-                            sConfig->socketname);
-                }
-                sleep(30);
-                continue;
-            }
-        }
-
-        enum protoCmd ret;
-        struct item *item = fetch_request();
-        if (item) {
-            struct protocol *req = &item->req;
-            req_slave->ver = PROTO_VER;
-            req_slave->cmd = cmdRender;
-            strcpy(req_slave->xmlname, req->xmlname);
-            req_slave->x = req->x;
-            req_slave->y = req->y;
-            req_slave->z = req->z;
-
-            /*Dispatch request to slave renderd*/
-            retry = 2;
-            syslog(LOG_INFO,
-                    "Dispatching request to slave thread on fd %i", pfd);
-            do {
-                ret_size = send(pfd, req_slave, sizeof(struct protocol), 0);
-
-                if (ret_size == sizeof(struct protocol)) {
-                    //correctly sent command to slave
-                    break;
-                }
-
-                if (errno != EPIPE) {
-                    syslog(LOG_ERR,
-                            "Failed to send cmd to render slave, shutting down thread");
-                    return NULL;
-                }
-
-                syslog(LOG_WARNING, "Failed to send cmd to render slave, retrying");
-                close(pfd);
-                pfd = client_socket_init(sConfig);
-                if (pfd == FD_INVALID) {
-                    syslog(LOG_ERR,
-                            "Failed to re-connect to render slave, dropping request");
-                    ret = cmdNotDone;
-                    send_response(item, ret);
-                    break;
-                }
-            } while (retry--);
-            if (pfd == FD_INVALID || ret_size != sizeof(struct protocol)) {
-                continue;
-            }
-
-            ret_size = 0;
-            retry = 10;
-            while ((ret_size < sizeof(struct protocol)) && (retry > 0)) {
-                ret_size = recv(pfd, resp + ret_size, (sizeof(struct protocol)
-                        - ret_size), 0);
-                if ((errno == EPIPE) || ret_size == 0) {
-                    close(pfd);
-                    pfd = FD_INVALID;
-                    ret_size = 0;
-                    syslog(LOG_ERR, "Pipe to render slave closed");
-                    break;
-                }
-                retry--;
-            }
-            if (ret_size < sizeof(struct protocol)) {
-                if (sConfig->ipport > 0) {
-                    syslog( LOG_ERR,
-                            "Invalid reply from render slave %s:%i, trying again in 30 seconds",
-                            sConfig->iphostname, sConfig->ipport);
-                } else {
-                    syslog( LOG_ERR,
-                            "Invalid reply render slave %s, trying again in 30 seconds",
-                            sConfig->socketname);
-                }
-
-                ret = cmdNotDone;
-                send_response(item, ret);
-                sleep(30);
-            } else {
-                ret = resp->cmd;
-                send_response(item, ret);
-                if (resp->cmd != cmdDone) {
-                    if (sConfig->ipport > 0) {
-                        syslog( LOG_ERR,
-                                "Request from render slave %s:%i did not complete correctly",
-                                sConfig->iphostname, sConfig->ipport);
-                    } else {
-                        syslog( LOG_ERR,
-                                "Request from render slave %s did not complete correctly",
-                                sConfig->socketname);
-                    }
-                    //Sleep for a while to make sure we don't overload the renderer
-                    //This only happens if it didn't correctly block on the rendering
-                    //request
-                    sleep(30);
-                }
-            }
-
-        } else {
-            sleep(1); // TODO: Use an event to indicate there are new requests
-        }
-    }
-    return NULL;
-}
-
-
 int main(int argc, char **argv)
 {
-    int fd, i, j, k;
+    int fd, i;
+    struct shm_ring *ring = NULL;
+    pthread_t ring_thr;
 
     int c;
     int foreground=0;
@@ -905,22 +692,7 @@ int main(int argc, char **argv)
 
     syslog(LOG_INFO, "Rendering daemon started");
 
-    pthread_mutex_init(&qLock, NULL);
-    pthread_cond_init(&qCond, NULL);
-    reqHead.next = reqHead.prev = &reqHead;
-    reqPrioHead.next = reqPrioHead.prev = &reqPrioHead;
-    reqBulkHead.next = reqBulkHead.prev = &reqBulkHead;
-    dirtyHead.next = dirtyHead.prev = &dirtyHead;
-    renderHead.next = renderHead.prev = &renderHead;
-    hashidxSize = HASHIDX_SIZE;
-    item_hashidx = (struct item_idx *) malloc(sizeof(struct item_idx) * hashidxSize);
-    bzero(item_hashidx, sizeof(struct item_idx) * hashidxSize);
-
-    stats.noDirtyRender = 0;
-    stats.noReqDroped = 0;
-    stats.noReqRender = 0;
-    stats.noReqPrioRender = 0;
-    stats.noReqBulkRender = 0;
+    request_queue_init();
 
     xmlconfigitem maps[XMLCONFIGS_MAX];
     bzero(maps, sizeof(xmlconfigitem) * XMLCONFIGS_MAX);
@@ -958,6 +730,7 @@ int main(int argc, char **argv)
                 fprintf(stderr, "Config: more than %d configurations found\n", XMLCONFIGS_MAX);
                 exit(7);
             }
+            render_stats_add_style(name);
             sprintf(buffer, "%s:uri", name);
             char *ini_uri = iniparser_getstring(ini, buffer, (char *)"");
             if (strlen(ini_uri) >= PATH_MAX) {
@@ -984,6 +757,14 @@ int main(int argc, char **argv)
                 fprintf(stderr, "HTCP host name too long: %s\n", ini_htcpip);
                 exit(7);
             }
+#ifdef METATILE
+            sprintf(buffer, "%s:metatile", name);
+            char *ini_metatile = iniparser_getstring(ini, buffer, (char *) "");
+            if (ini_metatile[0] && !metatile_size_parse(name, ini_metatile)) {
+                fprintf(stderr, "Invalid metatile sizes: %s\n", ini_metatile);
+                exit(7);
+            }
+#endif
             strcpy(maps[iconf].xmlfile, ini_xmlpath);
             strcpy(maps[iconf].tile_dir, config.tile_dir);
             strcpy(maps[iconf].host, ini_hostname);
@@ -1022,6 +803,12 @@ int main(int argc, char **argv)
                 config.iphostname = config_slaves[render_sec].iphostname;
                 config.ipport = config_slaves[render_sec].ipport;
                 config.num_threads = config_slaves[render_sec].num_threads;
+                sprintf(buffer, "%s:num_encode_threads", name);
+                config.num_encode_threads = iniparser_getint(ini,
+                        buffer, NUM_ENCODE_THREADS);
+                sprintf(buffer, "%s:num_store_threads", name);
+                config.num_store_threads = iniparser_getint(ini,
+                        buffer, NUM_STORE_THREADS);
                 config.tile_dir = config_slaves[render_sec].tile_dir;
                 config.stats_filename
                         = config_slaves[render_sec].stats_filename;
@@ -1031,6 +818,18 @@ int main(int argc, char **argv)
                         "mapnik:font_dir", (char *) FONT_DIR);
                 config.mapnik_font_dir_recurse = iniparser_getboolean(ini,
                         "mapnik:font_dir_recurse", FONT_RECURSE);
+                sprintf(buffer, "%s:dirty_policy", name);
+                config.dirty_policy = iniparser_getstring(ini,
+                        buffer, (char *) "zoom");
+                sprintf(buffer, "%s:shm_ring", name);
+                config.shm_ring = iniparser_getstring(ini,
+                        buffer, NULL);
+                sprintf(buffer, "%s:metrics_port", name);
+                config.metrics_port = iniparser_getint(ini,
+                        buffer, 0);
+                sprintf(buffer, "%s:metrics_host", name);
+                config.metrics_host = iniparser_getstring(ini,
+                        buffer, (char *) "127.0.0.1");
             } else {
                 noSlaveRenders += config_slaves[render_sec].num_threads;
             }
@@ -1043,11 +842,21 @@ int main(int argc, char **argv)
         syslog(LOG_INFO, "config renderd: unix socketname=%s\n", config.socketname);
     }
     syslog(LOG_INFO, "config renderd: num_threads=%d\n", config.num_threads);
+    syslog(LOG_INFO, "config renderd: num_encode_threads=%d\n", config.num_encode_threads);
+    syslog(LOG_INFO, "config renderd: num_store_threads=%d\n", config.num_store_threads);
     if (active_slave == 0) {
         syslog(LOG_INFO, "config renderd: num_slaves=%d\n", noSlaveRenders);
     }
     syslog(LOG_INFO, "config renderd: tile_dir=%s\n", config.tile_dir);
     syslog(LOG_INFO, "config renderd: stats_file=%s\n", config.stats_filename);
+    syslog(LOG_INFO, "config renderd: dirty_policy=%s\n", config.dirty_policy);
+    syslog(LOG_INFO, "config renderd: shm_ring=%s\n", config.shm_ring);
+    if (config.metrics_port > 0) {
+        syslog(LOG_INFO, "config renderd: metrics=%s:%i\n", config.metrics_host, config.metrics_port);
+    }
+    if (config.dirty_policy && !request_queue_set_dirty_policy(config.dirty_policy)) {
+        syslog(LOG_ERR, "Unknown dirty_policy %s, using zoom", config.dirty_policy);
+    }
     syslog(LOG_INFO, "config mapnik:  plugins_dir=%s\n", config.mapnik_plugins_dir);
     syslog(LOG_INFO, "config mapnik:  font_dir=%s\n", config.mapnik_font_dir);
     syslog(LOG_INFO, "config mapnik:  font_dir_recurse=%d\n", config.mapnik_font_dir_recurse);
@@ -1082,13 +891,13 @@ int main(int argc, char **argv)
     }
 
     fd = server_socket_init(&config);
-#if 0
-    if (fcntl(fd, F_SETFD, O_RDWR | O_NONBLOCK) < 0) {
+    // The listening socket must not block, as process_loop() accepts
+    // connections until there are none left
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
         fprintf(stderr, "setting socket non-block failed\n");
         close(fd);
         exit(5);
     }
-#endif
 
     //sigPipeAction.sa_handler = pipe_handler;
     sigPipeAction.sa_handler = SIG_IGN;
@@ -1099,6 +908,7 @@ int main(int argc, char **argv)
     }
 
     render_init(config.mapnik_plugins_dir, config.mapnik_font_dir, config.mapnik_font_dir_recurse);
+    pipeline_init(config.num_encode_threads, config.num_store_threads);
 
     /* unless the command line said to run in foreground mode, fork and detach from terminal */
     if (foreground) {
@@ -1123,6 +933,7 @@ int main(int argc, char **argv)
         syslog(LOG_INFO, "No stats file specified in config. Stats reporting disabled");
     }
 
+    request_queue_set_workers(config.num_threads + ((active_slave == 0) ? noSlaveRenders : 0));
     render_threads = (pthread_t *) malloc(sizeof(pthread_t) * config.num_threads);
 
     for(i=0; i<config.num_threads; i++) {
@@ -1135,23 +946,26 @@ int main(int argc, char **argv)
 
     if (active_slave == 0) {
         //Only the master renderd opens connections to its slaves
-        k = 0;
-        slave_threads
-                = (pthread_t *) malloc(sizeof(pthread_t) * noSlaveRenders);
-        for (i = 1; i < MAX_SLAVES; i++) {
-            for (j = 0; j < config_slaves[i].num_threads; j++) {
-                if (pthread_create(&slave_threads[k++], NULL, slave_thread,
-                        (void *) &config_slaves[i])) {
-                    fprintf(stderr, "error spawning render thread\n");
-                    close(fd);
-                    exit(7);
-                }
-            }
+        slaves_start(config_slaves, MAX_SLAVES);
+    }
+
+    if (config.metrics_port > 0) {
+        metrics_start(config.metrics_host, config.metrics_port);
+    }
+
+    if (config.shm_ring != NULL) {
+        ring = shm_ring_create(config.shm_ring);
+        if (!ring) {
+            syslog(LOG_ERR, "Could not create shared memory ring %s: %s", config.shm_ring, strerror(errno));
+        } else if (pthread_create(&ring_thr, NULL, ring_thread, (void *)ring)) {
+            syslog(LOG_WARNING, "Could not create shared memory ring thread");
         }
     }
 
     process_loop(fd);
 
+    if (ring)
+        shm_ring_destroy(ring, config.shm_ring);
     unlink(config.socketname);
     close(fd);
     return 0;
@@ -1,5 +1,5 @@
 #ifndef DAEMON_H
-#define DEEMON_H
+#define DAEMON_H
 
 #include <limits.h> /* for PATH_MAX */
 
@@ -13,11 +13,17 @@ typedef struct {
     char *iphostname;
     int ipport;
     int num_threads;
+    int num_encode_threads;
+    int num_store_threads;
     char *tile_dir;
     char *mapnik_plugins_dir;
     char *mapnik_font_dir;
     int mapnik_font_dir_recurse;
     char * stats_filename;
+    char *dirty_policy;
+    char *shm_ring;
+    char *metrics_host;
+    int metrics_port;
 } renderd_config;
 
 typedef struct {
@@ -35,14 +41,22 @@ typedef struct {
     long noReqPrioRender;
     long noReqBulkRender;
     long noReqDroped;
-    long noZoomRender[MAX_ZOOM + 1];
+    long noReqBusy;
+    long noReqExpired;
     long timeReqRender;
     long timeReqPrioRender;
     long timeReqBulkRender;
-    long timeZoomRender[MAX_ZOOM + 1];
+    long itemPoolSize;
+    long itemPoolFree;
+    long itemPoolRefills;
+    long itemPoolFlushes;
+    long itemPoolGrowths;
+    long dirtyAgeP50;
+    long dirtyAgeP90;
+    long dirtyAgeP99;
+    long dirtyAgeMax;
 } stats_struct;
 
-void statsRenderFinish(int z, long time);
 void request_exit(void);
 
 
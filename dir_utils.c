@@ -140,15 +140,83 @@ int path_to_xyz(const char *path, char *xmlconfig, int *px, int *py, int *pz)
 }
 
 #ifdef METATILE
+// Styles with sizes other than METATILE, set up before any thread starts
+static struct {
+    char xmlconfig[XMLCONFIG_MAX];
+    unsigned char size[MAX_ZOOM + 1];
+} metatileSizes[XMLCONFIGS_MAX];
+static int numMetatileSizes;
+
+int metatile_size_parse(const char *xmlconfig, const char *spec)
+{
+    unsigned char size[MAX_ZOOM + 1];
+    const char *p = spec;
+    int i, z;
+
+    for (z = 0; z <= MAX_ZOOM; z++)
+        size[z] = METATILE;
+    while (*p) {
+        int n, minz = 0, maxz = MAX_ZOOM, used;
+
+        if (sscanf(p, " %d%n", &n, &used) != 1)
+            return 0;
+        p += used;
+        if (*p == ':') {
+            if (sscanf(p, ":%d-%d%n", &minz, &maxz, &used) != 2)
+                return 0;
+            p += used;
+        }
+        if ((n < 1) || (n > METATILE_MAX) || (n & (n - 1)) ||
+                (minz < 0) || (maxz > MAX_ZOOM) || (minz > maxz))
+            return 0;
+        for (z = minz; z <= maxz; z++)
+            size[z] = n;
+        while ((*p == ' ') || (*p == '\t'))
+            p++;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return 0;
+    }
+
+    for (i = 0; i < numMetatileSizes; i++) {
+        if (!strcmp(metatileSizes[i].xmlconfig, xmlconfig))
+            break;
+    }
+    if (i == numMetatileSizes) {
+        if (i >= XMLCONFIGS_MAX)
+            return 0;
+        strncpy(metatileSizes[i].xmlconfig, xmlconfig, XMLCONFIG_MAX - 1);
+        numMetatileSizes++;
+    }
+    memcpy(metatileSizes[i].size, size, sizeof(size));
+    return 1;
+}
+
+int metatile_size(const char *xmlconfig, int z)
+{
+    int i;
+
+    if ((z < 0) || (z > MAX_ZOOM))
+        return METATILE;
+    for (i = 0; i < numMetatileSizes; i++) {
+        if (!strcmp(metatileSizes[i].xmlconfig, xmlconfig))
+            return metatileSizes[i].size[z];
+    }
+    return METATILE;
+}
+
 // Returns the path to the meta-tile and the offset within the meta-tile
 int xyz_to_meta(char *path, size_t len, const char *tile_dir, const char *xmlconfig, int x, int y, int z)
 {
-    unsigned char i, hash[5], offset, mask;
+    unsigned char i, hash[5];
+    int size, offset, mask;
 
     // Each meta tile winds up in its own file, with several in each leaf directory
     // the .meta tile name is beasd on the sub-tile at (0,0)
-    mask = METATILE - 1;
-    offset = (x & mask) * METATILE + (y & mask);
+    size = metatile_size(xmlconfig, z);
+    mask = size - 1;
+    offset = (x & mask) * size + (y & mask);
     x &= ~mask;
     y &= ~mask;
 
@@ -25,6 +25,16 @@ int check_xyz(int x, int y, int z);
 int path_to_xyz(const char *path, char *xmlconfig, int *px, int *py, int *pz);
 
 #ifdef METATILE
+/* Metatile sizes. Each style can have its own size for each zoom level, given
+ * as "16:0-12,8:13-16,4:17-18" or just "4" for all zoom levels. The sizes are
+ * powers of 2 up to METATILE_MAX, zoom levels not mentioned use METATILE.
+ * Everything reading or writing the tiles of a style must agree on its sizes.
+ */
+/* Set the sizes of xmlconfig from spec. Returns 0 if spec is invalid. */
+int metatile_size_parse(const char *xmlconfig, const char *spec);
+/* Tiles across a metatile of xmlconfig at zoom z */
+int metatile_size(const char *xmlconfig, int z);
+
 /* New meta-tile storage functions */
 /* Returns the path to the meta-tile and the offset within the meta-tile */
 int xyz_to_meta(char *path, size_t len, const char *tile_dir, const char *xmlconfig, int x, int y, int z);
@@ -9,6 +9,8 @@
 
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <vector>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -23,6 +25,7 @@
 #include "protocol.h"
 #include "dir_utils.h"
 #include "store.h"
+#include "render_stats.h"
 
 #ifdef HTCP_EXPIRE_CACHE
 #include <sys/socket.h>
@@ -299,46 +302,50 @@ int init_cache_expire(char * htcphost) {
 
 class metaTile {
     public:
-        metaTile(const std::string &xmlconfig, int x, int y, int z):
-            x_(x), y_(y), z_(z), xmlconfig_(xmlconfig)
+        // A metatile of size x size tiles, of which those within the world
+        // are rendered
+        metaTile(const std::string &xmlconfig, int x, int y, int z, int size):
+            x_(x), y_(y), z_(z), size_(size), xmlconfig_(xmlconfig), tile(size * size)
         {
-            clear();
         }
 
         void clear()
         {
-            for (int x = 0; x < METATILE; x++)
-                for (int y = 0; y < METATILE; y++)
-                    tile[x][y] = "";
+            for (int i = 0; i < size_ * size_; i++)
+                tile[i] = "";
         }
 
         void set(int x, int y, const std::string &data)
         {
-            tile[x][y] = data;
+            tile[x * size_ + y] = data;
         }
 
-        const std::string get(int x, int y)
+        const std::string &get(int x, int y) const
         {
-            return tile[x][y];
+            return tile[x * size_ + y];
         }
 
         // Returns the offset within the meta-tile index table
         int xyz_to_meta_offset(int x, int y, int z)
         {
-            unsigned char mask = METATILE - 1;
-            return (x & mask) * METATILE + (y & mask);
+            int mask = size_ - 1;
+            return (x & mask) * size_ + (y & mask);
         }
 
         void save(const char *tile_dir)
         {
             int ox, oy, limit;
             size_t offset;
+            const int count = size_ * size_;
+            const size_t header_size = sizeof(struct meta_layout) + sizeof(struct entry) * count;
             struct meta_layout m;
             char meta_path[PATH_MAX];
-            struct entry offsets[METATILE * METATILE];
+            std::vector<struct entry> offsets(count);
+            std::vector<unsigned char> v2buf(META_V2_SIZE(count));
+            struct meta_header_v2 *v2 = (struct meta_header_v2 *)&v2buf[0];
 
             memset(&m, 0, sizeof(m));
-            memset(&offsets, 0, sizeof(offsets));
+            memset(&offsets[0], 0, sizeof(struct entry) * count);
 
             xyz_to_meta(meta_path, sizeof(meta_path), tile_dir, xmlconfig_.c_str(), x_, y_, z_);
             std::stringstream ss;
@@ -354,33 +361,71 @@ class metaTile {
 	      file.open(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
 
 	      // Create and write header
-	      m.count = METATILE * METATILE;
+	      m.count = count;
 	      memcpy(m.magic, META_MAGIC, strlen(META_MAGIC));
 	      m.x = x_;
 	      m.y = y_;
 	      m.z = z_;
 	      file.write((const char *)&m, sizeof(m));
 	      
-	      offset = header_size;
+	      offset = header_size + v2buf.size();
 	      limit = (1 << z_);
-	      limit = MIN(limit, METATILE);
-	      
+	      limit = MIN(limit, size_);
+
+	      // Identical tiles are written once and share their data. The
+	      // shared data goes first, so that readers find it in the part
+	      // of the file they read along with the header.
+	      int n = limit * limit;
+	      std::vector<int> same(n), shared(n);
+	      std::vector<size_t> at(n);
+	      std::vector<int> order;
+	      int i, j;
+
+	      for (i = 0; i < n; i++) {
+		same[i] = i;
+		shared[i] = 0;
+		for (j = 0; j < i; j++) {
+		  if (get(j / limit, j % limit) == get(i / limit, i % limit)) {
+		    same[i] = same[j];
+		    shared[same[j]] = 1;
+		    break;
+		  }
+		}
+	      }
+	      for (int pass = 1; pass >= 0; pass--) {
+		for (i = 0; i < n; i++) {
+		  if ((same[i] == i) && (shared[i] == pass)) {
+		    at[i] = offset;
+		    offset += get(i / limit, i % limit).size();
+		    order.push_back(i);
+		  }
+		}
+	      }
+
 	      // Generate offset table
-	      for (ox=0; ox < limit; ox++) {
-                for (oy=0; oy < limit; oy++) {
-		  int mt = xyz_to_meta_offset(x_ + ox, y_ + oy, z_);
-		  offsets[mt].offset = offset;
-		  offsets[mt].size   = tile[ox][oy].size();
-		  offset += offsets[mt].size;
-                }
+	      for (i = 0; i < n; i++) {
+		ox = i / limit;
+		oy = i % limit;
+		int mt = xyz_to_meta_offset(x_ + ox, y_ + oy, z_);
+		const std::string &data = get(ox, oy);
+		offsets[mt].offset = at[same[i]];
+		offsets[mt].size   = data.size();
+		tile_hash((const unsigned char *)data.data(), data.size(), v2->hash[mt]);
 	      }
-	      file.write((const char *)&offsets, sizeof(offsets));
-	      
+	      file.write((const char *)&offsets[0], sizeof(struct entry) * count);
+
+	      // Version 2 header, its hashes are the ETags of mod_tile
+	      memcpy(v2->magic, META_V2_MAGIC, strlen(META_V2_MAGIC));
+	      v2->version = META_VERSION;
+	      v2->size = size_;
+	      v2->encoding = metaEncodingPNG;
+	      v2->rendered = time(NULL);
+	      file.write((const char *)&v2buf[0], v2buf.size());
+
 	      // Write tiles
-	      for (ox=0; ox < limit; ox++) {
-                for (oy=0; oy < limit; oy++) {
-		  file.write((const char *)tile[ox][oy].data(), tile[ox][oy].size());
-                }
+	      for (i = 0; i < (int)order.size(); i++) {
+		const std::string &data = get(order[i] / limit, order[i] % limit);
+		file.write(data.data(), data.size());
 	      }
 	      
 	      file.close();
@@ -402,7 +447,7 @@ class metaTile {
             syslog(LOG_INFO, "Purging metatile via HTCP cache expiry");
             int ox, oy;
             int limit = (1 << z_);
-            limit = MIN(limit, METATILE);
+            limit = MIN(limit, size_);
 
             // Generate offset table
             for (ox=0; ox < limit; ox++) {
@@ -413,13 +458,12 @@ class metaTile {
         }
 #endif
         int x_, y_, z_;
+        int size_;
         std::string xmlconfig_;
-        std::string tile[METATILE][METATILE];
-        static const int header_size = sizeof(struct meta_layout) + (sizeof(struct entry) * (METATILE * METATILE));
+        std::vector<std::string> tile;
 };
 
-
-static enum protoCmd render(Map &m, char *xmlname, projection &prj, int x, int y, int z, unsigned int size, metaTile &tiles)
+static void render(Map &m, projection &prj, int x, int y, int z, unsigned int size, Image32 &buf)
 {
     int render_size = 256 * size;
     double p0x = x * 256;
@@ -441,21 +485,302 @@ static enum protoCmd render(Map &m, char *xmlname, projection &prj, int x, int y
     m.set_buffer_size(128);
     //m.zoom(size+1);
 
-    Image32 buf(render_size, render_size);
     agg_renderer<Image32> ren(m,buf);
     ren.apply();
+}
 
-    // Split the meta tile into an NxN grid of tiles
-    unsigned int xx, yy;
-    for (yy = 0; yy < size; yy++) {
-        for (xx = 0; xx < size; xx++) {
-            image_view<ImageData32> vw(xx * 256, yy * 256, 256, 256, buf.data());
-            tiles.set(xx, yy, save_to_string(vw, "png256"));
+/* Rendering a metatile is a pipeline of three stages, each with its own
+ * threads and a bounded queue in front of it:
+ *
+ *  - the render threads draw the metatile with mapnik,
+ *  - the encoder threads split it into tiles and encode them to PNG, each
+ *    taking the next tile of the oldest metatile not yet taken,
+ *  - the store threads write the metatile to disk, answer the clients and
+ *    then purge the tiles from the HTCP caches.
+ *
+ * A stage without threads of its own is done by the thread of the stage
+ * before it. A full queue holds up the stage before it, which bounds the
+ * number of metatiles in memory.
+ */
+struct render_job {
+    struct item *item;
+    xmlmapconfig *map; // Of the render thread, which never exits
+    Image32 *buf;
+    metaTile *tiles;
+    unsigned int size;
+    unsigned int claimed;   // Tiles taken by an encoder thread, in row order
+    unsigned int remaining; // Tiles not encoded yet
+    int failed;
+    long started; // When drawing started
+    long drawn;   // When drawing finished
+    long phases[STATS_PHASES];
+    struct render_job *next;
+};
+
+struct stage {
+    struct render_job *head;
+    int length;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+};
+
+static struct stage encodeStage = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static struct stage storeStage = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void stage_push(struct stage *s, struct render_job *job)
+{
+    struct render_job **last;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->length >= PIPELINE_QUEUE_MAX)
+        pthread_cond_wait(&s->notFull, &s->lock);
+    for (last = &s->head; *last; last = &(*last)->next)
+        ;
+    job->next = NULL;
+    *last = job;
+    s->length++;
+    pthread_cond_broadcast(&s->notEmpty);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Called with the lock of s held
+static struct render_job *stage_unlink(struct stage *s)
+{
+    struct render_job *job = s->head;
+
+    s->head = job->next;
+    s->length--;
+    pthread_cond_signal(&s->notFull);
+    return job;
+}
+
+static struct render_job *stage_pop(struct stage *s)
+{
+    struct render_job *job;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->head)
+        pthread_cond_wait(&s->notEmpty, &s->lock);
+    job = stage_unlink(s);
+    pthread_mutex_unlock(&s->lock);
+    return job;
+}
+
+static void store_job(struct render_job *job)
+{
+    enum protoCmd ret = job->failed ? cmdNotDone : cmdDone;
+    struct item *item = job->item;
+    char xmlname[XMLCONFIG_MAX];
+    int z = item->req.z;
+
+    // The item is gone once the clients are answered
+    strcpy(xmlname, item->req.xmlname);
+
+    if (ret == cmdDone) {
+        long t0 = stats_clock_ms();
+        try {
+            job->tiles->save(job->map->tile_dir);
+        } catch (...) {
+            // Treat any error as fatal and request end of processing
+            syslog(LOG_ERR, "Received error when writing metatile to disk, requesting exit.");
+            ret = cmdNotDone;
+            request_exit();
         }
+        job->phases[phaseWrite] = stats_clock_ms() - t0;
+    }
+    send_response(item, ret);
+
+    if (ret == cmdDone) {
+#ifdef HTCP_EXPIRE_CACHE
+        long t1 = stats_clock_ms();
+        job->tiles->expire_tiles(job->map->htcpsock, job->map->host, job->map->xmluri);
+        job->phases[phaseExpire] = stats_clock_ms() - t1;
+#endif
+        statsRenderPhases(xmlname, z, job->phases);
+    }
+    delete job->tiles;
+    free(job);
+}
+
+static void job_encoded(struct render_job *job)
+{
+    struct item *item = job->item;
+    struct protocol *req = &item->req;
+    long now = stats_clock_ms();
+
+    delete job->buf;
+    job->buf = NULL;
+    job->phases[phaseEncode] = now - job->drawn;
+    syslog(LOG_DEBUG, "DEBUG: DONE TILE %s %d %d-%d %d-%d in %.3lf seconds",
+           req->xmlname, req->z, item->mx, item->mx+job->size-1, item->my, item->my+job->size-1, (now - job->started)/1000.0);
+    statsRenderFinish(item, job->started - item->received, job->phases[phaseDraw] + job->phases[phaseEncode]);
+
+    if (storeStage.threads > 0)
+        stage_push(&storeStage, job);
+    else
+        store_job(job);
+}
+
+/* Tiles of a single colour, like those of open sea or empty land, make up a
+ * large part of the world. A style has few such colours, so each of them is
+ * only encoded once and then shared by all tiles of that colour.
+ */
+static std::map<unsigned int, std::string> uniformTiles;
+static pthread_mutex_t uniformLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int is_uniform(const image_view<ImageData32> &vw, unsigned int *colour)
+{
+    const unsigned int *first = vw.getRow(0);
+    unsigned int x, y;
+
+    for (x = 1; x < vw.width(); x++) {
+        if (first[x] != first[0])
+            return 0;
+    }
+    for (y = 1; y < vw.height(); y++) {
+        if (memcmp(vw.getRow(y), first, vw.width() * sizeof(*first)))
+            return 0;
+    }
+    *colour = first[0];
+    return 1;
+}
+
+static std::string encode_view(const image_view<ImageData32> &vw)
+{
+    std::map<unsigned int, std::string>::iterator it;
+    unsigned int colour;
+    std::string data;
+
+    if (!is_uniform(vw, &colour))
+        return save_to_string(vw, "png256");
+
+    pthread_mutex_lock(&uniformLock);
+    it = uniformTiles.find(colour);
+    if (it != uniformTiles.end())
+        data = it->second;
+    pthread_mutex_unlock(&uniformLock);
+    if (!data.empty())
+        return data;
+
+    data = save_to_string(vw, "png256");
+    pthread_mutex_lock(&uniformLock);
+    if (uniformTiles.size() < UNIFORM_TILES_MAX)
+        uniformTiles[colour] = data;
+    pthread_mutex_unlock(&uniformLock);
+    return data;
+}
+
+static int encode_tile(struct render_job *job, unsigned int n)
+{
+    unsigned int xx = n % job->size;
+    unsigned int yy = n / job->size;
+
+    try {
+        image_view<ImageData32> vw(xx * 256, yy * 256, 256, 256, job->buf->data());
+        job->tiles->set(xx, yy, encode_view(vw));
+    } catch (std::exception &ex) {
+        syslog(LOG_ERR, "Failed to encode tile: %s", ex.what());
+        return 0;
+    }
+    return 1;
+}
+
+static void *encode_thread(void *arg)
+{
+    struct stage *s = &encodeStage;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        struct render_job *job;
+        unsigned int n;
+        int ok;
+
+        while (!s->head)
+            pthread_cond_wait(&s->notEmpty, &s->lock);
+        job = s->head;
+        n = job->claimed++;
+        // Last tile of the metatile, nothing left for the others
+        if (job->claimed == job->size * job->size)
+            stage_unlink(s);
+        pthread_mutex_unlock(&s->lock);
+
+        ok = encode_tile(job, n);
+
+        pthread_mutex_lock(&s->lock);
+        if (!ok)
+            job->failed = 1;
+        if (--job->remaining == 0) {
+            pthread_mutex_unlock(&s->lock);
+            job_encoded(job);
+            pthread_mutex_lock(&s->lock);
+        }
+    }
+    return NULL;
+}
+
+static void *store_thread(void *arg)
+{
+    while (1)
+        store_job(stage_pop(&storeStage));
+    return NULL;
+}
+
+static void stage_start(struct stage *s, int threads, void *(*fn)(void *), const char *name)
+{
+    pthread_t thread;
+
+    for (s->threads = 0; s->threads < threads; s->threads++) {
+        if (pthread_create(&thread, NULL, fn, NULL)) {
+            syslog(LOG_ERR, "Could not create %s thread, running with %i", name, s->threads);
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void pipeline_init(int encode_threads, int store_threads)
+{
+    stage_start(&encodeStage, encode_threads, encode_thread, "encoder");
+    stage_start(&storeStage, store_threads, store_thread, "store");
+}
+
+/* Draw the metatile of item and pass it down the pipeline */
+static void render_metatile(xmlmapconfig *map, struct item *item)
+{
+    struct protocol *req = &item->req;
+    struct render_job *job;
+
+    job = (struct render_job *)calloc(1, sizeof(struct render_job));
+    if (!job) {
+        syslog(LOG_ERR, "malloc failed, not rendering metatile");
+        send_response(item, cmdNotDone);
+        return;
+    }
+    job->item = item;
+    job->map = map;
+    // At very low zoom the whole world may be smaller than the metatile
+    int size = metatile_size(req->xmlname, req->z);
+    job->size = MIN(size, 1 << req->z);
+    job->remaining = job->size * job->size;
+    job->tiles = new metaTile(req->xmlname, item->mx, item->my, req->z, size);
+    job->buf = new Image32(256 * job->size, 256 * job->size);
+
+    job->started = stats_clock_ms();
+    render(map->map, map->prj, item->mx, item->my, req->z, job->size, *job->buf);
+    job->drawn = stats_clock_ms();
+    job->phases[phaseDraw] = job->drawn - job->started;
+
+    if (encodeStage.threads > 0) {
+        stage_push(&encodeStage, job);
+    } else {
+        for (unsigned int n = 0; n < job->size * job->size; n++) {
+            if (!encode_tile(job, n))
+                job->failed = 1;
+        }
+        job_encoded(job);
     }
-//    std::cout << "DONE TILE " << xmlname << " " << z << " " << x << "-" << x+size-1 << " " << y << "-" << y+size-1 << "\n";
-    syslog(LOG_DEBUG, "DEBUG: DONE TILE %s %d %d-%d %d-%d", xmlname, z, x, x+size-1, y, y+size-1);
-    return cmdDone; // OK
 }
 #else
 static enum protoCmd render(Map &m, const char *tile_dir, char *xmlname, projection &prj, int x, int y, int z)
@@ -497,6 +822,10 @@ static enum protoCmd render(Map &m, const char *tile_dir, char *xmlname, project
 
     return cmdDone; // OK
 }
+
+void pipeline_init(int encode_threads, int store_threads)
+{
+}
 #endif
 
 
@@ -544,63 +873,39 @@ void *render_thread(void * arg)
 #endif
     }
 
+    // Style and zoom level rendered last. Sticking to them where the queue
+    // allows keeps the caches of the style and its datasources warm.
+    const char *last_xmlname = NULL;
+    int last_z = 0;
+
     while (1) {
-        enum protoCmd ret;
-        struct item *item = fetch_request();
+        struct item *item = fetch_request_affinity(last_xmlname, last_z);
         if (item) {
             struct protocol *req = &item->req;
-#ifdef METATILE
-            // At very low zoom the whole world may be smaller than METATILE
-            unsigned int size = MIN(METATILE, 1 << req->z);
             for (i = 0; i < iMaxConfigs; ++i) {
                 if (!strcmp(maps[i].xmlname, req->xmlname)) {
-                    metaTile tiles(req->xmlname, item->mx, item->my, req->z);
-                    
-                    if (maps[i].ok) {
-                        timeval tim;
-                        gettimeofday(&tim, NULL);
-                        long t1=tim.tv_sec*1000+(tim.tv_usec/1000);
-
-                        ret = render(maps[i].map, req->xmlname, maps[i].prj, item->mx, item->my, req->z, size, tiles);
-
-                        gettimeofday(&tim, NULL);
-                        long t2=tim.tv_sec*1000+(tim.tv_usec/1000);
-                        syslog(LOG_DEBUG, "DEBUG: DONE TILE %s %d %d-%d %d-%d in %.3lf seconds", 
-                               req->xmlname, req->z, item->mx, item->mx+size-1, item->my, item->my+size-1, (t2 - t1)/1000.0);
-                        statsRenderFinish(req->z, t2 - t1);
-                    } else {
+                    if (!maps[i].ok) {
                         syslog(LOG_ERR, "Received request for map layer '%s' which failed to load", req->xmlname);
-                        ret = cmdNotDone;
-                    }
-
-                    if (ret == cmdDone) {
-		      try {
-                        tiles.save(maps[i].tile_dir);
-		      } catch (...) {
-			// Treat any error as fatal and request end of processing
-                        syslog(LOG_ERR, "Received error when writing metatile to disk, requesting exit.");
-                        ret = cmdNotDone;
-			request_exit();
-		      }
-#ifdef HTCP_EXPIRE_CACHE
-                        tiles.expire_tiles(maps[i].htcpsock,maps[i].host,maps[i].xmluri);
-#endif
+                        send_response(item, cmdNotDone);
+                        break;
                     }
+                    last_xmlname = maps[i].xmlname;
+                    last_z = req->z;
+#ifdef METATILE
+                    render_metatile(&maps[i], item);
 #else
-                    ret = render(maps[i].map, maps[i].tile_dir, req->xmlname, maps[i].prj, req->x, req->y, req->z);
+                    enum protoCmd ret = render(maps[i].map, maps[i].tile_dir, req->xmlname, maps[i].prj, req->x, req->y, req->z);
 #ifdef HTCP_EXPIRE_CACHE
                     cache_expire(maps[i].htcpsock,maps[i].host, maps[i].xmluri, req->x,req->y,req->z);
-#endif
 #endif
                     send_response(item, ret);
+#endif
                     break;
-               }
+                }
             }
             if (i == iMaxConfigs){
                 syslog(LOG_ERR, "No map for: %s", req->xmlname);
             }
-        } else {
-            sleep(1); // TODO: Use an event to indicate there are new requests
         }
     }
     return NULL;
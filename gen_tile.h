@@ -1,6 +1,8 @@
 #ifndef GEN_TILE_H
 #define GEN_TILE_H
 
+#include <stdint.h>
+#include <time.h>
 #include "protocol.h"
 
 #ifdef __cplusplus
@@ -10,29 +12,53 @@ extern "C" {
 #define HTCP_EXPIRE_CACHE 1
 #define HTCP_EXPIRE_CACHE_PORT "4827"
 
-enum queueEnum {queueRequest, queueRequestPrio, queueRequestBulk, queueDirty, queueRender,  queueDuplicate};
+enum queueEnum {queueRequest, queueRequestPrio, queueRequestBulk, queueDirty, queueRender,  queueDuplicate, queueDropped};
+
+struct item;
+
+/* Items a client connection is waiting for a response to. Kept in the
+ * connection, so that forgetting about a closed connection only has to visit
+ * its own requests.
+ */
+struct waiter_list {
+    struct item *head;
+};
 
 struct item {
     struct item *next;
     struct item *prev;
     struct protocol req;
+    int id; // Request id of protocol version 3 clients
     int mx, my;
+    uint64_t key; // Hash of xmlname, z, mx and my used by the request index
     int fd;
+    struct item *waitNext; // Next item on the waiter list of the client connection
+    struct item **waitPrev; // Pointer to this item in the waiter list, NULL if not on one
     struct item *duplicates;
     enum queueEnum inQueue;
-};
-
-struct item_idx {
-    struct item_idx *next;
-    struct item *item;
+    enum queueEnum originatedQueue; // Queue the item was in before rendering started
+    int retries; // Number of times the item has been put back into its queue
+    int skipped; // Number of times a render thread preferred a later item
+    int popularity; // Sum of the popularity hints of all requests for the metatile
+    time_t queued; // When the request was queued
+    unsigned long seq; // Order in which requests were queued
+    long dirtyKey; // Position in the dirty queue, lower keys are rendered first
+    int heapIdx; // Index in the dirty queue heap
+    int timeout; // Milliseconds the client waits for the response, 0 for no limit
+    long deadline; // When the client stops waiting (CLOCK_MONOTONIC, in ms), 0 for never
+    long received; // When the request was queued (CLOCK_MONOTONIC, in ms)
+    long estimate; // Expected render time in milliseconds
 };
 
 //int render(Map &m, int x, int y, int z, const char *filename);
 void *render_thread(void *);
 struct item *fetch_request(void);
+struct item *fetch_request_affinity(const char *xmlname, int z);
 void delete_request(struct item *item);
+void requeue_request(struct item *item);
 void send_response(struct item *item, enum protoCmd);
 void render_init(const char *plugins_dir, const char* font_dir, int font_recurse);
+void pipeline_init(int encode_threads, int store_threads);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,226 @@
+/* Cache of hot tiles in shared memory, see hot_cache.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hot_cache.h"
+
+struct hot_cache_slot {
+    uint32_t seq; // Odd while the slot is written
+    uint32_t referenced; // CLOCK bit, set by hits and cleared by the hand
+    int64_t checked;
+    int64_t mtime;
+    int32_t x, y, z;
+    int32_t size; // 0 if the slot is empty
+    char xmlname[XMLCONFIG_MAX];
+    unsigned char hash[META_HASH_SIZE];
+    unsigned char data[]; // tile_max bytes
+};
+
+struct hot_cache {
+    uint32_t magic;
+    uint32_t sets;
+    uint32_t slot_size;
+    int32_t tile_max;
+    size_t slots_offset;
+    uint32_t hands[]; // CLOCK hand of each set, the slots follow
+};
+
+#define ALIGN64(n) (((n) + 63) & ~(size_t)63)
+
+static struct hot_cache_slot *slot_at(struct hot_cache *cache, uint32_t set, int way)
+{
+    size_t i = (size_t)set * HOT_CACHE_WAYS + way;
+
+    return (struct hot_cache_slot *)((char *)cache + cache->slots_offset + i * cache->slot_size);
+}
+
+/* FNV-1a over the style and the coordinates */
+static uint32_t set_of(struct hot_cache *cache, const char *xmlname, int x, int y, int z)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int32_t xyz[3] = { x, y, z };
+    const unsigned char *p;
+    size_t i;
+
+    for (p = (const unsigned char *)xmlname; *p; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    for (i = 0, p = (const unsigned char *)xyz; i < sizeof(xyz); i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return (uint32_t)(h % cache->sets);
+}
+
+/* Only meaningful if the sequence number of the slot stays the same */
+static int slot_matches(const struct hot_cache_slot *slot, const char *xmlname, int x, int y, int z)
+{
+    return (slot->size > 0) && (slot->x == x) && (slot->y == y) && (slot->z == z) &&
+           !strncmp(slot->xmlname, xmlname, XMLCONFIG_MAX);
+}
+
+struct hot_cache *hot_cache_init(void *mem, size_t len, int tile_max)
+{
+    struct hot_cache *cache = (struct hot_cache *)mem;
+    size_t slot_size = ALIGN64(sizeof(struct hot_cache_slot) + tile_max);
+    size_t sets;
+    uint32_t set;
+    int way;
+
+    if ((tile_max <= 0) || (len < ALIGN64(sizeof(struct hot_cache))))
+        return NULL;
+    // Each set needs its ways and a hand, plus up to 64 bytes of alignment
+    sets = (len - ALIGN64(sizeof(struct hot_cache)) - 64) / (HOT_CACHE_WAYS * slot_size + sizeof(uint32_t));
+    if (sets == 0)
+        return NULL;
+    if (sets > UINT32_MAX / HOT_CACHE_WAYS)
+        sets = UINT32_MAX / HOT_CACHE_WAYS;
+
+    cache->sets = (uint32_t)sets;
+    cache->slot_size = (uint32_t)slot_size;
+    cache->tile_max = tile_max;
+    cache->slots_offset = ALIGN64(sizeof(struct hot_cache) + sets * sizeof(uint32_t));
+    // Only the headers of the slots, so that the pages of the tiles are not
+    // touched before they are used
+    for (set = 0; set < cache->sets; set++) {
+        cache->hands[set] = 0;
+        for (way = 0; way < HOT_CACHE_WAYS; way++) {
+            struct hot_cache_slot *slot = slot_at(cache, set, way);
+            slot->seq = 0;
+            slot->referenced = 0;
+            slot->size = 0;
+        }
+    }
+    __atomic_store_n(&cache->magic, HOT_CACHE_MAGIC, __ATOMIC_RELEASE);
+    return cache;
+}
+
+int hot_cache_slots(struct hot_cache *cache)
+{
+    return (int)(cache->sets * HOT_CACHE_WAYS);
+}
+
+int hot_cache_get(struct hot_cache *cache, const char *xmlname, int x, int y, int z,
+                  struct hot_cache_entry *entry, unsigned char *data, int len)
+{
+    uint32_t set = set_of(cache, xmlname, x, y, z);
+
+    for (int way = 0; way < HOT_CACHE_WAYS; way++) {
+        struct hot_cache_slot *slot = slot_at(cache, set, way);
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int size;
+
+        if ((seq & 1) || !slot_matches(slot, xmlname, x, y, z))
+            continue;
+        // Whatever a concurrent writer left in size, never copy beyond data
+        size = slot->size;
+        if ((size <= 0) || (size > cache->tile_max) || (size > len))
+            continue;
+        memcpy(data, slot->data, size);
+        entry->mtime = slot->mtime;
+        entry->checked = __atomic_load_n(&slot->checked, __ATOMIC_RELAXED);
+        memcpy(entry->hash, slot->hash, META_HASH_SIZE);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        // Only write if needed, hot slots are read by every process
+        if (!__atomic_load_n(&slot->referenced, __ATOMIC_RELAXED))
+            __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+        return size;
+    }
+    return -1;
+}
+
+/* Look for a slot holding the tile. Returns 1 if it holds it with mtime and
+ * hash, otherwise 0 and *victim is set to the slot holding an older version.
+ */
+static int find_current(struct hot_cache *cache, uint32_t set, const char *xmlname, int x, int y, int z,
+                        int64_t mtime, const unsigned char hash[META_HASH_SIZE], int64_t now,
+                        struct hot_cache_slot **victim)
+{
+    for (int way = 0; way < HOT_CACHE_WAYS; way++) {
+        struct hot_cache_slot *slot = slot_at(cache, set, way);
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int current;
+
+        if ((seq & 1) || !slot_matches(slot, xmlname, x, y, z))
+            continue;
+        current = (slot->mtime == mtime) && !memcmp(slot->hash, hash, META_HASH_SIZE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (current) {
+            // Should the slot have been reused since, its new tile was
+            // checked just now anyway
+            __atomic_store_n(&slot->checked, now, __ATOMIC_RELAXED);
+            return 1;
+        }
+        *victim = slot;
+        return 0;
+    }
+    return 0;
+}
+
+/* Advance the CLOCK hand of set to the first slot not hit since the hand
+ * last passed it, giving a second chance to those which were.
+ */
+static struct hot_cache_slot *clock_victim(struct hot_cache *cache, uint32_t set)
+{
+    uint32_t hand = __atomic_load_n(&cache->hands[set], __ATOMIC_RELAXED) % HOT_CACHE_WAYS;
+    struct hot_cache_slot *victim = NULL;
+
+    for (int n = 0; n < 2 * HOT_CACHE_WAYS; n++) {
+        struct hot_cache_slot *slot = slot_at(cache, set, hand);
+
+        hand = (hand + 1) % HOT_CACHE_WAYS;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) & 1)
+            continue;
+        if ((slot->size > 0) && __atomic_load_n(&slot->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        victim = slot;
+        break;
+    }
+    __atomic_store_n(&cache->hands[set], hand, __ATOMIC_RELAXED);
+    return victim;
+}
+
+void hot_cache_put(struct hot_cache *cache, const char *xmlname, int x, int y, int z,
+                   int64_t mtime, int64_t now, const unsigned char hash[META_HASH_SIZE],
+                   const unsigned char *data, int len)
+{
+    uint32_t set = set_of(cache, xmlname, x, y, z);
+    struct hot_cache_slot *slot = NULL;
+    uint32_t seq;
+
+    if ((len <= 0) || (len > cache->tile_max))
+        return;
+    if (find_current(cache, set, xmlname, x, y, z, mtime, hash, now, &slot))
+        return;
+    if (!slot)
+        slot = clock_victim(cache, set);
+    if (!slot)
+        return;
+
+    // Claim the slot. If another writer has it, the tile is cached next time.
+    // A writer which dies here leaves the slot odd, lost for the cache.
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->x = x;
+    slot->y = y;
+    slot->z = z;
+    strncpy(slot->xmlname, xmlname, XMLCONFIG_MAX - 1);
+    slot->xmlname[XMLCONFIG_MAX - 1] = 0;
+    slot->mtime = mtime;
+    __atomic_store_n(&slot->checked, now, __ATOMIC_RELAXED);
+    memcpy(slot->hash, hash, META_HASH_SIZE);
+    memcpy(slot->data, data, len);
+    slot->size = len;
+    __atomic_store_n(&slot->referenced, 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
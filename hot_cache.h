@@ -0,0 +1,70 @@
+#ifndef HOT_CACHE_H
+#define HOT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "render_config.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cache of hot tiles in memory shared by all Apache children
+ *
+ * The cache is a set associative array of fixed size slots, each holding one
+ * tile of at most tile_max bytes together with the mtime of the metatile it
+ * was read from and its hash. A tile can only live in the HOT_CACHE_WAYS
+ * slots of the set its key hashes to, and the set evicts with CLOCK: a hit
+ * sets the referenced bit of a slot, the hand of the set clears the bits it
+ * passes and replaces the first slot which has not been hit since.
+ *
+ * Readers take no lock. Each slot has a sequence number which is odd while
+ * the slot is written, a reader copies the tile out and only uses the copy if
+ * the sequence number was even and unchanged throughout. Writers claim a slot
+ * by making its sequence number odd with a compare and swap, and simply skip
+ * the insert if another writer got there first.
+ *
+ * Times are in microseconds, as apr_time_t.
+ */
+
+#define HOT_CACHE_MAGIC 0x686f7463
+#define HOT_CACHE_WAYS 8
+
+struct hot_cache;
+
+/* A tile found in the cache */
+struct hot_cache_entry {
+    int64_t mtime; // Of the metatile the tile was read from
+    int64_t checked; // When mtime was last compared with the metatile
+    unsigned char hash[META_HASH_SIZE];
+};
+
+/* Lay out a cache for tiles of up to tile_max bytes in the len bytes at mem.
+ * Returns NULL if not even one set fits.
+ */
+struct hot_cache *hot_cache_init(void *mem, size_t len, int tile_max);
+
+/* Number of tiles the cache can hold */
+int hot_cache_slots(struct hot_cache *cache);
+
+/* Copy the tile into data, which has room for len bytes. Returns the size of
+ * the tile, or -1 if it is not cached.
+ */
+int hot_cache_get(struct hot_cache *cache, const char *xmlname, int x, int y, int z,
+                  struct hot_cache_entry *entry, unsigned char *data, int len);
+
+/* Store the tile, read from a metatile with mtime at time now. If the tile is
+ * cached with that mtime already, only its checked time is updated.
+ */
+void hot_cache_put(struct hot_cache *cache, const char *xmlname, int x, int y, int z,
+                   int64_t mtime, int64_t now, const unsigned char hash[META_HASH_SIZE],
+                   const unsigned char *data, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,314 @@
+/* OpenMetrics exposition of the renderd statistics, see metrics.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "render_config.h"
+#include "daemon.h"
+#include "request_queue.h"
+#include "render_stats.h"
+#include "slave.h"
+#include "metrics.h"
+
+// Time a client gets to send its request and to read the response, in seconds
+#define METRICS_IO_TIMEOUT 5
+#define METRICS_REQUEST_MAX 4096
+
+static int metricsFd = -1;
+
+static void family(FILE *f, const char *name, const char *type, const char *help)
+{
+    fprintf(f, "# TYPE %s %s\n", name, type);
+    fprintf(f, "# HELP %s %s\n", name, help);
+}
+
+/* Histograms are recorded in ms with STATS_HIST_SUB buckets per power of 2.
+ * Only the powers of 2 are exported, which is plenty for quantiles and keeps
+ * the number of series down.
+ */
+static void histogram(FILE *f, const char *name, const char *labels, const struct stats_histogram *hist)
+{
+    long count = stats_histogram_count(hist);
+    long cumulative = 0;
+    int i;
+
+    if (count == 0)
+        return;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        cumulative += hist->count[i];
+        if ((i + 1) % STATS_HIST_SUB == 0) {
+            // All values in ms are integers, so those up to the bucket's max
+            // are below the next full ms
+            fprintf(f, "%s_bucket{%s,le=\"%g\"} %li\n", name, labels,
+                    (stats_histogram_bucket_max(i) + 1) / 1000.0, cumulative);
+        }
+    }
+    fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %li\n", name, labels, count);
+    fprintf(f, "%s_count{%s} %li\n", name, labels, count);
+    fprintf(f, "%s_sum{%s} %g\n", name, labels, hist->sum / 1000.0);
+}
+
+void metrics_write(FILE *f)
+{
+    static const char *queueNames[STATS_QUEUES] = { "request", "priority", "bulk", "dirty" };
+    static const char *phaseNames[STATS_PHASES] = { "draw", "encode", "write", "expire" };
+    stats_struct stats;
+    struct render_stats *rStats;
+    struct slave_stats slaves[MAX_SLAVES];
+    int lengths[STATS_QUEUES];
+    long rendered[STATS_QUEUES];
+    char labels[XMLCONFIG_MAX + 64];
+    int numSlaves;
+    int i, p;
+
+    bzero(&stats, sizeof(stats));
+    request_queue_counters(&stats, &lengths[queueRequest], &lengths[queueRequestPrio],
+            &lengths[queueRequestBulk], &lengths[queueDirty]);
+    rendered[queueRequest] = stats.noReqRender;
+    rendered[queueRequestPrio] = stats.noReqPrioRender;
+    rendered[queueRequestBulk] = stats.noReqBulkRender;
+    rendered[queueDirty] = stats.noDirtyRender;
+
+    family(f, "renderd_queue_length", "gauge", "Requests waiting in each queue.");
+    for (i = 0; i < STATS_QUEUES; i++)
+        fprintf(f, "renderd_queue_length{queue=\"%s\"} %i\n", queueNames[i], lengths[i]);
+    family(f, "renderd_rendered", "counter", "Metatiles rendered by the queue they were taken from.");
+    for (i = 0; i < STATS_QUEUES; i++)
+        fprintf(f, "renderd_rendered_total{queue=\"%s\"} %li\n", queueNames[i], rendered[i]);
+    family(f, "renderd_requests_rejected", "counter", "Requests not rendered for the client that asked for them.");
+    fprintf(f, "renderd_requests_rejected_total{reason=\"dropped\"} %li\n", stats.noReqDroped);
+    fprintf(f, "renderd_requests_rejected_total{reason=\"busy\"} %li\n", stats.noReqBusy);
+    fprintf(f, "renderd_requests_rejected_total{reason=\"expired\"} %li\n", stats.noReqExpired);
+
+    family(f, "renderd_item_pool_size", "gauge", "Request items allocated.");
+    fprintf(f, "renderd_item_pool_size %li\n", stats.itemPoolSize);
+    family(f, "renderd_item_pool_free", "gauge", "Request items in the global free list.");
+    fprintf(f, "renderd_item_pool_free %li\n", stats.itemPoolFree);
+    family(f, "renderd_item_pool_refills", "counter", "Thread caches refilled from the global free list.");
+    fprintf(f, "renderd_item_pool_refills_total %li\n", stats.itemPoolRefills);
+    family(f, "renderd_item_pool_flushes", "counter", "Thread caches flushed to the global free list.");
+    fprintf(f, "renderd_item_pool_flushes_total %li\n", stats.itemPoolFlushes);
+    family(f, "renderd_item_pool_growths", "counter", "Slabs of request items allocated after startup.");
+    fprintf(f, "renderd_item_pool_growths_total %li\n", stats.itemPoolGrowths);
+
+    rStats = (struct render_stats *)malloc(sizeof(struct render_stats));
+    if (rStats) {
+        render_stats_collect(rStats);
+
+        family(f, "renderd_zoom_wait_seconds", "histogram", "Time metatiles waited in the queues, by zoom level.");
+        for (i = 0; i <= MAX_ZOOM; i++) {
+            snprintf(labels, sizeof(labels), "zoom=\"%i\"", i);
+            histogram(f, "renderd_zoom_wait_seconds", labels, &rStats->waitZoom[i]);
+        }
+        family(f, "renderd_zoom_render_seconds", "histogram", "Time to render a metatile, by zoom level.");
+        for (i = 0; i <= MAX_ZOOM; i++) {
+            snprintf(labels, sizeof(labels), "zoom=\"%i\"", i);
+            histogram(f, "renderd_zoom_render_seconds", labels, &rStats->renderZoom[i]);
+        }
+        family(f, "renderd_queue_wait_seconds", "histogram", "Time metatiles waited, by the queue they were taken from.");
+        for (i = 0; i < STATS_QUEUES; i++) {
+            snprintf(labels, sizeof(labels), "queue=\"%s\"", queueNames[i]);
+            histogram(f, "renderd_queue_wait_seconds", labels, &rStats->waitQueue[i]);
+        }
+        family(f, "renderd_queue_render_seconds", "histogram", "Time to render a metatile, by the queue it was taken from.");
+        for (i = 0; i < STATS_QUEUES; i++) {
+            snprintf(labels, sizeof(labels), "queue=\"%s\"", queueNames[i]);
+            histogram(f, "renderd_queue_render_seconds", labels, &rStats->renderQueue[i]);
+        }
+        family(f, "renderd_style_wait_seconds", "histogram", "Time metatiles waited in the queues, by style.");
+        for (i = 0; render_stats_style(i); i++) {
+            snprintf(labels, sizeof(labels), "style=\"%s\"", render_stats_style(i));
+            histogram(f, "renderd_style_wait_seconds", labels, &rStats->waitStyle[i]);
+        }
+        family(f, "renderd_style_render_seconds", "histogram", "Time to render a metatile, by style.");
+        for (i = 0; render_stats_style(i); i++) {
+            snprintf(labels, sizeof(labels), "style=\"%s\"", render_stats_style(i));
+            histogram(f, "renderd_style_render_seconds", labels, &rStats->renderStyle[i]);
+        }
+        family(f, "renderd_zoom_phase_seconds", "histogram", "Time spent in each phase of rendering a metatile, by zoom level.");
+        for (p = 0; p < STATS_PHASES; p++) {
+            for (i = 0; i <= MAX_ZOOM; i++) {
+                snprintf(labels, sizeof(labels), "phase=\"%s\",zoom=\"%i\"", phaseNames[p], i);
+                histogram(f, "renderd_zoom_phase_seconds", labels, &rStats->phaseZoom[p][i]);
+            }
+        }
+        family(f, "renderd_style_phase_seconds", "histogram", "Time spent in each phase of rendering a metatile, by style.");
+        for (p = 0; p < STATS_PHASES; p++) {
+            for (i = 0; render_stats_style(i); i++) {
+                snprintf(labels, sizeof(labels), "phase=\"%s\",style=\"%s\"", phaseNames[p], render_stats_style(i));
+                histogram(f, "renderd_style_phase_seconds", labels, &rStats->phaseStyle[p][i]);
+            }
+        }
+        free(rStats);
+    }
+
+    numSlaves = slaves_get_stats(slaves, MAX_SLAVES);
+    if (numSlaves > 0) {
+        family(f, "renderd_slave_up", "gauge", "1 if the render slave is healthy, 0 while it is backed off.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_up{slave=\"%i\"} %i\n", slaves[i].id, slaves[i].up);
+        family(f, "renderd_slave_window", "gauge", "Requests the render slave allows to be outstanding.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_window{slave=\"%i\"} %i\n", slaves[i].id, slaves[i].window);
+        family(f, "renderd_slave_outstanding", "gauge", "Requests outstanding on the render slave.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_outstanding{slave=\"%i\"} %i\n", slaves[i].id, slaves[i].outstanding);
+        family(f, "renderd_slave_dispatched", "counter", "Requests sent to the render slave.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_dispatched_total{slave=\"%i\"} %li\n", slaves[i].id, slaves[i].dispatched);
+        family(f, "renderd_slave_failed", "counter", "Failures of the render slave.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_failed_total{slave=\"%i\"} %li\n", slaves[i].id, slaves[i].failed);
+        family(f, "renderd_slave_timeouts", "counter", "Requests the render slave did not answer in time.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_timeouts_total{slave=\"%i\"} %li\n", slaves[i].id, slaves[i].timeouts);
+        family(f, "renderd_slave_requeued", "counter", "Requests put back into the queue after the render slave failed.");
+        for (i = 0; i < numSlaves; i++)
+            fprintf(f, "renderd_slave_requeued_total{slave=\"%i\"} %li\n", slaves[i].id, slaves[i].requeued);
+    }
+
+    fprintf(f, "# EOF\n");
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+static void send_status(int fd, const char *status)
+{
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s\n",
+            status, strlen(status) + 1, status);
+
+    send_all(fd, buf, len);
+}
+
+static void serve_client(int fd)
+{
+    char request[METRICS_REQUEST_MAX];
+    size_t len = 0;
+    char *body = NULL;
+    size_t bodyLen = 0;
+    char header[256];
+    FILE *f;
+
+    // Read the request line and headers, we do not care about a body
+    while (len < sizeof(request) - 1) {
+        ssize_t ret = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        len += ret;
+        request[len] = 0;
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+    request[len] = 0;
+
+    if (strncmp(request, "GET ", 4)) {
+        send_status(fd, "405 Method Not Allowed");
+        return;
+    }
+    if (strncmp(request + 4, "/metrics ", 9) && strncmp(request + 4, "/metrics?", 9)) {
+        send_status(fd, "404 Not Found");
+        return;
+    }
+
+    f = open_memstream(&body, &bodyLen);
+    if (!f) {
+        send_status(fd, "500 Internal Server Error");
+        return;
+    }
+    metrics_write(f);
+    fclose(f);
+
+    len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", bodyLen);
+    if (send_all(fd, header, len))
+        send_all(fd, body, bodyLen);
+    free(body);
+}
+
+static void *metrics_thread(void *arg)
+{
+    while (1) {
+        struct timeval tv;
+        int fd = accept(metricsFd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno != EINTR)
+                syslog(LOG_WARNING, "Accepting metrics connection failed: %s", strerror(errno));
+            continue;
+        }
+        // Scrapes are served one after another, a slow client must not
+        // hold up the next one for long
+        tv.tv_sec = METRICS_IO_TIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start(const char *host, int port)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+    int fd;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        syslog(LOG_ERR, "Bad metrics address %s", host);
+        return 0;
+    }
+
+    fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failed to create metrics socket: %s", strerror(errno));
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 16) < 0)) {
+        syslog(LOG_ERR, "Failed to listen for metrics on %s:%i: %s", host, port, strerror(errno));
+        close(fd);
+        return 0;
+    }
+
+    metricsFd = fd;
+    if (pthread_create(&thread, NULL, metrics_thread, NULL)) {
+        syslog(LOG_ERR, "Could not create metrics thread");
+        close(fd);
+        metricsFd = -1;
+        return 0;
+    }
+    syslog(LOG_INFO, "Serving metrics on http://%s:%i/metrics", host, port);
+    return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* OpenMetrics exposition of the renderd statistics
+ *
+ * An optional HTTP listener serves queue lengths, request counters, render
+ * latency histograms, item pool counters and the health of render slaves
+ * in the OpenMetrics text format at /metrics. Everything is computed when
+ * it is scraped, without taking the queue lock.
+ */
+
+/* Start the listener on host:port in its own thread. Returns 0 on failure. */
+int metrics_start(const char *host, int port);
+
+/* Write all metrics in OpenMetrics text format to f */
+void metrics_write(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,8 +3,10 @@
 #include "apr_thread_proc.h"    /* for RLIMIT stuff */
 #include "apr_optional.h"
 #include "apr_buckets.h"
+#include "apr_portable.h"
 #include "apr_lib.h"
 #include "apr_poll.h"
+#include "apr_reslist.h"
 
 #define APR_WANT_STRFUNC
 #define APR_WANT_MEMFUNC
@@ -23,7 +25,6 @@
 #include "ap_mpm.h"
 #include "mod_core.h"
 #include "mod_cgi.h"
-#include "util_md5.h"
 
 module AP_MODULE_DECLARE_DATA tile_module;
 
@@ -34,6 +35,7 @@ module AP_MODULE_DECLARE_DATA tile_module;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -48,6 +50,8 @@ module AP_MODULE_DECLARE_DATA tile_module;
 #include "render_config.h"
 #include "store.h"
 #include "dir_utils.h"
+#include "shm_ring.h"
+#include "hot_cache.h"
 #include "mod_tile.h"
 
 
@@ -61,8 +65,11 @@ module AP_MODULE_DECLARE_DATA tile_module;
 
 apr_shm_t *stats_shm;
 apr_shm_t *delaypool_shm;
+apr_shm_t *hotcache_shm;
 char *shmfilename;
 char *shmfilename_delaypool;
+char *shmfilename_hotcache;
+struct hot_cache *hotCache;
 apr_global_mutex_t *stats_mutex;
 apr_global_mutex_t *delay_mutex;
 char *mutexfilename;
@@ -91,45 +98,321 @@ static int error_message(request_rec *r, const char *format, ...)
     return OK;
 }
 
-int socket_init(request_rec *r)
+static int socket_connect(const char *socket_name)
 {
-    ap_conf_vector_t *sconf = r->server->module_config;
-    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
-
     int fd;
     struct sockaddr_un addr;
 
     fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "failed to create unix socket");
+    if (fd < 0)
         return FD_INVALID;
-    }
 
     bzero(&addr, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, scfg->renderd_socket_name, sizeof(addr.sun_path));
+    strncpy(addr.sun_path, socket_name, sizeof(addr.sun_path));
 
     if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "socket connect failed for: %s", scfg->renderd_socket_name);
         close(fd);
         return FD_INVALID;
     }
     return fd;
 }
 
-int request_tile(request_rec *r, struct protocol *cmd, int renderImmediately)
+/* The shared memory ring of renderd, if one is configured and renderd is
+ * running. A restarted renderd creates a new ring, the old one stays mapped
+ * as connections of other threads may still be using it.
+ */
+static struct shm_ring *renderd_ring(tile_server_conf *scfg)
 {
-    int fd;
+    struct shm_ring *ring = scfg->renderd_ring;
+    struct shm_ring *fresh;
+
+    if (!scfg->renderd_shm_ring[0])
+        return NULL;
+    if (ring && shm_ring_alive(ring))
+        return ring;
+
+    fresh = shm_ring_attach(scfg->renderd_shm_ring);
+    if (!fresh)
+        return NULL;
+    if (!__sync_bool_compare_and_swap(&scfg->renderd_ring, ring, fresh)) {
+        // Another thread got there first
+        shm_ring_detach(fresh);
+        return scfg->renderd_ring;
+    }
+    return fresh;
+}
+
+/* Connections to renderd are kept open in a per child pool and reused for
+ * subsequent requests. Every request on a connection gets a new protocol v3
+ * request id, so that a late response to a request which timed out earlier
+ * can be told apart from the one we are waiting for. A client slot of the
+ * shared memory ring is preferred over a socket, ids then start at the
+ * generation of the slot so that they differ from those of its previous owner.
+ */
+static apr_status_t renderd_conn_construct(void **resource, void *params, apr_pool_t *pool)
+{
+    tile_server_conf *scfg = (tile_server_conf *)params;
+    renderd_conn *conn;
+    struct shm_ring *ring;
+    uint32_t generation;
+
+    // Not allocated from pool, which lives as long as the whole list
+    conn = malloc(sizeof(renderd_conn));
+    if (!conn)
+        return APR_ENOMEM;
+    conn->fd = FD_INVALID;
+    conn->ring = NULL;
+    conn->slot = -1;
+    conn->next_id = 0;
+
+    ring = renderd_ring(scfg);
+    if (ring) {
+        conn->slot = shm_ring_claim(ring, &generation);
+        if (conn->slot >= 0) {
+            conn->ring = ring;
+            conn->next_id = (int)((generation & 0x7fff) << 16);
+            *resource = conn;
+            return APR_SUCCESS;
+        }
+    }
+
+    conn->fd = socket_connect(scfg->renderd_socket_name);
+    if (conn->fd == FD_INVALID) {
+        apr_status_t rv = errno ? errno : APR_EGENERAL;
+        free(conn);
+        return rv;
+    }
+    *resource = conn;
+    return APR_SUCCESS;
+}
+
+static apr_status_t renderd_conn_destruct(void *resource, void *params, apr_pool_t *pool)
+{
+    renderd_conn *conn = (renderd_conn *)resource;
+
+    if (conn->ring)
+        shm_ring_release(conn->ring, conn->slot);
+    else
+        close(conn->fd);
+    free(conn);
+    return APR_SUCCESS;
+}
+
+static renderd_conn *renderd_conn_acquire(request_rec *r)
+{
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+    renderd_conn *conn;
+    apr_status_t rv;
+
+    if (!scfg->renderd_conns)
+        return NULL;
+
+    rv = apr_reslist_acquire(scfg->renderd_conns, (void **)&conn);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, "socket connect failed for: %s", scfg->renderd_socket_name);
+        return NULL;
+    }
+    return conn;
+}
+
+/* Return the connection to the pool, or close it if it can not be used for
+ * further requests
+ */
+static void renderd_conn_release(request_rec *r, renderd_conn *conn, int broken)
+{
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+
+    if (broken)
+        apr_reslist_invalidate(scfg->renderd_conns, conn);
+    else
+        apr_reslist_release(scfg->renderd_conns, conn);
+}
+
+/* Receive len bytes, giving up at deadline. Returns the number of bytes
+ * received, which is less than len on timeout, or -1 on error.
+ */
+static int recv_until(int fd, void *buf, size_t len, apr_time_t deadline)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        struct pollfd pfd;
+        apr_time_t now = apr_time_now();
+        int ret;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, (deadline > now) ? (int)((deadline - now) / 1000) : 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+
+        ret = recv(fd, (char *)buf + got, len - got, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            return -1;
+        got += ret;
+    }
+    return got;
+}
+
+/* Is resp the response to the request with id for cmd? If so, done is set to
+ * the result for request_tile().
+ */
+static int match_response(request_rec *r, const struct protocol *cmd, int id, const struct protocol_v3_item *resp, int *done, int *retry_after)
+{
+    if (resp->id != id || cmd->x != resp->x || cmd->y != resp->y || cmd->z != resp->z || strcmp(cmd->xmlname, resp->xmlname)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+           "Response does not match request: xml(%s,%s) z(%d,%d) x(%d,%d) y(%d,%d)", cmd->xmlname,
+           resp->xmlname, cmd->z, resp->z, cmd->x, resp->x, cmd->y, resp->y);
+        return 0;
+    }
+    *done = (resp->cmd == cmdDone);
+    if (resp->cmd == cmdBusy) {
+        // renderd can not make it in time, no point in waiting
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Renderer busy, retry after %d ms", resp->retry_after);
+        *retry_after = resp->retry_after;
+        *done = -1;
+    }
+    return 1;
+}
+
+/* Wait for the response to the request with id on fd. Returns 1 once it
+ * arrived, with done set as by match_response(), 0 if deadline passed, which
+ * leaves the connection usable, or -1 if the connection is broken.
+ */
+static int recv_response(request_rec *r, int fd, const struct protocol *cmd, int id, apr_time_t deadline, int *done, int *retry_after)
+{
+    int found = 0;
+
+    while (!found) {
+        struct protocol_v3 hdr;
+        int i, ret;
+
+        ret = recv_until(fd, &hdr, sizeof(hdr), deadline);
+        if (ret == 0)
+            return 0;
+        if ((ret != sizeof(hdr)) || (hdr.ver != PROTO_VER_BATCH) || (hdr.count < 0) || (hdr.count > PROTO_BATCH_MAX) ||
+                (hdr.itemsize < (int)PROTO_ITEM_MIN) || (hdr.itemsize > PROTO_ITEM_MAX))
+            return -1;
+
+        for (i = 0; i < hdr.count; i++) {
+            char buf[PROTO_ITEM_MAX];
+            struct protocol_v3_item resp;
+
+            if (recv_until(fd, buf, hdr.itemsize, deadline) != hdr.itemsize)
+                return -1;
+            bzero(&resp, sizeof(resp));
+            memcpy(&resp, buf, (hdr.itemsize < (int)sizeof(resp)) ? hdr.itemsize : sizeof(resp));
+            resp.xmlname[XMLCONFIG_MAX - 1] = 0;
+
+            if (match_response(r, cmd, id, &resp, done, retry_after))
+                found = 1;
+        }
+    }
+    return 1;
+}
+
+/* request_tile() through the shared memory ring, no system calls are needed
+ * unless we have to wait for renderd. Returns RING_FULL if the request did
+ * not fit into the ring, the caller then sends it through the socket.
+ */
+#define RING_FULL (-2)
+
+static int request_tile_ring(request_rec *r, renderd_conn *conn, struct protocol *cmd, struct protocol_v3_item *item,
+                             int renderImmediately, int timeout, int *retry_after)
+{
+    apr_time_t deadline;
+    int done = 0;
+
+    item->id = conn->next_id++;
+    if (!shm_ring_submit(conn->ring, conn->slot, item)) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Request ring of renderer is full, using its socket");
+        renderd_conn_release(r, conn, 0);
+        return RING_FULL;
+    }
+
+    if (!renderImmediately) {
+        renderd_conn_release(r, conn, 0);
+        return 0;
+    }
+
+    deadline = apr_time_now() + apr_time_from_sec(timeout);
+    while (1) {
+        struct protocol_v3_item resp;
+        apr_time_t now = apr_time_now();
+
+        if ((now >= deadline) || !shm_ring_response(conn->ring, conn->slot, &resp, (int)((deadline - now) / 1000))) {
+            // Give up the slot if renderd is gone, the next one goes to its new ring
+            renderd_conn_release(r, conn, !shm_ring_alive(conn->ring));
+            return 0;
+        }
+        resp.xmlname[XMLCONFIG_MAX - 1] = 0;
+        if (match_response(r, cmd, item->id, &resp, &done, retry_after))
+            break;
+    }
+
+    renderd_conn_release(r, conn, 0);
+    return done;
+}
+
+/* request_tile() through a socket connection of its own, for when the ring
+ * is full. The pooled connections are all ring slots then.
+ */
+static int request_tile_socket(request_rec *r, struct protocol *cmd, const void *frame, size_t len, int id,
+                               int renderImmediately, int timeout, int *retry_after)
+{
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+    int fd, ret = 0;
+    int done = 0;
+
+    fd = socket_connect(scfg->renderd_socket_name);
+    if (fd == FD_INVALID) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, errno, r, "socket connect failed for: %s", scfg->renderd_socket_name);
+        return 0;
+    }
+    if (send(fd, frame, len, 0) == (ssize_t)len && renderImmediately)
+        ret = recv_response(r, fd, cmd, id, apr_time_now() + apr_time_from_sec(timeout), &done, retry_after);
+    close(fd);
+    return (ret > 0) ? done : 0;
+}
+
+/* Ask renderd to render the tile. With renderImmediately set, wait until it
+ * is done and return 1 if it got rendered, 0 if not, or -1 if renderd was too
+ * busy to render it in time. retry_after is then set to the number of
+ * milliseconds renderd asks us to wait before trying again.
+ */
+int request_tile(request_rec *r, struct protocol *cmd, int renderImmediately, int *retry_after)
+{
+    renderd_conn *conn;
+    int timeout;
     int ret = 0;
     int retry = 1;
-    struct protocol resp;
+    int done = 0;
+    struct {
+        struct protocol_v3 hdr;
+        struct protocol_v3_item item;
+    } frame;
 
     ap_conf_vector_t *sconf = r->server->module_config;
     tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
 
-    fd = socket_init(r);
+    conn = renderd_conn_acquire(r);
 
-    if (fd == FD_INVALID) {
+    if (!conn) {
         ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Failed to connect to renderer");
         return 0;
     }
@@ -142,58 +425,58 @@ int request_tile(request_rec *r, struct protocol *cmd, int renderImmediately)
     case 2: { cmd->cmd = cmdRenderPrio; break;}
     }
 
+    bzero(&frame, sizeof(frame));
+    frame.hdr.ver = PROTO_VER_BATCH;
+    frame.hdr.count = 1;
+    frame.hdr.itemsize = sizeof(frame.item);
+    frame.item.cmd = cmd->cmd;
+    frame.item.x = cmd->x;
+    frame.item.y = cmd->y;
+    frame.item.z = cmd->z;
+    strcpy(frame.item.xmlname, cmd->xmlname);
+    // Tiles explicitly marked dirty are not wanted by any viewer yet
+    frame.item.popularity = strcmp(r->handler, "tile_dirty") ? 1 : 0;
+    timeout = (renderImmediately > 1) ? scfg->request_timeout_priority : scfg->request_timeout;
+    if (renderImmediately)
+        frame.item.timeout = timeout * 1000;
+
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Requesting xml(%s) z(%d) x(%d) y(%d)", cmd->xmlname, cmd->z, cmd->x, cmd->y);
-    do {
-        ret = send(fd, cmd, sizeof(struct protocol), 0);
+    if (conn->ring) {
+        ret = request_tile_ring(r, conn, cmd, &frame.item, renderImmediately, timeout, retry_after);
+        if (ret != RING_FULL)
+            return ret;
+        return request_tile_socket(r, cmd, &frame, sizeof(frame), frame.item.id, renderImmediately, timeout, retry_after);
+    }
 
-        if (ret == sizeof(struct protocol))
+    while (1) {
+        int err;
+
+        frame.item.id = conn->next_id++;
+        ret = send(conn->fd, &frame, sizeof(frame), 0);
+
+        if (ret == sizeof(frame))
             break;
 
-        close(fd);
-        if (errno != EPIPE)
+        // The connection may have gone stale, e.g. renderd got restarted
+        err = errno;
+        renderd_conn_release(r, conn, 1);
+        if ((err != EPIPE && err != ECONNRESET) || !retry--)
             return 0;
 
-        fd = socket_init(r);
-        if (fd == FD_INVALID)
+        conn = renderd_conn_acquire(r);
+        if (!conn)
             return 0;
-    } while (retry--);
-
-    if (renderImmediately) {
-        struct timeval tv = {(renderImmediately > 1?scfg->request_timeout_priority:scfg->request_timeout), 0 };
-        fd_set rx;
-        int s;
-
-        while (1) {
-            FD_ZERO(&rx);
-            FD_SET(fd, &rx);
-            s = select(fd+1, &rx, NULL, NULL, &tv);
-            if (s == 1) {
-                bzero(&resp, sizeof(struct protocol));
-                ret = recv(fd, &resp, sizeof(struct protocol), 0);
-                if (ret != sizeof(struct protocol)) {
-                    //perror("recv error");
-                    break;
-                }
+    }
 
-                if (cmd->x == resp.x && cmd->y == resp.y && cmd->z == resp.z && !strcmp(cmd->xmlname, resp.xmlname)) {
-                    close(fd);
-                    if (resp.cmd == cmdDone)
-                        return 1;
-                    else
-                        return 0;
-                } else {
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                       "Response does not match request: xml(%s,%s) z(%d,%d) x(%d,%d) y(%d,%d)", cmd->xmlname,
-                       resp.xmlname, cmd->z, resp.z, cmd->x, resp.x, cmd->y, resp.y);
-                }
-            } else {
-                break;
-            }
-        }
+    if (!renderImmediately) {
+        renderd_conn_release(r, conn, 0);
+        return 0;
     }
 
-    close(fd);
-    return 0;
+    // On timeout between responses the connection is still usable
+    ret = recv_response(r, conn->fd, cmd, frame.item.id, apr_time_now() + apr_time_from_sec(timeout), &done, retry_after);
+    renderd_conn_release(r, conn, ret < 0);
+    return (ret > 0) ? done : 0;
 }
 
 static apr_time_t getPlanetTime(request_rec *r)
@@ -476,6 +759,10 @@ static int incFreshCounter(int status, request_rec *r) {
             stats->noOldRender++;
             break;
         }
+        case FRESH_HOT: {
+            stats->noHotCache++;
+            break;
+        }
         }
         apr_global_mutex_unlock(stats_mutex);
         /* Swallowing the result because what are we going to do with it at
@@ -599,16 +886,77 @@ static int tile_handler_dirty(request_rec *r)
     if (cmd == NULL)
         return DECLINED;
 
-    request_tile(r, cmd, 0);
+    request_tile(r, cmd, 0, NULL);
     return error_message(r, "Tile submitted for rendering\n");
 }
 
+/* A tile copied out of the hot tile cache for this request */
+struct hot_tile {
+    struct hot_cache_entry entry;
+    int len;
+    unsigned char *data;
+};
+
+#define HOT_TILE_KEY "mod_tile_hot_tile"
+
+/* Look up the tile of cmd in the hot tile cache. A tile found is remembered
+ * for tile_handler_serve, which uses it if the metatile still has its mtime.
+ */
+static struct hot_tile *hot_tile_lookup(request_rec *r, tile_server_conf *scfg, struct protocol *cmd)
+{
+    unsigned char buf[HOT_CACHE_TILE_MAX];
+    struct hot_tile *hot;
+    struct hot_cache_entry entry;
+    int len;
+
+    if (!hotCache || (cmd->z > scfg->hotCacheMaxZoom))
+        return NULL;
+    len = hot_cache_get(hotCache, cmd->xmlname, cmd->x, cmd->y, cmd->z, &entry, buf, sizeof(buf));
+    if (len <= 0)
+        return NULL;
+    hot = apr_palloc(r->pool, sizeof(struct hot_tile));
+    hot->entry = entry;
+    hot->len = len;
+    hot->data = apr_pmemdup(r->pool, buf, len);
+    apr_pool_userdata_setn(hot, HOT_TILE_KEY, NULL, r->pool);
+    return hot;
+}
+
+static struct hot_tile *hot_tile_get(request_rec *r)
+{
+    void *hot = NULL;
+
+    apr_pool_userdata_get(&hot, HOT_TILE_KEY, r->pool);
+    return (struct hot_tile *)hot;
+}
+
+#ifdef METATILE
+/* Whether the metatile of cmd can be served from. One rendered with another
+ * metatile size than the style has now, or with a damaged header, can not.
+ */
+static int tile_meta_usable(struct protocol *cmd)
+{
+    struct tile_view view;
+    int len;
+
+    // Mapped metatiles are cached, so this is cheap and the mapping is still
+    // there when the tile is served
+    len = tile_view_get(cmd->xmlname, cmd->x, cmd->y, cmd->z, &view);
+    if (len >= 0)
+        tile_view_release(&view);
+    return (len != -4) && (len != -6);
+}
+#endif
+
 static int tile_storage_hook(request_rec *r)
 {
 //    char abs_path[PATH_MAX];
     int avg;
     int renderPrio = 0;
+    int rendered, retry_after = 0;
     enum tileState state;
+    struct hot_tile *hot;
+    int trusted = 0;
 
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "tile_storage_hook: handler(%s), uri(%s), filename(%s), path_info(%s)",
                   r->handler, r->uri, r->filename, r->path_info);
@@ -640,12 +988,27 @@ should already be done
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "abs_path(%s)", abs_path);
     r->filename = apr_pstrdup(r->pool, abs_path);
 */
-    avg = get_load_avg(r);
-    state = tile_state(r, cmd);
-
     ap_conf_vector_t *sconf = r->server->module_config;
     tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
 
+    // A hot tile whose metatile was stat()ed recently enough is taken to be
+    // unchanged, so that it is served without any file system access
+    hot = hot_tile_lookup(r, scfg, cmd);
+    if (hot && (r->request_time < hot->entry.checked + apr_time_from_sec(HOT_CACHE_RECHECK))) {
+        r->finfo.mtime = hot->entry.mtime;
+        r->finfo.valid |= APR_FINFO_MTIME;
+        trusted = 1;
+    }
+    state = tile_state(r, cmd);
+#ifdef METATILE
+    // Only stat()ed so far, a metatile that can not be used is as good as
+    // missing and gets rendered again
+    if ((state != tileMissing) && !trusted && !tile_meta_usable(cmd)) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Metatile %s can not be used, rendering it again", r->filename);
+        state = tileMissing;
+    }
+#endif
+
 	if (scfg->enableTileThrottling && !delay_allowed(r, state)) {
 		if (!incRespCounter(HTTP_SERVICE_UNAVAILABLE, r, cmd)) {
                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
@@ -656,16 +1019,18 @@ should already be done
 
     switch (state) {
         case tileCurrent:
-            if (!incFreshCounter(FRESH, r)) {
+            if (!incFreshCounter(trusted ? FRESH_HOT : FRESH, r)) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                     "Failed to increase fresh stats counter");
             }
             return OK;
             break;
         case tileOld:
+            // Only asked for here, it reads /proc on every call
+            avg = get_load_avg(r);
             if (avg > scfg->max_load_old) {
                // Too much load to render it now, mark dirty but return old tile
-               request_tile(r, cmd, 0);
+               request_tile(r, cmd, 0, NULL);
                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Load larger max_load_old (%d). Mark dirty and deliver from cache.", scfg->max_load_old);
                if (!incFreshCounter(OLD, r)) {
                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
@@ -676,8 +1041,9 @@ should already be done
             renderPrio = 1;
             break;
         case tileMissing:
+            avg = get_load_avg(r);
             if (avg > scfg->max_load_missing) {
-               request_tile(r, cmd, 0);
+               request_tile(r, cmd, 0, NULL);
                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Load larger max_load_missing (%d). Return HTTP_NOT_FOUND.", scfg->max_load_missing);
                if (!incRespCounter(HTTP_NOT_FOUND, r, cmd)) {
                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
@@ -689,7 +1055,8 @@ should already be done
             break;
     }
 
-    if (request_tile(r, cmd, renderPrio)) {
+    rendered = request_tile(r, cmd, renderPrio, &retry_after);
+    if (rendered > 0) {
         ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Update file info abs_path(%s)", r->filename);
         // Need to update fileinfo for new rendered tile
         apr_stat(&r->finfo, r->filename, APR_FINFO_MIN, r->pool);
@@ -707,6 +1074,15 @@ should already be done
         }
         return OK;
     }
+    if (rendered < 0) {
+        // The tile is rendered in the background, tell the client when to come back
+        apr_table_setn(r->err_headers_out, "Retry-After", apr_psprintf(r->pool, "%d", (retry_after + 999) / 1000));
+        if (!incRespCounter(HTTP_SERVICE_UNAVAILABLE, r, cmd)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                    "Failed to increase response stats counter");
+        }
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
     if (!incRespCounter(HTTP_NOT_FOUND, r, cmd)) {
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                 "Failed to increase response stats counter");
@@ -774,6 +1150,7 @@ static int tile_handler_mod_stats(request_rec *r)
     ap_rprintf(r, "NoOldCache: %li\n", local_stats.noOldCache);
     ap_rprintf(r, "NoFreshRender: %li\n", local_stats.noFreshRender);
     ap_rprintf(r, "NoOldRender: %li\n", local_stats.noOldRender);
+    ap_rprintf(r, "NoHotCache: %li\n", local_stats.noHotCache);
 	for (i = 0; i <= MAX_ZOOM; i++) {
 		ap_rprintf(r, "NoRespZoom%02i: %li\n", i, local_stats.noRespZoom[i]);
 	}
@@ -783,11 +1160,100 @@ static int tile_handler_mod_stats(request_rec *r)
     return OK;
 }
 
-static int tile_handler_serve(request_rec *r)
+#ifdef METATILE
+static apr_status_t tile_view_cleanup(void *data)
+{
+    tile_view_release((struct tile_view *)data);
+    return APR_SUCCESS;
+}
+#endif
+
+/* Point *data at the tile of cmd, which stays valid for the lifetime of the
+ * request. Tiles in metatiles are served straight from the mapped metatile
+ * and *view is set, otherwise it is NULL.
+ */
+static int tile_data(request_rec *r, struct protocol *cmd, const unsigned char **data, struct tile_view **view)
 {
-    const int tile_max = MAX_SIZE;
     unsigned char *buf;
     int len;
+
+    *view = NULL;
+#ifdef METATILE
+    struct tile_view *v = apr_pcalloc(r->pool, sizeof(struct tile_view));
+
+    len = tile_view_get(cmd->xmlname, cmd->x, cmd->y, cmd->z, v);
+    if (len >= 0) {
+        apr_pool_cleanup_register(r->pool, v, tile_view_cleanup, apr_pool_cleanup_null);
+        *data = v->data;
+        *view = v;
+        return len;
+    }
+#endif
+    // A tile in a file of its own
+    buf = malloc(MAX_SIZE);
+    if (!buf)
+        return -1;
+    len = read_from_file(cmd->xmlname, cmd->x, cmd->y, cmd->z, buf, MAX_SIZE);
+    if (len > 0)
+        *data = apr_pmemdup(r->pool, buf, len);
+    free(buf);
+    return len;
+}
+
+/* Add the tile of view to bb as a range of its metatile file, which Apache
+ * can send with sendfile() straight from the page cache. Returns 0 if the
+ * metatile has been replaced since it was mapped.
+ */
+static int tile_file_bucket(request_rec *r, struct tile_view *view, apr_bucket_brigade *bb)
+{
+    apr_file_t *file;
+    apr_os_file_t fd;
+
+    if (apr_file_open(&file, view->path, APR_READ | APR_SENDFILE_ENABLED, APR_OS_DEFAULT, r->pool) != APR_SUCCESS)
+        return 0;
+    if ((apr_os_file_get(&fd, file) != APR_SUCCESS) || !tile_view_same_file(view, fd)) {
+        apr_file_close(file);
+        return 0;
+    }
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_file_create(file, view->offset, view->size, r->pool, bb->bucket_alloc));
+    return 1;
+}
+
+/* Hash of a tile, the one stored in its metatile or else one of its data */
+static const unsigned char *tile_data_hash(request_rec *r, struct tile_view *view, const unsigned char *data, int len)
+{
+    unsigned char *hash;
+
+    if (view && view->hash)
+        return view->hash;
+    hash = apr_palloc(r->pool, META_HASH_SIZE);
+    tile_hash(data, len, hash);
+    return hash;
+}
+
+/* ETag of a tile from its hash. If a tile is re-rendered and produces the
+ * same output then caches can continue to use their copy.
+ */
+static const char *tile_etag(request_rec *r, const unsigned char *hash)
+{
+    char *etag = apr_palloc(r->pool, 2 * META_HASH_SIZE + 3);
+    int i;
+
+    etag[0] = '"';
+    for (i = 0; i < META_HASH_SIZE; i++)
+        sprintf(etag + 1 + 2 * i, "%02x", hash[i]);
+    strcpy(etag + 1 + 2 * META_HASH_SIZE, "\"");
+    return etag;
+}
+
+static int tile_handler_serve(request_rec *r)
+{
+    const unsigned char *data;
+    const unsigned char *hash = NULL;
+    struct tile_view *view = NULL;
+    struct hot_tile *hot;
+    apr_bucket_brigade *bb;
+    int len;
     apr_status_t errstatus;
 
     if(strcmp(r->handler, "tile_serve"))
@@ -805,44 +1271,50 @@ static int tile_handler_serve(request_rec *r)
 
     ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "tile_handler_serve: xml(%s) z(%d) x(%d) y(%d)", cmd->xmlname, cmd->z, cmd->x, cmd->y);
 
-    // FIXME: It is a waste to do the malloc + read if we are fulfilling a HEAD or returning a 304.
-    buf = malloc(tile_max);
-    if (!buf) {
-        if (!incRespCounter(HTTP_INTERNAL_SERVER_ERROR, r, cmd)) {
-            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
-                    "Failed to increase response stats counter");
+    ap_conf_vector_t *sconf = r->server->module_config;
+    tile_server_conf *scfg = ap_get_module_config(sconf, &tile_module);
+
+    // A hot tile is served from the copy taken by tile_storage_hook, unless
+    // the metatile has changed since it was cached
+    hot = hot_tile_get(r);
+    if (hot && (hot->entry.mtime == r->finfo.mtime)) {
+        data = hot->data;
+        len = hot->len;
+        hash = hot->entry.hash;
+        // Compared with the metatile by tile_storage_hook, good for a while
+        if (r->request_time >= hot->entry.checked + apr_time_from_sec(HOT_CACHE_RECHECK))
+            hot_cache_put(hotCache, cmd->xmlname, cmd->x, cmd->y, cmd->z, r->finfo.mtime, r->request_time, hash, data, len);
+    } else {
+        // Tiles in metatiles are only mapped. With the hash from the metatile
+        // a HEAD or a 304 is answered from its header, without touching the tile.
+        len = tile_data(r, cmd, &data, &view);
+        if (len > 0) {
+            hash = tile_data_hash(r, view, data, len);
+            if (hotCache && (cmd->z <= scfg->hotCacheMaxZoom) && (r->finfo.valid & APR_FINFO_MTIME))
+                hot_cache_put(hotCache, cmd->xmlname, cmd->x, cmd->y, cmd->z, r->finfo.mtime, r->request_time, hash, data, len);
         }
-        return HTTP_INTERNAL_SERVER_ERROR;
     }
-
-    len = tile_read(cmd->xmlname, cmd->x, cmd->y, cmd->z, buf, tile_max);
     if (len > 0) {
-#if 0
-        // Set default Last-Modified and Etag headers
-        ap_update_mtime(r, r->finfo.mtime);
-        ap_set_last_modified(r);
-        ap_set_etag(r);
-#else
-        // Use MD5 hash as only cache attribute.
-        // If a tile is re-rendered and produces the same output
-        // then we can continue to use the previous cached copy
-        char *md5 = ap_md5_binary(r->pool, buf, len);
-        apr_table_setn(r->headers_out, "ETag",
-                        apr_psprintf(r->pool, "\"%s\"", md5));
-#endif
+        apr_table_setn(r->headers_out, "ETag", tile_etag(r, hash));
         ap_set_content_type(r, "image/png");
         ap_set_content_length(r, len);
         add_expiry(r, cmd);
         if ((errstatus = ap_meets_conditions(r)) != OK) {
-            free(buf);
             if (!incRespCounter(errstatus, r, cmd)) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                         "Failed to increase response stats counter");
             }
             return errstatus;
         } else {
-            ap_rwrite(buf, len, r);
-            free(buf);
+            if (!r->header_only) {
+                bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+                if (!view || !scfg->enableSendfile || !tile_file_bucket(r, view, bb)) {
+                    // Filters which hold on to the tile beyond this call copy it
+                    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create((const char *)data, len, bb->bucket_alloc));
+                }
+                APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+                ap_pass_brigade(r->output_filters, bb);
+            }
             if (!incRespCounter(errstatus, r, cmd)) {
                 ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
                         "Failed to increase response stats counter");
@@ -850,7 +1322,6 @@ static int tile_handler_serve(request_rec *r)
             return OK;
         }
     }
-    free(buf);
     //ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "len = %d", len);
     if (!incRespCounter(HTTP_NOT_FOUND, r, cmd)) {
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
@@ -954,6 +1425,7 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     stats_data *stats;
 	delaypool *delayp;
 	int i;
+    tile_server_conf *scfg = ap_get_module_config(s->module_config, &tile_module);
 
 
     /*
@@ -979,6 +1451,7 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
      */
     shmfilename = apr_psprintf(pconf, "/tmp/httpd_shm.%ld", (long int)getpid());
 	shmfilename_delaypool = apr_psprintf(pconf, "/tmp/httpd_shm_delay.%ld", (long int)getpid());
+    shmfilename_hotcache = apr_psprintf(pconf, "/tmp/httpd_shm_hot.%ld", (long int)getpid());
 
     /* Now create that segment */
     rs = apr_shm_create(&stats_shm, sizeof(stats_data),
@@ -1014,6 +1487,7 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     stats->noFreshRender = 0;
     stats->noOldCache = 0;
     stats->noOldRender = 0;
+    stats->noHotCache = 0;
 
 	delayp = (delaypool *)apr_shm_baseaddr_get(delaypool_shm);
 	
@@ -1030,6 +1504,30 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
 	}
 	/* TODO: need a way to initialise the delaypool whitelist */
 
+    /* The hot tile cache is sized by the main server */
+    hotCache = NULL;
+    if (scfg->hotCacheSize > 0) {
+        apr_size_t size = (apr_size_t)scfg->hotCacheSize * 1024 * 1024;
+
+        rs = apr_shm_create(&hotcache_shm, size, (const char *) shmfilename_hotcache, pconf);
+        if (rs != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rs, s,
+                         "Failed to create shared memory segment on file %s",
+                         shmfilename_hotcache);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        hotCache = hot_cache_init(apr_shm_baseaddr_get(hotcache_shm), apr_shm_size_get(hotcache_shm), HOT_CACHE_TILE_MAX);
+        if (!hotCache) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "ModTileHotCache of %d MB is too small for a single set of tiles",
+                         scfg->hotCacheSize);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "Hot tile cache of %d tiles up to zoom %d",
+                     hot_cache_slots(hotCache), scfg->hotCacheMaxZoom);
+    }
+
 
     /* Create global mutex */
 
@@ -1093,12 +1591,14 @@ static int mod_tile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
 
 /*
  * This routine gets called when a child inits. We use it to attach
- * to the shared memory segment, and reinitialize the mutex.
+ * to the shared memory segment, reinitialize the mutex and set up the
+ * connections to renderd.
  */
 
 static void mod_tile_child_init(apr_pool_t *p, server_rec *s)
 {
     apr_status_t rs;
+    int threads;
 
      /*
       * Re-open the mutex for the child. Note we're reusing
@@ -1115,6 +1615,24 @@ static void mod_tile_child_init(apr_pool_t *p, server_rec *s)
           * This routine doesn't return a status. */
          exit(1); /* Ugly, but what else? */
      }
+
+    /*
+     * Set up the pool of persistent connections to renderd. One connection
+     * per thread is enough, as a request only ever uses one at a time.
+     */
+    if (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS || threads < 1)
+        threads = 1;
+    for (; s; s = s->next) {
+        tile_server_conf *scfg = ap_get_module_config(s->module_config, &tile_module);
+
+        rs = apr_reslist_create(&scfg->renderd_conns, 0, threads, threads, 0,
+                                renderd_conn_construct, renderd_conn_destruct, scfg, p);
+        if (rs != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rs, s,
+                         "Failed to create renderd connection pool");
+            scfg->renderd_conns = NULL;
+        }
+    }
 }
 
 static void register_hooks(__attribute__((unused)) apr_pool_t *p)
@@ -1201,6 +1719,11 @@ static const char *load_tile_config(cmd_parms *cmd, void *mconfig, const char *c
                 result = add_tile_config(cmd, mconfig, value, xmlname);
                 if (result != NULL) return result;
             }
+#ifdef METATILE
+            if (!strcmp(key, "METATILE") && !metatile_size_parse(xmlname, value)) {
+                return "Invalid metatile sizes";
+            }
+#endif
         }
     }
     fclose(hini);
@@ -1267,6 +1790,14 @@ static const char *mod_tile_renderd_socket_name_config(cmd_parms *cmd, void *mco
     return NULL;
 }
 
+static const char *mod_tile_renderd_shm_ring_config(cmd_parms *cmd, void *mconfig, const char *renderd_shm_ring_string)
+{
+    tile_server_conf *scfg = ap_get_module_config(cmd->server->module_config, &tile_module);
+    strncpy(scfg->renderd_shm_ring, renderd_shm_ring_string, PATH_MAX-1);
+    scfg->renderd_shm_ring[PATH_MAX-1] = 0;
+    return NULL;
+}
+
 static const char *mod_tile_tile_dir_config(cmd_parms *cmd, void *mconfig, const char *tile_dir_string)
 {
     tile_server_conf *scfg = ap_get_module_config(cmd->server->module_config, &tile_module);
@@ -1384,6 +1915,34 @@ static const char *mod_tile_enable_stats(cmd_parms *cmd, void *mconfig, int enab
     return NULL;
 }
 
+static const char *mod_tile_enable_sendfile(cmd_parms *cmd, void *mconfig, int enableSendfile)
+{
+    tile_server_conf *scfg = ap_get_module_config(cmd->server->module_config, &tile_module);
+    scfg->enableSendfile = enableSendfile;
+    return NULL;
+}
+
+static const char *mod_tile_hot_cache_config(cmd_parms *cmd, void *mconfig, const char *size_string, const char *zoom_string)
+{
+    int size, zoom;
+    const char *err;
+
+    // There is only one cache, shared by all virtual hosts
+    if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL)
+        return err;
+
+    tile_server_conf *scfg = ap_get_module_config(cmd->server->module_config, &tile_module);
+    if ((sscanf(size_string, "%d", &size) != 1) || (size < 0)) {
+        return "ModTileHotCache needs two integer arguments, the size of the cache in MB and the highest zoom level cached";
+    }
+    if ((sscanf(zoom_string, "%d", &zoom) != 1) || (zoom < 0) || (zoom > MAX_ZOOM)) {
+        return "ModTileHotCache needs two integer arguments, the size of the cache in MB and the highest zoom level cached";
+    }
+    scfg->hotCacheSize = size;
+    scfg->hotCacheMaxZoom = zoom;
+    return NULL;
+}
+
 static const char *mod_tile_enable_throttling(cmd_parms *cmd, void *mconfig, int enableThrottling)
 {
     tile_server_conf *scfg = ap_get_module_config(cmd->server->module_config, &tile_module);
@@ -1456,6 +2015,9 @@ static void *create_tile_config(apr_pool_t *p, server_rec *s)
     scfg->cache_level_medium_zoom = 0;
     scfg->enableGlobalStats = 1;
 	scfg->enableTileThrottling = 0;
+    scfg->enableSendfile = 0;
+    scfg->hotCacheSize = 0;
+    scfg->hotCacheMaxZoom = 12;
 	scfg->delaypoolTileSize = AVAILABLE_TILE_BUCKET_SIZE;
 	scfg->delaypoolTileRate = RENDER_TOPUP_RATE;
 	scfg->delaypoolRenderSize = AVAILABLE_RENDER_BUCKET_SIZE;
@@ -1479,6 +2041,8 @@ static void *merge_tile_config(apr_pool_t *p, void *basev, void *overridesv)
     scfg->max_load_missing = scfg_over->max_load_missing;
     strncpy(scfg->renderd_socket_name, scfg_over->renderd_socket_name, PATH_MAX-1);
     scfg->renderd_socket_name[PATH_MAX-1] = 0;
+    strncpy(scfg->renderd_shm_ring, scfg_over->renderd_shm_ring, PATH_MAX-1);
+    scfg->renderd_shm_ring[PATH_MAX-1] = 0;
     strncpy(scfg->tile_dir, scfg_over->tile_dir, PATH_MAX-1);
     scfg->tile_dir[PATH_MAX-1] = 0;
     strncpy(scfg->cache_extended_hostname, scfg_over->cache_extended_hostname, PATH_MAX-1);
@@ -1494,6 +2058,9 @@ static void *merge_tile_config(apr_pool_t *p, void *basev, void *overridesv)
     scfg->cache_level_medium_zoom = scfg_over->cache_level_medium_zoom;
     scfg->enableGlobalStats = scfg_over->enableGlobalStats;
 	scfg->enableTileThrottling = scfg_over->enableTileThrottling;
+    scfg->enableSendfile = scfg_over->enableSendfile;
+    scfg->hotCacheSize = scfg_base->hotCacheSize;
+    scfg->hotCacheMaxZoom = scfg_base->hotCacheMaxZoom;
 	scfg->delaypoolTileSize = scfg_over->delaypoolTileSize;
 	scfg->delaypoolTileRate = scfg_over->delaypoolTileRate;
 	scfg->delaypoolRenderSize = scfg_over->delaypoolRenderSize;
@@ -1564,6 +2131,13 @@ static const command_rec tile_cmds[] =
         OR_OPTIONS,                      /* where available */
         "Set name of unix domain socket for connecting to rendering daemon"  /* directive description */
     ),
+    AP_INIT_TAKE1(
+        "ModTileRenderdShmRing",         /* directive name */
+        mod_tile_renderd_shm_ring_config, /* config action routine */
+        NULL,                            /* argument to include in call */
+        OR_OPTIONS,                      /* where available */
+        "Set name of the shared memory ring of a rendering daemon on the same host, preferred over the socket"  /* directive description */
+    ),
     AP_INIT_TAKE1(
         "ModTileTileDir",                /* directive name */
         mod_tile_tile_dir_config,        /* config action routine */
@@ -1633,6 +2207,20 @@ static const command_rec tile_cmds[] =
         NULL,                            /* argument to include in call */
         OR_OPTIONS,                      /* where available */
         "On Off - enable of keeping stats about what mod_tile is serving"  /* directive description */
+    ),
+    AP_INIT_FLAG(
+        "ModTileEnableSendfile",       /* directive name */
+        mod_tile_enable_sendfile,                 /* config action routine */
+        NULL,                            /* argument to include in call */
+        OR_OPTIONS,                      /* where available */
+        "On Off - serve tiles as ranges of their metatile file, so that Apache can use sendfile"  /* directive description */
+    ),
+    AP_INIT_TAKE2(
+        "ModTileHotCache",       /* directive name */
+        mod_tile_hot_cache_config,                 /* config action routine */
+        NULL,                            /* argument to include in call */
+        RSRC_CONF,                       /* where available */
+        "Set the size in MB of the hot tile cache shared by all children and the highest zoom level cached"  /* directive description */
     ),
 	AP_INIT_FLAG(
         "ModTileEnableTileThrottling",       /* directive name */
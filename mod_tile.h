@@ -19,6 +19,15 @@
 #define OLD 2
 #define FRESH_RENDER 3
 #define OLD_RENDER 4
+#define FRESH_HOT 5
+
+/* Largest tile kept in the hot tile cache */
+#define HOT_CACHE_TILE_MAX 32768
+/* Seconds a tile in the hot tile cache is served without comparing the
+ * mtime of its metatile, so a re-rendered tile may be served that long after
+ * it was replaced.
+ */
+#define HOT_CACHE_RECHECK 5
 
 /* Number of microseconds to camp out on the mutex */
 #define CAMPOUT 10
@@ -50,6 +59,7 @@ typedef struct stats_data {
     apr_uint64_t noFreshRender;
     apr_uint64_t noOldCache;
     apr_uint64_t noOldRender;
+    apr_uint64_t noHotCache;
 	apr_uint64_t noRespZoom[MAX_ZOOM + 1];
 } stats_data;
 
@@ -60,8 +70,21 @@ typedef struct {
     int maxzoom;
 } tile_config_rec;
 
+struct shm_ring;
+
+/* Persistent connection to renderd, either a socket or a client slot of the
+ * shared memory ring
+ */
+typedef struct {
+    int fd;
+    struct shm_ring *ring;
+    int slot;
+    int next_id;
+} renderd_conn;
+
 typedef struct {
     apr_array_header_t *configs;
+    apr_reslist_t *renderd_conns;
     int request_timeout;
 	int request_timeout_priority;
     int max_load_old;
@@ -75,12 +98,17 @@ typedef struct {
     int cache_level_medium_zoom;
     double cache_duration_last_modified_factor;
     char renderd_socket_name[PATH_MAX];
+    char renderd_shm_ring[PATH_MAX];
+    struct shm_ring *renderd_ring; // Attached in each child
     char tile_dir[PATH_MAX];
 	char cache_extended_hostname[PATH_MAX];
     int  cache_extended_duration;
     int mincachetime[MAX_ZOOM + 1];
     int enableGlobalStats;
 	int enableTileThrottling;
+    int enableSendfile;
+    int hotCacheSize; // In MB, 0 without a hot tile cache
+    int hotCacheMaxZoom;
 	int delaypoolTileSize;
 	long delaypoolTileRate;
 	int delaypoolRenderSize;
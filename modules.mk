@@ -2,10 +2,10 @@
 # this is used/needed by the APACHE2 build system
 #
 
-MOD_TILE = mod_tile dir_utils store
+MOD_TILE = mod_tile dir_utils store shm_ring hot_cache
 
 mod_tile.la: ${MOD_TILE:=.slo}
-	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version ${MOD_TILE:=.lo}
+	$(SH_LINK) -rpath $(libexecdir) -module -avoid-version ${MOD_TILE:=.lo} $(RT_LDFLAGS)
 
 DISTCLEAN_TARGETS = modules.mk
 
@@ -1,6 +1,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,13 +16,47 @@ extern "C" {
  *
  * A client may not bother waiting for a response if the render daemon is too slow
  * causing responses to get slightly out of step with requests.
+ *
+ * ver = 3;
+ *
+ * Batched requests. A frame is a struct protocol_v3 header followed by count
+ * items of itemsize bytes each. Every item carries an id chosen by the client,
+ * which is echoed in the response, so that a client can pipeline many requests
+ * over one connection. Each render command gets exactly one response
+ * {cmdDone, cmdNotDone} as soon as its metatile is finished, in any order and
+ * possibly batched with other responses. cmdDirty items get no response.
+ *
+ * cmdCredit(x = number of requests the client has outstanding), response:
+ * {cmdCredit(x = window, y = queue depth)}. Asks the render daemon how many
+ * requests the client may keep outstanding. This is used by a master renderd
+ * to keep its slaves busy without queueing too much work on any of them.
+ *
+ * timeout is the number of milliseconds the client is going to wait for a
+ * cmdRender or cmdRenderPrio, 0 if it waits for as long as it takes. If the
+ * render daemon does not expect to finish in time, it responds straight away
+ * with cmdBusy and sets retry_after to the number of milliseconds after which
+ * a new request is more likely to succeed. The metatile is then rendered in
+ * the background like a cmdDirty.
+ *
+ * popularity is a hint how much a tile is wanted, e.g. mod_tile sets it to 1
+ * for tiles requested by a viewer. The render daemon adds up the popularity of
+ * all requests for a tile waiting in the dirty queue, and renders popular
+ * tiles first.
+ *
+ * itemsize allows fields to be appended to struct protocol_v3_item later on:
+ * receivers ignore trailing bytes they do not know about and zero fill fields
+ * missing from shorter items. popularity, timeout and retry_after were appended
+ * this way, the original items end before popularity.
  */
 #define TILE_PATH_MAX (256)
 #define PROTO_VER (2)
+#define PROTO_VER_BATCH (3)
+#define PROTO_BATCH_MAX (1024)
+#define PROTO_ITEM_MAX (256)
 #define RENDER_SOCKET "/tmp/osm-renderd"
 #define XMLCONFIG_MAX 41
 
-enum protoCmd { cmdIgnore, cmdRender, cmdDirty, cmdDone, cmdNotDone, cmdRenderPrio, cmdRenderBulk };
+enum protoCmd { cmdIgnore, cmdRender, cmdDirty, cmdDone, cmdNotDone, cmdRenderPrio, cmdRenderBulk, cmdCredit, cmdBusy };
 
 struct protocol {
     int ver;
@@ -39,6 +75,27 @@ struct protocol_v1 {
     int z;
 };
 
+struct protocol_v3 {
+    int ver;
+    int count;
+    int itemsize;
+};
+
+struct protocol_v3_item {
+    int id;
+    enum protoCmd cmd;
+    int x;
+    int y;
+    int z;
+    char xmlname[XMLCONFIG_MAX];
+    int popularity;
+    int timeout;
+    int retry_after;
+};
+
+// Smallest item a version 3 sender may use
+#define PROTO_ITEM_MIN (offsetof(struct protocol_v3_item, popularity))
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,160 @@
+/* Micro benchmark for the renderd request queues
+ *
+ * Runs a number of producer threads feeding requests into the queue (as the
+ * main thread of renderd does) and consumer threads fetching and answering
+ * them (as the render threads do), without doing any actual rendering.
+ * Reports enqueue and dequeue throughput, and how long request_queue_add()
+ * takes, which is what the main thread of renderd waits for while the render
+ * threads hold the locks it needs. For a baseline, build it once more
+ * against the request_queue.c of the revision to compare with and run both
+ * with the same options on the same machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "render_config.h"
+#include "protocol.h"
+#include "gen_tile.h"
+#include "request_queue.h"
+
+static volatile int running = 1;
+static long enqueued, dequeued;
+static int duplicates = 10;
+
+// Latency of request_queue_add(), bucket i counts calls of less than 2^i ns
+#define LAT_BUCKETS (40)
+static long addLatency[LAT_BUCKETS];
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Upper bound in ns of the bucket below which fraction of the calls fall */
+static long latency_percentile(double fraction)
+{
+    long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+        total += addLatency[i];
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        sum += addLatency[i];
+        if (sum >= total * fraction)
+            break;
+    }
+    return 1L << i;
+}
+
+static void *producer(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    long n = 0;
+    int retry_after;
+    long latency[LAT_BUCKETS] = { 0 };
+
+    while (running) {
+        struct item *item = item_alloc();
+        int r = rand_r(&seed) % 100;
+
+        bzero(item, sizeof(*item));
+        item->req.ver = PROTO_VER;
+        item->req.cmd = (r < 40) ? cmdRender : (r < 60) ? cmdRenderPrio : (r < 80) ? cmdDirty : cmdRenderBulk;
+        item->req.z = 18;
+        // A small fraction of requests hits the same few metatiles
+        if (rand_r(&seed) % 100 < duplicates) {
+            item->req.x = rand_r(&seed) % 64;
+            item->req.y = rand_r(&seed) % 64;
+        } else {
+            item->req.x = rand_r(&seed) % (1 << 18);
+            item->req.y = rand_r(&seed) % (1 << 18);
+        }
+        strcpy(item->req.xmlname, XMLCONFIG_DEFAULT);
+        item->mx = item->req.x & ~(METATILE-1);
+        item->my = item->req.y & ~(METATILE-1);
+        item->fd = FD_INVALID;
+        long start = now_ns();
+        request_queue_add(item, NULL, &retry_after);
+        long ns = now_ns() - start;
+        int bucket = 0;
+        while ((bucket < LAT_BUCKETS - 1) && ((1L << bucket) <= ns))
+            bucket++;
+        latency[bucket]++;
+        n++;
+    }
+    __sync_fetch_and_add(&enqueued, n);
+    for (int i = 0; i < LAT_BUCKETS; i++)
+        __sync_fetch_and_add(&addLatency[i], latency[i]);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    while (1) {
+        struct item *item = fetch_request();
+        if (item) {
+            send_response(item, cmdDone);
+            __sync_fetch_and_add(&dequeued, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int producers = 1, consumers = 16, seconds = 5;
+    int c, i;
+    pthread_t thread;
+    struct timeval start, end;
+    double sec;
+    stats_struct stats;
+    int reqLen, reqPrioLen, reqBulkLen, dirtyLen;
+
+    while ((c = getopt(argc, argv, "p:c:t:d:h")) != -1) {
+        switch (c) {
+            case 'p': producers = atoi(optarg); break;
+            case 'c': consumers = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'd': duplicates = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: queue_speedtest [-p producers] [-c consumers] [-t seconds] [-d duplicate percentage]\n");
+                return 1;
+        }
+    }
+
+    request_queue_init();
+
+    printf("Running %d producer and %d consumer threads for %d seconds\n", producers, consumers, seconds);
+    for (i = 0; i < consumers; i++)
+        pthread_create(&thread, NULL, consumer, NULL);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < producers; i++)
+        pthread_create(&thread, NULL, producer, (void *)(long)(i + 1));
+
+    sleep(seconds);
+    running = 0;
+    // Give the producers a moment to add up their counts
+    usleep(100000);
+    gettimeofday(&end, NULL);
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    request_queue_stats(&stats, &reqLen, &reqPrioLen, &reqBulkLen, &dirtyLen);
+
+    printf("Enqueued %ld requests (%.0f/s)\n", enqueued, enqueued / sec);
+    printf("Dequeued %ld requests (%.0f/s)\n", dequeued, dequeued / sec);
+    printf("Dropped %ld requests\n", stats.noReqDroped);
+    printf("Enqueue latency below %ld ns (p50), %ld ns (p99), %ld ns (p99.9)\n",
+           latency_percentile(0.5), latency_percentile(0.99), latency_percentile(0.999));
+    return 0;
+}
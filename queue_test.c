@@ -0,0 +1,186 @@
+/* Regression test for the renderd request queues
+ *
+ * Render threads expire interactive requests whose clients have given up.
+ * A duplicate arriving for the same metatile while that happens must either
+ * be refused with NotDone straight away or be answered once the metatile is
+ * rendered, it must never be left waiting. Queues batches of requests which
+ * expire as soon as the render threads get to them, attaches live duplicates
+ * while the render threads are expiring them, and checks that every
+ * duplicate accepted by the queue gets its answer.
+ *
+ * The windows for such races are short, so where the linker supports it the
+ * test wraps pthread_mutex_unlock() to yield the CPU after every unlock. That
+ * way threads interleave at each lock even on a single CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include "render_config.h"
+#include "protocol.h"
+#include "gen_tile.h"
+#include "request_queue.h"
+
+#define BATCH (64)
+#define BLOCKER_Z (5)
+#define REPLY_TIMEOUT (2000)
+
+#ifdef QUEUE_TEST_YIELD
+#ifdef __cplusplus
+extern "C" {
+#endif
+int __real_pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+int __wrap_pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    int ret = __real_pthread_mutex_unlock(mutex);
+    sched_yield();
+    return ret;
+}
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+static int consumers = 4;
+static int released;
+
+static void *consumer(void *arg)
+{
+    while (1) {
+        struct item *item = fetch_request();
+        // Blockers keep the render threads busy until the batch of their
+        // round has expired
+        if (item->req.z == BLOCKER_Z) {
+            while (__atomic_load_n(&released, __ATOMIC_ACQUIRE) < item->id)
+                usleep(100);
+        }
+        send_response(item, cmdDone);
+    }
+    return NULL;
+}
+
+static void add_request(enum protoCmd cmd, int x, int z, int fd, int id, int timeout, struct waiter_list *waiters, enum protoCmd *ret)
+{
+    struct item *item = item_alloc();
+    int retry_after;
+    enum protoCmd r;
+
+    bzero(item, sizeof(*item));
+    item->req.ver = PROTO_VER_BATCH;
+    item->req.cmd = cmd;
+    item->req.x = x;
+    item->req.y = 0;
+    item->req.z = z;
+    strcpy(item->req.xmlname, XMLCONFIG_DEFAULT);
+    item->mx = item->req.x & ~(METATILE-1);
+    item->my = item->req.y & ~(METATILE-1);
+    item->fd = fd;
+    item->id = id;
+    item->timeout = timeout;
+    r = request_queue_add(item, waiters, &retry_after);
+    if (ret)
+        *ret = r;
+}
+
+/* Read answers from fd until all ids marked in pending have one, returns the
+ * number still missing after REPLY_TIMEOUT ms without any answer
+ */
+static int collect_replies(int fd, char *pending, int num)
+{
+    struct {
+        struct protocol_v3 hdr;
+        struct protocol_v3_item item;
+    } frame;
+    struct pollfd pfd;
+    int missing = 0;
+
+    for (int i = 0; i < BATCH; i++)
+        missing += pending[i];
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (missing && (poll(&pfd, 1, REPLY_TIMEOUT) > 0)) {
+        if (recv(fd, &frame, sizeof(frame), MSG_WAITALL) != sizeof(frame))
+            break;
+        if ((frame.item.id >= num) && (frame.item.id < num + BATCH) && pending[frame.item.id - num]) {
+            pending[frame.item.id - num] = 0;
+            missing--;
+        }
+    }
+    return missing;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = 200;
+    int expired[2], dupes[2];
+    struct waiter_list expiredWaiters, dupeWaiters;
+    char pending[BATCH];
+    long accepted = 0, refused = 0, lost = 0;
+    pthread_t thread;
+    int c, i, r;
+
+    while ((c = getopt(argc, argv, "r:c:h")) != -1) {
+        switch (c) {
+            case 'r': rounds = atoi(optarg); break;
+            case 'c': consumers = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: queue_test [-r rounds] [-c consumers]\n");
+                return 1;
+        }
+    }
+
+    if ((socketpair(AF_UNIX, SOCK_STREAM, 0, expired) < 0) || (socketpair(AF_UNIX, SOCK_STREAM, 0, dupes) < 0)) {
+        perror("socketpair");
+        return 1;
+    }
+    bzero(&expiredWaiters, sizeof(expiredWaiters));
+    bzero(&dupeWaiters, sizeof(dupeWaiters));
+
+    request_queue_init();
+    for (i = 0; i < consumers; i++)
+        pthread_create(&thread, NULL, consumer, NULL);
+
+    for (r = 0; r < rounds; r++) {
+        int base = r * BATCH;
+        char drain[4096];
+
+        // Occupy every render thread
+        for (i = 0; i < consumers; i++)
+            add_request(cmdRenderBulk, (base + i) * METATILE, BLOCKER_Z, FD_INVALID, r + 1, 0, NULL, NULL);
+        while (request_queue_waiting() > 0)
+            usleep(100);
+
+        // Requests whose clients give up after 1 ms, expired by the time
+        // the render threads get to them
+        for (i = 0; i < BATCH; i++)
+            add_request(cmdRender, (base + i) * METATILE, 18, expired[0], 0, 1, &expiredWaiters, NULL);
+        usleep(3000);
+
+        // Let the render threads go and attach live duplicates meanwhile
+        __atomic_store_n(&released, r + 1, __ATOMIC_RELEASE);
+        for (i = 0; i < BATCH; i++) {
+            enum protoCmd ret;
+            add_request(cmdRender, (base + i) * METATILE, 18, dupes[0], base + i, 0, &dupeWaiters, &ret);
+            pending[i] = (ret == cmdIgnore);
+            if (ret == cmdIgnore)
+                accepted++;
+            else
+                refused++;
+        }
+
+        lost += collect_replies(dupes[1], pending, base);
+        while (recv(expired[1], drain, sizeof(drain), MSG_DONTWAIT) > 0)
+            ;
+    }
+
+    printf("%ld duplicates answered, %ld refused, %ld never answered\n", accepted - lost, refused, lost);
+    return lost ? 1 : 0;
+}
@@ -37,6 +37,9 @@
 #define FONT_DIR "/usr/local/lib64/mapnik/fonts"
 #define FONT_RECURSE 0
 
+// Metatiles each process keeps mapped into memory for serving tiles
+#define META_MAP_CACHE 64
+
 // Typical interval between planet imports, used as basis for tile expiry times
 #define PLANET_INTERVAL (7 * 24 * 60 * 60)
 
@@ -52,33 +55,98 @@
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #define MAX(x,y) ((x)>(y)?(x):(y))
 
-#define MAX_CONNECTIONS (2048)
-
 // default for number of rendering threads
 #define NUM_THREADS (4)
 
+// default for number of threads encoding the tiles of rendered metatiles,
+// 0 to encode on the render threads
+#define NUM_ENCODE_THREADS (2)
+
+// default for number of threads writing metatiles to disk, 0 to write them
+// on the threads encoding them
+#define NUM_STORE_THREADS (2)
+
+// Colours of tiles of a single colour whose encoded tile renderd keeps
+#define UNIFORM_TILES_MAX (256)
+
+// Metatiles waiting to be encoded or written before the stage feeding them
+// has to wait
+#define PIPELINE_QUEUE_MAX (4)
+
 // Use this to enable meta-tiles which will render NxN tiles at once
 // Note: This should be a power of 2 (2, 4, 8, 16 ...)
+// It is the default, styles can use other sizes per zoom level in renderd.conf
 #define METATILE (8)
 //#undef METATILE
+// Largest metatile size a style can be configured with
+#define METATILE_MAX (16)
 
 //Fallback to standard tiles if meta tile doesn't exist
 //Legacy - not needed on new installs
 //#undef METATILEFALLBACK
 
 // Metatiles are much larger in size so we don't need big queues to handle large areas
+// HASHIDX_SIZE is the initial size of the pending request index. It must be a power of 2
+// and is grown automatically when the queues hold more requests.
 #ifdef METATILE
 #define QUEUE_MAX (64)
 #define REQ_LIMIT (32)
 #define DIRTY_LIMIT (1000)
-#define HASHIDX_SIZE 2213
+#define HASHIDX_SIZE 2048
 #else
 #define QUEUE_MAX (1024)
 #define REQ_LIMIT (512)
 #define DIRTY_LIMIT (10000)
-#define HASHIDX_SIZE 22123
+#define HASHIDX_SIZE 16384
 #endif
 
+// Render slaves: seconds to wait for a slave to render a metatile, and the
+// range of the exponential backoff after a slave failed (in seconds)
+#define SLAVE_RENDER_TIMEOUT (600)
+#define SLAVE_BACKOFF_MIN (1)
+#define SLAVE_BACKOFF_MAX (300)
+// Number of times a request is put back into the queue after a slave failed it
+#define SLAVE_MAX_RETRIES (3)
+// Connections the master keeps open to each slave, and the upper limit of the
+// number of requests outstanding on a slave. A slave grants a window of
+// SLAVE_WINDOW_FACTOR requests per render thread, minus the work other
+// clients have queued on it.
+#define SLAVE_CONNECTIONS (2)
+#define SLAVE_WINDOW_MAX (64)
+#define SLAVE_WINDOW_FACTOR (2)
+
+// Ordering of the dirty queue with dirty_policy=zoom (in seconds). A dirty
+// metatile is rendered as if it had been queued earlier by DIRTY_ZOOM_BONUS for
+// each zoom level it is below MAX_ZOOM (counting zoom levels up to
+// DIRTY_ZOOM_FULL_BONUS as that), and by DIRTY_POPULARITY_BONUS for each unit of
+// popularity up to DIRTY_POPULARITY_MAX.
+#define DIRTY_ZOOM_BONUS (60)
+#define DIRTY_ZOOM_FULL_BONUS (14)
+#define DIRTY_POPULARITY_BONUS (30)
+#define DIRTY_POPULARITY_MAX (100)
+
+// Admission control: a request with a timeout is answered with cmdBusy if its
+// expected wait exceeds the timeout. The wait is estimated from a moving average
+// of the render time per zoom level. Clients are asked to wait at least
+// ADMISSION_RETRY_MIN ms before trying again.
+#define ADMISSION_RETRY_MIN (250)
+
+// Render threads prefer requests for the style and zoom band (z / AFFINITY_ZOOM_BAND)
+// they rendered last, looking at up to AFFINITY_SCAN requests of the highest
+// priority queue that is not empty. The request at the front of the queue is
+// passed over at most AFFINITY_MAX_SKIPS times.
+#define AFFINITY_SCAN (16)
+#define AFFINITY_ZOOM_BAND (4)
+#define AFFINITY_MAX_SKIPS (8)
+
+// Shared memory transport between mod_tile and renderd on the same host: the
+// number of requests the request ring holds, the number of clients (pooled
+// mod_tile connections) that can attach, and the responses each client's
+// ring holds. Both sizes must be powers of 2.
+#define SHM_RING_SIZE (1024)
+#define SHM_RING_CLIENTS (1024)
+#define SHM_RING_RESPONSES (8)
+
 // Penalty for client making an invalid request (in seconds)
 #define CLIENT_PENALTY (3)
 
@@ -53,12 +53,13 @@
 #include "protocol.h"
 #include "render_config.h"
 #include "dir_utils.h"
+#include "render_submit_queue.h"
 
 // macros handling our tile marking arrays (these are essentially bit arrays
-// that have one bit for each tile on the repsective zoom level; since we only
-// need them for meta tile levels, even if someone were to render level 20,
-// we'd still only use 4^17 bits = 2 GB RAM (plus a little for the lower zoom 
-// levels) - this saves us the hassle of working with a tree structure.
+// that have one bit for each meta tile on the repsective zoom level; even if
+// someone were to render level 20 with 8x8 meta tiles, we'd still only use
+// 4^17 bits = 2 GB RAM (plus a little for the lower zoom levels) - this saves
+// us the hassle of working with a tree structure. x and y are in meta tiles.
 
 #define TILE_REQUESTED(z,x,y) \
    (tile_requested[z][((x)*twopow[z]+(y))/(8*sizeof(int))]>>(((x)*twopow[z]+(y))%(8*sizeof(int))))&0x01
@@ -78,14 +79,16 @@ int main(int argc, char **argv)
 // tile marking arrays
 unsigned int **tile_requested;
 
-// "two raised to the power of [...]" - don't trust pow() to be efficient 
-// for base 2
-unsigned long long twopow[18];
+// Meta tiles across each zoom level
+unsigned long long twopow[MAX_ZOOM + 1];
+
+// log2 of the meta tile size of each zoom level, the number of zoom levels
+// whose tiles share one meta tile
+int excess_zoomlevels[MAX_ZOOM + 1];
 
 static int minZoom = 0;
 static int maxZoom = MAX_ZOOM;
 static int verbose = 0;
-int work_complete;
 
 void display_rate(struct timeval start, struct timeval end, int num) 
 {
@@ -101,233 +104,16 @@ void display_rate(struct timeval start, struct timeval end, int num)
     fflush(NULL);
 }
 
-int process_loop(int fd, const char *mapname, int x, int y, int z)
-{
-    struct protocol cmd, rsp;
-    //struct pollfd fds[1];
-    int ret = 0;
-
-    bzero(&cmd, sizeof(cmd));
-
-    cmd.ver = 2;
-    cmd.cmd = cmdRenderBulk;
-    cmd.z = z;
-    cmd.x = x;
-    cmd.y = y;
-    strcpy(cmd.xmlname, mapname);
-
-    //printf("Sending request\n");
-    ret = send(fd, &cmd, sizeof(cmd), 0);
-    if (ret != sizeof(cmd)) {
-        perror("send error");
-    }
-
-    //printf("Waiting for response\n");
-    bzero(&rsp, sizeof(rsp));
-    ret = recv(fd, &rsp, sizeof(rsp), 0);
-    if (ret != sizeof(rsp)) 
-    {
-        perror("recv error");
-        return 0;
-    }
-    //printf("Got response\n");
-
-    if (rsp.cmd != cmdDone) 
-    {
-        printf("rendering failed, pausing\n");
-        sleep(10);
-    }
-
-    if (!ret)
-        perror("Socket send error");
-    return ret;
-}
-
-void process(int fd, const char *name)
-{
-    char xmlconfig[XMLCONFIG_MAX];
-    int x, y, z;
-
-    if (path_to_xyz(name, xmlconfig, &x, &y, &z))
-        return;
-
-    printf("Requesting xml(%s) x(%d) y(%d) z(%d)\n", xmlconfig, x, y, z);
-    process_loop(fd, xmlconfig, x, y, z);
-}
-
-#define QMAX 32
-
-pthread_mutex_t qLock;
-pthread_cond_t qCondNotEmpty;
-pthread_cond_t qCondNotFull;
-
-unsigned int qLen;
-struct qItem {
-    char *path;
-    struct qItem *next;
-};
-
-struct qItem *qHead, *qTail;
-
-char *fetch(void)
-{
-    // Fetch path to render from queue or NULL on work completion
-    // Must free() pointer after use
-    char *path;
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == 0) {
-        if (work_complete) {
-            pthread_mutex_unlock(&qLock);
-            return NULL;
-        }
-        pthread_cond_wait(&qCondNotEmpty, &qLock);
-    }
-
-    // Fetch item from queue
-    if (!qHead) {
-        fprintf(stderr, "Queue failure, null qHead with %d items in list\n", qLen);
-        exit(1);
-    }
-    path = qHead->path;
-
-    if (qHead == qTail) {
-        free(qHead);
-        qHead = NULL;
-        qTail = NULL;
-        qLen = 0;
-    } else {
-        struct qItem *e = qHead;
-        qHead = qHead->next;
-        free(e);
-        qLen--;
-        pthread_cond_signal(&qCondNotFull);
-    }
-
-    pthread_mutex_unlock(&qLock);
-    return path;
-}
-
-void enqueue(const char *path)
-{
-    // Add this path in the local render queue
-    struct qItem *e = malloc(sizeof(struct qItem));
-
-    e->path = strdup(path);
-    e->next = NULL;
-
-    if (!e->path) {
-        fprintf(stderr, "Malloc failure\n");
-        exit(1);
-    }
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == QMAX) 
-    {
-        pthread_cond_wait(&qCondNotFull, &qLock);
-    }
-
-    // Append item to end of queue
-    if (qTail)
-        qTail->next = e;
-    else
-        qHead = e;
-    qTail = e;
-    qLen++;
-    pthread_cond_signal(&qCondNotEmpty);
-
-    pthread_mutex_unlock(&qLock);
-}
-
-
-void *thread_main(void *arg)
-{
-    const char *spath = (const char *)arg;
-    int fd;
-    struct sockaddr_un addr;
-    char *tile;
-
-    fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        fprintf(stderr, "failed to create unix socket\n");
-        exit(2);
-    }
-
-    bzero(&addr, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, spath, sizeof(addr.sun_path));
-
-    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "socket connect failed for: %s\n", spath);
-        close(fd);
-        return NULL;
-    }
-
-    while(1) {
-        if (!(tile = fetch())) break;
-        process(fd, tile);
-        free(tile);
-    }
-
-    close(fd);
-
-    return NULL;
-}
-
-
-pthread_t *workers;
-
-void spawn_workers(int num, const char *spath)
-{
-    int i;
-
-    // Setup request queue
-    pthread_mutex_init(&qLock, NULL);
-    pthread_cond_init(&qCondNotEmpty, NULL);
-    pthread_cond_init(&qCondNotFull, NULL);
-
-    printf("Starting %d rendering threads\n", num);
-    workers = calloc(sizeof(pthread_t), num);
-    if (!workers) {
-        perror("Error allocating worker memory");
-        exit(1);
-    }
-    for(i=0; i<num; i++) {
-        if (pthread_create(&workers[i], NULL, thread_main, (void *)spath)) {
-            perror("Thread creation failed");
-            exit(1);
-        }
-    }
-}
-
-void finish_workers(int num)
-{
-    int i;
-
-    printf("Waiting for rendering threads to finish\n");
-    pthread_mutex_lock(&qLock);
-    work_complete = 1;
-    pthread_mutex_unlock(&qLock);
-    pthread_cond_broadcast(&qCondNotEmpty);
-
-    for(i=0; i<num; i++)
-        pthread_join(workers[i], NULL);
-    free(workers);
-    workers = NULL;
-}
-
-
 int main(int argc, char **argv)
 {
     char *spath = RENDER_SOCKET;
     char *mapname = XMLCONFIG_DEFAULT;
     char *tile_dir = HASH_PATH;
+    char *metatile = NULL;
     int x, y, z;
     char name[PATH_MAX];
     struct timeval start, end;
-    int num_render = 0, num_all = 0, num_read = 0, num_ignore = 0, num_unlink = 0, num_touch = 0;
+    int num_render = 0, num_tiles = 0, num_all = 0, num_read = 0, num_ignore = 0, num_unlink = 0, num_touch = 0;
     int c;
     int all=0;
     int numThreads = 1;
@@ -341,35 +127,6 @@ int main(int argc, char **argv)
     touchTime.actime = 946681200;
     touchTime.modtime = 946681200; // Jan 1 00:00 2000
 
-    // excess_zoomlevels is how many zoom levels at the large end
-    // we can ignore because their tiles will share one meta tile.
-    // with the default METATILE==8 this is 3.
-    int excess_zoomlevels = 0;
-    int mt = METATILE;
-    while (mt > 1)
-    {
-        excess_zoomlevels++;
-        mt >>= 1; 
-    }
-
-    // initialise arrays for tile markings
-
-    tile_requested = (unsigned int **) malloc((maxZoom - excess_zoomlevels + 1)*sizeof(unsigned int *));
-
-    for (i=0; i<=maxZoom - excess_zoomlevels; i++)
-    {
-        // initialize twopow array
-        twopow[i] = (i==0) ? 1 : twopow[i-1]*2;
-        unsigned long long fourpow=twopow[i]*twopow[i];
-        tile_requested[i] = (unsigned int *) malloc((fourpow / METATILE) + 1);
-        if (NULL == tile_requested[i])
-        {
-            fprintf(stderr, "not enough memory available.\n");
-            return 1;
-        }
-        memset(tile_requested[i], 0, (fourpow / METATILE) + 1);
-    }
-
     while (1) 
     {
         int option_index = 0;
@@ -383,12 +140,13 @@ int main(int argc, char **argv)
             {"touch-from", 1, 0, 'T'},
             {"tile-dir", 1, 0, 't'},
             {"map", 1, 0, 'm'},
+            {"metatile", 1, 0, 'M'},
             {"verbose", 0, 0, 'v'},
             {"help", 0, 0, 'h'},
             {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "hvz:Z:s:m:t:n:", long_options, &option_index);
+        c = getopt_long(argc, argv, "hvz:Z:s:m:M:t:n:", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -406,6 +164,9 @@ int main(int argc, char **argv)
             case 'm':   /* -m, --map */
                 mapname=strdup(optarg);
                 break;
+            case 'M':   /* -M, --metatile */
+                metatile=strdup(optarg);
+                break;
             case 'n':   /* -n, --num-threads */
                 numThreads=atoi(optarg);
                 if (numThreads <= 0) {
@@ -449,6 +210,7 @@ int main(int argc, char **argv)
             case 'h':   /* -h, --help */
                 fprintf(stderr, "Usage: render_expired [OPTION] ...\n");
                 fprintf(stderr, "  -m, --map=MAP        render tiles in this map (defaults to '" XMLCONFIG_DEFAULT "')\n");
+                fprintf(stderr, "  -M, --metatile=SIZES metatile sizes of the map, as METATILE in renderd.conf (defaults to %d)\n", METATILE);
                 fprintf(stderr, "  -s, --socket=SOCKET  unix domain socket name for contacting renderd\n");
                 fprintf(stderr, "  -n, --num-threads=N the number of parallel request threads (default 1)\n");
                 fprintf(stderr, "  -t, --tile-dir       tile cache directory (defaults to '" HASH_PATH "')\n");
@@ -476,7 +238,39 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if (minZoom < excess_zoomlevels) minZoom = excess_zoomlevels;
+    if (metatile && !metatile_size_parse(mapname, metatile)) {
+        fprintf(stderr, "Invalid metatile sizes: %s\n", metatile);
+        return 1;
+    }
+
+    // initialise arrays for tile markings. Zoom levels smaller than their
+    // meta tile are skipped.
+
+    tile_requested = (unsigned int **) calloc(maxZoom + 1, sizeof(unsigned int *));
+
+    for (i=0; i<=maxZoom; i++)
+    {
+        int mt = metatile_size(mapname, i);
+
+        excess_zoomlevels[i] = 0;
+        while (mt > 1)
+        {
+            excess_zoomlevels[i]++;
+            mt >>= 1;
+        }
+        if (i < minZoom || i < excess_zoomlevels[i])
+            continue;
+        twopow[i] = 1ULL << (i - excess_zoomlevels[i]);
+        unsigned long long fourpow=twopow[i]*twopow[i];
+        size_t len = (fourpow / (8 * sizeof(int)) + 1) * sizeof(int);
+        tile_requested[i] = (unsigned int *) malloc(len);
+        if (NULL == tile_requested[i])
+        {
+            fprintf(stderr, "not enough memory available.\n");
+            return 1;
+        }
+        memset(tile_requested[i], 0, len);
+    }
 
     fprintf(stderr, "Rendering client\n");
 
@@ -486,7 +280,7 @@ int main(int argc, char **argv)
         || (deleteFrom != -1 && minZoom < deleteFrom)
         || ( touchFrom == -1 && deleteFrom == -1) ) {
         // No need to spawn render threads, when we're not actually going to rerender tiles
-        spawn_workers(numThreads, spath);
+        spawn_workers(numThreads, spath, 0);
 	doRender = 1;
     }
 
@@ -519,13 +313,17 @@ int main(int argc, char **argv)
 
         for (; z>= minZoom; z--, x>>=1, y>>=1)
         {
+            int excess = excess_zoomlevels[z];
+
+            if (z < excess)
+                continue;
             printf("process: x=%d y=%d z=%d\n", x, y, z);
 
             // don't do anything if this tile was already requested.
             // renderd does keep a list internally to avoid enqueing the same tile
             // twice but in case it has already rendered the tile we don't want to
             // cause extra work.
-            if (TILE_REQUESTED(z - excess_zoomlevels,x>>excess_zoomlevels,y>>excess_zoomlevels)) 
+            if (TILE_REQUESTED(z,x>>excess,y>>excess)) 
             { 
                 printf("already requested\n"); 
                 break; 
@@ -534,7 +332,7 @@ int main(int argc, char **argv)
             // mark tile as requested. (do this even if, below, the tile is not 
             // actually requested due to not being present on disk, to avoid 
             // unnecessary later stat'ing).
-            SET_TILE_REQUESTED(z - excess_zoomlevels,x>>excess_zoomlevels,y>>excess_zoomlevels); 
+            SET_TILE_REQUESTED(z,x>>excess,y>>excess); 
 
             // commented out - seems to cause problems in MT environment, 
             // trying to write to already-closed file
@@ -566,6 +364,7 @@ int main(int argc, char **argv)
                     printf("render: %s\n", name);
                     enqueue(name);
                     num_render++;
+                    num_tiles += 1 << (2 * excess);
                 }
                 /*
                 if (!(num_render % 10)) 
@@ -575,7 +374,7 @@ int main(int argc, char **argv)
                     printf("Meta tiles rendered: ");
                     display_rate(start, end, num_render);
                     printf("Total tiles rendered: ");
-                    display_rate(start, end, num_render * METATILE * METATILE);
+                    display_rate(start, end, num_tiles);
                     printf("Total tiles in input: %d\n", num_read);
                     printf("Total tiles expanded from input: %d\n", num_all);
                     printf("Total tiles ignored (not on disk): %d\n", num_ignore);
@@ -591,7 +390,7 @@ int main(int argc, char **argv)
     }
 
     if (doRender) {
-        finish_workers(numThreads);
+        finish_workers();
     }
 
     gettimeofday(&end, NULL);
@@ -599,7 +398,7 @@ int main(int argc, char **argv)
     printf("Meta tiles rendered: ");
     display_rate(start, end, num_render);
     printf("Total tiles rendered: ");
-    display_rate(start, end, num_render * METATILE * METATILE);
+    display_rate(start, end, num_tiles);
     printf("Total tiles in input: %d\n", num_read);
     printf("Total tiles expanded from input: %d\n", num_all);
     printf("Total meta tiles deleted: %d\n", num_unlink);
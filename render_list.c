@@ -20,6 +20,7 @@
 #include "protocol.h"
 #include "render_config.h"
 #include "dir_utils.h"
+#include "render_submit_queue.h"
 
 #ifndef METATILE
 #warning("render_list not implemented for non-metatile mode. Feel free to submit fix")
@@ -35,8 +36,6 @@ static int maxZoom = MAX_ZOOM;
 static int verbose = 0;
 static int maxLoad = MAX_LOAD_OLD;
 
-int work_complete;
-
 void display_rate(struct timeval start, struct timeval end, int num) 
 {
     int d_s, d_us;
@@ -79,262 +78,17 @@ static time_t getPlanetTime(char *tile_dir)
     return planet_timestamp;
 }
 
-int get_load_avg(void)
-{
-    FILE *loadavg = fopen("/proc/loadavg", "r");
-    int avg = 1000;
-
-    if (!loadavg) {
-        fprintf(stderr, "failed to read /proc/loadavg");
-        return 1000;
-    }
-    if (fscanf(loadavg, "%d", &avg) != 1) {
-        fprintf(stderr, "failed to parse /proc/loadavg");
-        fclose(loadavg);
-        return 1000;
-    }
-    fclose(loadavg);
-
-    return avg;
-}
-
-int process_loop(int fd, const char *mapname, int x, int y, int z)
-{
-    struct protocol cmd, rsp;
-    //struct pollfd fds[1];
-    int ret = 0;
-
-    bzero(&cmd, sizeof(cmd));
-
-    cmd.ver = 2;
-    cmd.cmd = cmdRenderBulk;
-    cmd.z = z;
-    cmd.x = x;
-    cmd.y = y;
-    strcpy(cmd.xmlname, mapname);
-
-    //printf("Sending request\n");
-    ret = send(fd, &cmd, sizeof(cmd), 0);
-    if (ret != sizeof(cmd)) {
-        perror("send error");
-    }
-
-    //printf("Waiting for response\n");
-    bzero(&rsp, sizeof(rsp));
-    ret = recv(fd, &rsp, sizeof(rsp), 0);
-    if (ret != sizeof(rsp)) {
-        perror("recv error");
-        return 0;
-    }
-    //printf("Got response\n");
-
-    if (rsp.cmd != cmdDone) {
-        printf("rendering failed, pausing\n");
-        sleep(10);
-    }
-
-    if (!ret)
-        perror("Socket send error");
-    return ret;
-}
-
-void process(int fd, const char *name)
-{
-    char xmlconfig[XMLCONFIG_MAX];
-    int x, y, z;
-
-    if (path_to_xyz(name, xmlconfig, &x, &y, &z))
-        return;
-
-    printf("Requesting xml(%s) x(%d) y(%d) z(%d)\n", xmlconfig, x, y, z);
-    process_loop(fd, xmlconfig, x, y, z);
-}
-
-static void check_load(void)
-{
-    int avg = get_load_avg();
-
-    while (avg >= maxLoad) {
-        /* printf("Load average %d, sleeping\n", avg); */
-        sleep(5);
-        avg = get_load_avg();
-    }
-}
-
-#define QMAX 32
-
-pthread_mutex_t qLock;
-pthread_cond_t qCondNotEmpty;
-pthread_cond_t qCondNotFull;
-
-unsigned int qLen;
-struct qItem {
-    char *path;
-    struct qItem *next;
-};
-
-struct qItem *qHead, *qTail;
-
-char *fetch(void)
-{
-    // Fetch path to render from queue or NULL on work completion
-    // Must free() pointer after use
-    char *path;
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == 0) {
-        if (work_complete) {
-            pthread_mutex_unlock(&qLock);
-            return NULL;
-        }
-        pthread_cond_wait(&qCondNotEmpty, &qLock);
-    }
-
-    // Fetch item from queue
-    if (!qHead) {
-        fprintf(stderr, "Queue failure, null qHead with %d items in list\n", qLen);
-        exit(1);
-    }
-    path = qHead->path;
-
-    if (qHead == qTail) {
-        free(qHead);
-        qHead = NULL;
-        qTail = NULL;
-        qLen = 0;
-    } else {
-        struct qItem *e = qHead;
-        qHead = qHead->next;
-        free(e);
-        if (qLen == QMAX)
-            pthread_cond_signal(&qCondNotFull);
-        qLen--;
-    }
-
-    pthread_mutex_unlock(&qLock);
-    return path;
-}
-
-void enqueue(const char *path)
-{
-    // Add this path in the local render queue
-    struct qItem *e = malloc(sizeof(struct qItem));
-
-    e->path = strdup(path);
-    e->next = NULL;
-
-    if (!e->path) {
-        fprintf(stderr, "Malloc failure\n");
-        exit(1);
-    }
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == QMAX) {
-        pthread_cond_wait(&qCondNotFull, &qLock);
-    }
-
-    // Append item to end of queue
-    if (qTail)
-        qTail->next = e;
-    else
-        qHead = e;
-    qTail = e;
-    pthread_cond_signal(&qCondNotEmpty);
-    qLen++;
-
-    pthread_mutex_unlock(&qLock);
-}
-
-
-void *thread_main(void *arg)
-{
-    const char *spath = (const char *)arg;
-    int fd;
-    struct sockaddr_un addr;
-    char *tile;
-
-    fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        fprintf(stderr, "failed to create unix socket\n");
-        exit(2);
-    }
-
-    bzero(&addr, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, spath, sizeof(addr.sun_path));
-
-    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "socket connect failed for: %s\n", spath);
-        close(fd);
-        return NULL;
-    }
-
-    while((tile = fetch())) {
-        process(fd, tile);
-        free(tile);
-        check_load();
-    }
-
-    close(fd);
-
-    return NULL;
-}
-
-
-pthread_t *workers;
-
-void spawn_workers(int num, const char *spath)
-{
-    int i;
-
-    // Setup request queue
-    pthread_mutex_init(&qLock, NULL);
-    pthread_cond_init(&qCondNotEmpty, NULL);
-    pthread_cond_init(&qCondNotFull, NULL);
-
-    printf("Starting %d rendering threads\n", num);
-    workers = calloc(sizeof(pthread_t), num);
-    if (!workers) {
-        perror("Error allocating worker memory");
-        exit(1);
-    }
-    for(i=0; i<num; i++) {
-        if (pthread_create(&workers[i], NULL, thread_main, (void *)spath)) {
-            perror("Thread creation failed");
-            exit(1);
-        }
-    }
-}
-
-void finish_workers(int num)
-{
-    int i;
-
-    printf("Waiting for rendering threads to finish\n");
-    pthread_mutex_lock(&qLock);
-    work_complete = 1;
-    pthread_mutex_unlock(&qLock);
-    pthread_cond_broadcast(&qCondNotEmpty);
-
-    for(i=0; i<num; i++)
-        pthread_join(workers[i], NULL);
-    free(workers);
-    workers = NULL;
-}
-
-
 int main(int argc, char **argv)
 {
     char *spath = RENDER_SOCKET;
     char *mapname = XMLCONFIG_DEFAULT;
     char *tile_dir = HASH_PATH;
+    char *metatile = NULL;
     int minX=-1, maxX=-1, minY=-1, maxY=-1;
     int x, y, z;
     char name[PATH_MAX];
     struct timeval start, end;
-    int num_render = 0, num_all = 0;
+    int num_render = 0, num_all = 0, num_tiles = 0;
     time_t planetTime;
     int c;
     int all=0;
@@ -355,6 +109,7 @@ int main(int argc, char **argv)
             {"max-load", 1, 0, 'l'},
             {"tile-dir", 1, 0, 't'},
             {"map", 1, 0, 'm'},
+            {"metatile", 1, 0, 'M'},
             {"verbose", 0, 0, 'v'},
             {"force", 0, 0, 'f'},
             {"all", 0, 0, 'a'},
@@ -362,7 +117,7 @@ int main(int argc, char **argv)
             {0, 0, 0, 0}
         };
 
-        c = getopt_long(argc, argv, "hvaz:Z:x:X:y:Y:s:m:t:n:", long_options, &option_index);
+        c = getopt_long(argc, argv, "hvaz:Z:x:X:y:Y:s:m:M:t:n:", long_options, &option_index);
         if (c == -1)
             break;
 
@@ -379,6 +134,9 @@ int main(int argc, char **argv)
             case 'm':   /* -m, --map */
                 mapname=strdup(optarg);
                 break;
+            case 'M':   /* -M, --metatile */
+                metatile=strdup(optarg);
+                break;
             case 'l':   /* -l, --max-load */
                 maxLoad = atoi(optarg);
                 break;
@@ -426,6 +184,7 @@ int main(int argc, char **argv)
                 fprintf(stderr, "  -a, --all            render all tiles in given zoom level range instead of reading from STDIN\n");
                 fprintf(stderr, "  -f, --force          render tiles even if they seem current\n");
                 fprintf(stderr, "  -m, --map=MAP        render tiles in this map (defaults to '" XMLCONFIG_DEFAULT "')\n");
+                fprintf(stderr, "  -M, --metatile=SIZES metatile sizes of the map, as METATILE in renderd.conf (defaults to %d)\n", METATILE);
                 fprintf(stderr, "  -l, --max-load=LOAD  sleep if load is this high (defaults to %d)\n", MAX_LOAD_OLD);
                 fprintf(stderr, "  -s, --socket=SOCKET  unix domain socket name for contacting renderd\n");
                 fprintf(stderr, "  -n, --num-threads=N the number of parallel request threads (default 1)\n");
@@ -457,6 +216,11 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (metatile && !metatile_size_parse(mapname, metatile)) {
+        fprintf(stderr, "Invalid metatile sizes: %s\n", metatile);
+        return 1;
+    }
+
     if (all) {
         if ((minX != -1 || minY != -1 || maxX != -1 || maxY != -1) && minZoom != maxZoom) {
             fprintf(stderr, "min-zoom must be equal to max-zoom when using min-x, max-x, min-y, or max-y options\n");
@@ -490,7 +254,7 @@ int main(int argc, char **argv)
 
     gettimeofday(&start, NULL);
 
-    spawn_workers(numThreads, spath);
+    spawn_workers(numThreads, spath, maxLoad);
 
     if (all) {
         int x, y, z;
@@ -498,14 +262,16 @@ int main(int argc, char **argv)
         for (z=minZoom; z <= maxZoom; z++) {
             int current_maxX = (maxX == -1) ? (1 << z)-1 : maxX;
             int current_maxY = (maxY == -1) ? (1 << z)-1 : maxY;
+            int size = metatile_size(mapname, z);
             printf("Rendering all tiles for zoom %d from (%d, %d) to (%d, %d)\n", z, minX, minY, current_maxX, current_maxY);
-            for (x=minX; x <= current_maxX; x+=METATILE) {
-                for (y=minY; y <= current_maxY; y+=METATILE) {
+            for (x=minX; x <= current_maxX; x+=size) {
+                for (y=minY; y <= current_maxY; y+=size) {
                     xyz_to_meta(name, sizeof(name), tile_dir, mapname, x, y, z);
                     enqueue(name);
                     //process_loop(fd, mapname, x, y, z);
                     num_all++;
                     num_render++;
+                    num_tiles += size * size;
                 }
             }
         }
@@ -538,13 +304,14 @@ int main(int argc, char **argv)
                 //ret = process_loop(fd, mapname, x, y, z);
                 enqueue(name);
                 num_render++;
+                num_tiles += metatile_size(mapname, z) * metatile_size(mapname, z);
                 if (!(num_render % 10)) {
                     gettimeofday(&end, NULL);
                     printf("\n");
                     printf("Meta tiles rendered: ");
                     display_rate(start, end, num_render);
                     printf("Total tiles rendered: ");
-                    display_rate(start, end, num_render * METATILE * METATILE);
+                    display_rate(start, end, num_tiles);
                     printf("Total tiles handled from input: ");
                     display_rate(start, end, num_all);
                 }
@@ -552,14 +319,14 @@ int main(int argc, char **argv)
         }
     }
 
-    finish_workers(numThreads);
+    finish_workers();
 
     gettimeofday(&end, NULL);
     printf("\nTotal for all tiles rendered\n");
     printf("Meta tiles rendered: ");
     display_rate(start, end, num_render);
     printf("Total tiles rendered: ");
-    display_rate(start, end, num_render * METATILE * METATILE);
+    display_rate(start, end, num_tiles);
     printf("Total tiles handled: ");
     display_rate(start, end, num_all);
 
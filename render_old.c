@@ -23,6 +23,7 @@
 #include "protocol.h"
 #include "render_config.h"
 #include "dir_utils.h"
+#include "render_submit_queue.h"
 
 #ifndef METATILE
 #warning("render_old not implemented for non-metatile mode. Feel free to submit fix")
@@ -41,9 +42,6 @@ static int num_render = 0, num_all = 0;
 static time_t planetTime;
 static struct timeval start, end;
 
-
-int work_complete;
-
 void display_rate(struct timeval start, struct timeval end, int num) 
 {
     int d_s, d_us;
@@ -86,77 +84,6 @@ static time_t getPlanetTime(char *tile_dir)
     return planet_timestamp;
 }
 
-int get_load_avg(void)
-{
-    FILE *loadavg = fopen("/proc/loadavg", "r");
-    int avg = 1000;
-
-    if (!loadavg) {
-        fprintf(stderr, "failed to read /proc/loadavg");
-        return 1000;
-    }
-    if (fscanf(loadavg, "%d", &avg) != 1) {
-        fprintf(stderr, "failed to parse /proc/loadavg");
-        fclose(loadavg);
-        return 1000;
-    }
-    fclose(loadavg);
-
-    return avg;
-}
-
-
-int process_loop(int fd, char * xmlname, int x, int y, int z)
-{
-    struct protocol cmd, rsp;
-    //struct pollfd fds[1];
-    int ret = 0;
-
-    bzero(&cmd, sizeof(cmd));
-
-    cmd.ver = 2;
-    cmd.cmd = cmdRenderBulk;
-    cmd.z = z;
-    cmd.x = x;
-    cmd.y = y;
-    strcpy(cmd.xmlname, xmlname);
-    //strcpy(cmd.path, "/tmp/foo.png");
-    //printf("Sending request\n");
-    ret = send(fd, &cmd, sizeof(cmd), 0);
-    if (ret != sizeof(cmd)) {
-        perror("send error");
-    }
-        //printf("Waiting for response\n");
-    bzero(&rsp, sizeof(rsp));
-    ret = recv(fd, &rsp, sizeof(rsp), 0);
-    if (ret != sizeof(rsp)) {
-        perror("recv error");
-        return 0;
-    }
-        //printf("Got response\n");
-
-    if (rsp.cmd != cmdDone) {
-        printf("rendering failed, pausing\n");
-        sleep(10);
-    }
-
-    if (!ret)
-        perror("Socket send error");
-    return ret;
-}
-
-void process(int fd, const char *name)
-{
-    char xmlconfig[XMLCONFIG_MAX];
-    int x, y, z;
-
-    if (path_to_xyz(name, xmlconfig, &x, &y, &z))
-        return;
-
-    printf("Requesting xml(%s) x(%d) y(%d) z(%d)\n", xmlconfig, x, y, z);
-    process_loop(fd, xmlconfig, x, y, z);
-}
-
 static void check_load(void)
 {
     int avg = get_load_avg();
@@ -168,92 +95,6 @@ static void check_load(void)
     }
 }
 
-#define QMAX 32
-
-pthread_mutex_t qLock;
-pthread_cond_t qCondNotEmpty;
-pthread_cond_t qCondNotFull;
-
-unsigned int qLen;
-struct qItem {
-    char *path;
-    struct qItem *next;
-};
-
-struct qItem *qHead, *qTail;
-
-char *fetch(void)
-{
-    // Fetch path to render from queue or NULL on work completion
-    // Must free() pointer after use
-    char *path;
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == 0) {
-        if (work_complete) {
-            pthread_mutex_unlock(&qLock);
-            return NULL;
-        }
-        pthread_cond_wait(&qCondNotEmpty, &qLock);
-    }
-
-    // Fetch item from queue
-    if (!qHead) {
-        fprintf(stderr, "Queue failure, null qHead with %d items in list\n", qLen);
-        exit(1);
-    }
-    path = qHead->path;
-
-    if (qHead == qTail) {
-        free(qHead);
-        qHead = NULL;
-        qTail = NULL;
-        qLen = 0;
-    } else {
-        struct qItem *e = qHead;
-        qHead = qHead->next;
-        free(e);
-        if (qLen == QMAX)
-            pthread_cond_signal(&qCondNotFull);
-        qLen--;
-    }
-
-    pthread_mutex_unlock(&qLock);
-    return path;
-}
-
-void enqueue(const char *path)
-{
-    // Add this path in the local render queue
-    struct qItem *e = malloc(sizeof(struct qItem));
-
-    e->path = strdup(path);
-    e->next = NULL;
-
-    if (!e->path) {
-        fprintf(stderr, "Malloc failure\n");
-        exit(1);
-    }
-
-    pthread_mutex_lock(&qLock);
-
-    while (qLen == QMAX) {
-        pthread_cond_wait(&qCondNotFull, &qLock);
-    }
-
-    // Append item to end of queue
-    if (qTail)
-        qTail->next = e;
-    else
-        qHead = e;
-    qTail = e;
-    pthread_cond_signal(&qCondNotEmpty);
-    qLen++;
-
-    pthread_mutex_unlock(&qLock);
-}
-
 static void descend(const char *search)
 {
     DIR *tiles = opendir(search);
@@ -303,39 +144,6 @@ static void descend(const char *search)
     closedir(tiles);
 }
 
-void *thread_main(void *arg)
-{
-    const char *spath = (const char *)arg;
-    int fd;
-    struct sockaddr_un addr;
-    char *tile;
-
-    fd = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        fprintf(stderr, "failed to create unix socket\n");
-        exit(2);
-    }
-
-    bzero(&addr, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, spath, sizeof(addr.sun_path));
-
-    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "socket connect failed for: %s\n", spath);
-        close(fd);
-        return NULL;
-    }
-
-    while((tile = fetch())) {
-        process(fd, tile);
-        free(tile);
-    }
-
-    close(fd);
-
-    return NULL;
-}
-
 void render_layer(const char *name)
 {
     int z;
@@ -347,48 +155,6 @@ void render_layer(const char *name)
     }
 }
 
-pthread_t *workers;
-
-void spawn_workers(int num, const char *spath)
-{
-    int i;
-
-    // Setup request queue
-    pthread_mutex_init(&qLock, NULL);
-    pthread_cond_init(&qCondNotEmpty, NULL);
-    pthread_cond_init(&qCondNotFull, NULL);
-
-    printf("Starting %d rendering threads\n", num);
-    workers = calloc(sizeof(pthread_t), num);
-    if (!workers) {
-        perror("Error allocating worker memory");
-        exit(1);
-    }
-    for(i=0; i<num; i++) {
-        if (pthread_create(&workers[i], NULL, thread_main, (void *)spath)) {
-            perror("Thread creation failed");
-            exit(1);
-        }
-    }
-}
-
-void finish_workers(int num)
-{
-    int i;
-
-    printf("Waiting for rendering threads to finish\n");
-    pthread_mutex_lock(&qLock);
-    work_complete = 1;
-    pthread_mutex_unlock(&qLock);
-    pthread_cond_broadcast(&qCondNotEmpty);
-
-    for(i=0; i<num; i++)
-        pthread_join(workers[i], NULL);
-    free(workers);
-    workers = NULL;
-}
-
-
 int main(int argc, char **argv)
 {
     char spath[PATH_MAX] = RENDER_SOCKET;
@@ -481,7 +247,7 @@ int main(int argc, char **argv)
         exit(7);
     }
 
-    spawn_workers(numThreads, spath);
+    spawn_workers(numThreads, spath, 0);
 
     while (fgets(line, INILINE_MAX, hini)!=NULL) {
         if (line[0] == '[') {
@@ -497,7 +263,7 @@ int main(int argc, char **argv)
     }
     fclose(hini);
 
-    finish_workers(numThreads);
+    finish_workers();
 
     gettimeofday(&end, NULL);
     printf("\nTotal for all tiles rendered\n");
@@ -0,0 +1,238 @@
+/* Render statistics of renderd, see render_stats.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "render_config.h"
+#include "gen_tile.h"
+#include "request_queue.h"
+#include "render_stats.h"
+
+struct thread_stats {
+    struct render_stats stats;
+    struct thread_stats *next;
+} __attribute__((aligned(64)));
+
+static __thread struct thread_stats *myStats;
+static struct thread_stats *allStats;
+static pthread_mutex_t allStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phaseNames[STATS_PHASES] = { "Draw", "Encode", "Write", "Expire" };
+
+static char styles[XMLCONFIGS_MAX][XMLCONFIG_MAX];
+static int numStyles;
+
+/* Only the owning thread writes to its counters, so a plain add is enough.
+ * The store is atomic so that readers never see a torn value.
+ */
+#define STATS_ADD(counter, value) __atomic_store_n(&(counter), (counter) + (value), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+long stats_clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void render_stats_add_style(const char *xmlname)
+{
+    if (numStyles >= XMLCONFIGS_MAX)
+        return;
+    strncpy(styles[numStyles], xmlname, XMLCONFIG_MAX - 1);
+    numStyles++;
+}
+
+const char *render_stats_style(int i)
+{
+    return ((i >= 0) && (i < numStyles)) ? styles[i] : NULL;
+}
+
+const char *render_stats_phase(int phase)
+{
+    return ((phase >= 0) && (phase < STATS_PHASES)) ? phaseNames[phase] : NULL;
+}
+
+static int style_index(const char *xmlname)
+{
+    for (int i = 0; i < numStyles; i++) {
+        if (!strcmp(styles[i], xmlname))
+            return i;
+    }
+    return -1;
+}
+
+static struct thread_stats *thread_stats(void)
+{
+    struct thread_stats *ts = myStats;
+    void *mem;
+
+    if (ts)
+        return ts;
+
+    // Threads of renderd live as long as the process, their counters are
+    // never freed
+    if (posix_memalign(&mem, 64, sizeof(struct thread_stats))) {
+        syslog(LOG_ERR, "malloc failed, not recording render statistics");
+        return NULL;
+    }
+    ts = (struct thread_stats *)mem;
+    memset(ts, 0, sizeof(*ts));
+    pthread_mutex_lock(&allStatsLock);
+    ts->next = allStats;
+    allStats = ts;
+    pthread_mutex_unlock(&allStatsLock);
+    myStats = ts;
+    return ts;
+}
+
+/* Values below STATS_HIST_SUB get a bucket each. Above that, the values
+ * from 2^k to 2^(k+1) - 1 are split into STATS_HIST_SUB buckets.
+ */
+static int bucket_of(long value)
+{
+    int shift;
+    int bucket;
+
+    if (value < STATS_HIST_SUB)
+        return (value < 0) ? 0 : (int)value;
+    shift = 63 - __builtin_clzl((unsigned long)value) - STATS_HIST_SUB_BITS;
+    bucket = (shift + 1) * STATS_HIST_SUB + (int)(value >> shift) - STATS_HIST_SUB;
+    return (bucket < STATS_HIST_BUCKETS) ? bucket : STATS_HIST_BUCKETS - 1;
+}
+
+long stats_histogram_bucket_max(int bucket)
+{
+    int shift;
+    long mantissa;
+
+    if (bucket < STATS_HIST_SUB)
+        return bucket;
+    shift = bucket / STATS_HIST_SUB - 1;
+    mantissa = bucket % STATS_HIST_SUB + STATS_HIST_SUB;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static void hist_record(struct stats_histogram *hist, long value)
+{
+    STATS_ADD(hist->count[bucket_of(value)], 1);
+    STATS_ADD(hist->sum, value);
+}
+
+static void hist_merge(struct stats_histogram *to, const struct stats_histogram *from)
+{
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+        to->count[i] += STATS_GET(from->count[i]);
+    to->sum += STATS_GET(from->sum);
+}
+
+long stats_histogram_count(const struct stats_histogram *hist)
+{
+    long count = 0;
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+        count += hist->count[i];
+    return count;
+}
+
+long stats_histogram_percentile(const struct stats_histogram *hist, double p)
+{
+    long count = stats_histogram_count(hist);
+    long rank, seen = 0;
+
+    if (count == 0)
+        return 0;
+    rank = (long)(p * count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += hist->count[i];
+        if (seen >= rank)
+            return stats_histogram_bucket_max(i);
+    }
+    return stats_histogram_bucket_max(STATS_HIST_BUCKETS - 1);
+}
+
+void statsRenderFinish(const struct item *item, long wait, long time)
+{
+    struct thread_stats *ts = thread_stats();
+    int z = item->req.z;
+    int style = style_index(item->req.xmlname);
+    int queue = item->originatedQueue;
+
+    if ((z < 0) || (z > MAX_ZOOM))
+        return;
+    if (ts) {
+        struct render_stats *s = &ts->stats;
+
+        STATS_ADD(s->noZoomRender[z], 1);
+        STATS_ADD(s->timeZoomRender[z], time);
+        hist_record(&s->waitZoom[z], wait);
+        hist_record(&s->renderZoom[z], time);
+        if (style >= 0) {
+            hist_record(&s->waitStyle[style], wait);
+            hist_record(&s->renderStyle[style], time);
+        }
+        if ((queue >= 0) && (queue < STATS_QUEUES)) {
+            hist_record(&s->waitQueue[queue], wait);
+            hist_record(&s->renderQueue[queue], time);
+        }
+    }
+    request_queue_render_time(z, time);
+}
+
+void statsRenderPhases(const char *xmlname, int z, const long phases[STATS_PHASES])
+{
+    struct thread_stats *ts = thread_stats();
+    int style = style_index(xmlname);
+
+    if (!ts || (z < 0) || (z > MAX_ZOOM))
+        return;
+    for (int i = 0; i < STATS_PHASES; i++) {
+        hist_record(&ts->stats.phaseZoom[i][z], phases[i]);
+        if (style >= 0)
+            hist_record(&ts->stats.phaseStyle[i][style], phases[i]);
+    }
+}
+
+void render_stats_collect(struct render_stats *stats)
+{
+    struct thread_stats *ts;
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&allStatsLock);
+    ts = allStats;
+    pthread_mutex_unlock(&allStatsLock);
+
+    // Threads are only ever added at the head, the rest of the list is fixed
+    for (; ts; ts = ts->next) {
+        const struct render_stats *s = &ts->stats;
+
+        for (i = 0; i <= MAX_ZOOM; i++) {
+            stats->noZoomRender[i] += STATS_GET(s->noZoomRender[i]);
+            stats->timeZoomRender[i] += STATS_GET(s->timeZoomRender[i]);
+            hist_merge(&stats->waitZoom[i], &s->waitZoom[i]);
+            hist_merge(&stats->renderZoom[i], &s->renderZoom[i]);
+        }
+        for (i = 0; i < XMLCONFIGS_MAX; i++) {
+            hist_merge(&stats->waitStyle[i], &s->waitStyle[i]);
+            hist_merge(&stats->renderStyle[i], &s->renderStyle[i]);
+        }
+        for (i = 0; i < STATS_QUEUES; i++) {
+            hist_merge(&stats->waitQueue[i], &s->waitQueue[i]);
+            hist_merge(&stats->renderQueue[i], &s->renderQueue[i]);
+        }
+        for (i = 0; i < STATS_PHASES; i++) {
+            for (int z = 0; z <= MAX_ZOOM; z++)
+                hist_merge(&stats->phaseZoom[i][z], &s->phaseZoom[i][z]);
+            for (int j = 0; j < XMLCONFIGS_MAX; j++)
+                hist_merge(&stats->phaseStyle[i][j], &s->phaseStyle[i][j]);
+        }
+    }
+}
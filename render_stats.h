@@ -0,0 +1,103 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include "render_config.h"
+#include "gen_tile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Render statistics of renderd
+ *
+ * Every thread counts into its own, cache line aligned, copy of struct
+ * render_stats without locks or atomic read-modify-write operations. The
+ * copies are only summed up when the statistics are read.
+ *
+ * Besides the number of metatiles and the total render time per zoom level,
+ * the wait in the queues and the render time are kept in log-linear
+ * histograms per zoom level, per style and per queue the request came from.
+ * The time of a metatile is also split into the phases of enum renderPhase,
+ * which are kept in histograms per zoom level and per style as well.
+ *
+ * A histogram has STATS_HIST_SUB buckets for each power of 2 of milliseconds,
+ * so percentiles are accurate to within 1/STATS_HIST_SUB.
+ */
+
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_SUB (1 << STATS_HIST_SUB_BITS)
+// Longest time told apart from longer ones, 2^25 ms are more than 9 hours
+#define STATS_HIST_MAX_BITS 25
+#define STATS_HIST_BUCKETS ((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB)
+
+// Histograms per queue, indexed by enum queueEnum
+#define STATS_QUEUES (queueDirty + 1)
+
+/* Phases of rendering a metatile. Mapnik does the datasource queries, label
+ * placement and rasterisation in a single call, so they are one phase.
+ */
+enum renderPhase {
+    phaseDraw,   // Datasource queries, label placement and rasterisation
+    phaseEncode, // Waiting for encoder threads and encoding the PNG tiles
+    phaseWrite,  // Writing the metatile to disk
+    phaseExpire, // Purging the tiles from caches with HTCP
+    STATS_PHASES
+};
+
+struct stats_histogram {
+    long count[STATS_HIST_BUCKETS];
+    long sum;
+};
+
+struct render_stats {
+    long noZoomRender[MAX_ZOOM + 1];
+    long timeZoomRender[MAX_ZOOM + 1];
+    struct stats_histogram waitZoom[MAX_ZOOM + 1];
+    struct stats_histogram renderZoom[MAX_ZOOM + 1];
+    struct stats_histogram waitStyle[XMLCONFIGS_MAX];
+    struct stats_histogram renderStyle[XMLCONFIGS_MAX];
+    struct stats_histogram waitQueue[STATS_QUEUES];
+    struct stats_histogram renderQueue[STATS_QUEUES];
+    struct stats_histogram phaseZoom[STATS_PHASES][MAX_ZOOM + 1];
+    struct stats_histogram phaseStyle[STATS_PHASES][XMLCONFIGS_MAX];
+};
+
+/* Milliseconds of CLOCK_MONOTONIC, the clock of the times passed in */
+long stats_clock_ms(void);
+
+/* Register the style xmlname, must be done before any thread records */
+void render_stats_add_style(const char *xmlname);
+
+/* Name of style i, or NULL if there is none */
+const char *render_stats_style(int i);
+
+/* Record a metatile of item, which waited wait ms in the queues and took
+ * time ms to render. Also feeds the render time into admission control.
+ */
+void statsRenderFinish(const struct item *item, long wait, long time);
+
+/* Record the time in ms each phase of rendering a metatile of style xmlname
+ * at zoom level z took
+ */
+void statsRenderPhases(const char *xmlname, int z, const long phases[STATS_PHASES]);
+
+/* Name of phase, as used in the statistics */
+const char *render_stats_phase(int phase);
+
+/* Sum up the statistics of all threads into stats */
+void render_stats_collect(struct render_stats *stats);
+
+/* Upper bound of the values counted in bucket */
+long stats_histogram_bucket_max(int bucket);
+
+/* Value below which a fraction p of the recorded values are, 0 if empty */
+long stats_histogram_percentile(const struct stats_histogram *hist, double p);
+
+/* Number of values recorded */
+long stats_histogram_count(const struct stats_histogram *hist);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "protocol.h"
+#include "render_config.h"
+#include "dir_utils.h"
+#include "render_submit_queue.h"
+
+#define QMAX 32
+
+/* Most requests a worker keeps outstanding on its connection. renderd
+ * queues REQ_LIMIT bulk requests and moves the rest to the dirty queue, where
+ * they would crowd out the dirty requests of mod_tile, so the workers share
+ * REQ_LIMIT between them.
+ */
+#define PIPELINE_MAX (REQ_LIMIT < PROTO_BATCH_MAX ? REQ_LIMIT : PROTO_BATCH_MAX)
+
+static pthread_mutex_t qLock;
+static pthread_cond_t qCondNotEmpty;
+static pthread_cond_t qCondNotFull;
+
+static unsigned int qLen;
+struct qItem {
+    char *path;
+    struct qItem *next;
+};
+
+static struct qItem *qHead, *qTail;
+static int work_complete;
+
+static pthread_t *workers;
+static int num_workers;
+static int window; // Requests outstanding per worker
+static int maxLoad;
+
+int get_load_avg(void)
+{
+    FILE *loadavg = fopen("/proc/loadavg", "r");
+    int avg = 1000;
+
+    if (!loadavg) {
+        fprintf(stderr, "failed to read /proc/loadavg");
+        return 1000;
+    }
+    if (fscanf(loadavg, "%d", &avg) != 1) {
+        fprintf(stderr, "failed to parse /proc/loadavg");
+        fclose(loadavg);
+        return 1000;
+    }
+    fclose(loadavg);
+
+    return avg;
+}
+
+static void check_load(void)
+{
+    int avg = get_load_avg();
+
+    while (avg >= maxLoad) {
+        /* printf("Load average %d, sleeping\n", avg); */
+        sleep(5);
+        avg = get_load_avg();
+    }
+}
+
+static char *fetch(int block)
+{
+    // Fetch path to render from queue. Returns NULL on work completion, or
+    // if the queue is empty and block is not set
+    // Must free() pointer after use
+    char *path;
+
+    pthread_mutex_lock(&qLock);
+
+    while (qLen == 0) {
+        if (work_complete || !block) {
+            pthread_mutex_unlock(&qLock);
+            return NULL;
+        }
+        pthread_cond_wait(&qCondNotEmpty, &qLock);
+    }
+
+    // Fetch item from queue
+    if (!qHead) {
+        fprintf(stderr, "Queue failure, null qHead with %d items in list\n", qLen);
+        exit(1);
+    }
+    path = qHead->path;
+
+    if (qHead == qTail) {
+        free(qHead);
+        qHead = NULL;
+        qTail = NULL;
+        qLen = 0;
+    } else {
+        struct qItem *e = qHead;
+        qHead = qHead->next;
+        free(e);
+        qLen--;
+    }
+    pthread_cond_signal(&qCondNotFull);
+
+    pthread_mutex_unlock(&qLock);
+    return path;
+}
+
+void enqueue(const char *path)
+{
+    // Add this path in the local render queue
+    struct qItem *e = malloc(sizeof(struct qItem));
+
+    e->path = strdup(path);
+    e->next = NULL;
+
+    if (!e->path) {
+        fprintf(stderr, "Malloc failure\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&qLock);
+
+    while (qLen == QMAX) {
+        pthread_cond_wait(&qCondNotFull, &qLock);
+    }
+
+    // Append item to end of queue
+    if (qTail)
+        qTail->next = e;
+    else
+        qHead = e;
+    qTail = e;
+    pthread_cond_signal(&qCondNotEmpty);
+    qLen++;
+
+    pthread_mutex_unlock(&qLock);
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        int ret = send(fd, p, len, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("send error");
+            return 0;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+
+    while (len > 0) {
+        int ret = recv(fd, p, len, 0);
+        if (ret <= 0) {
+            if ((ret < 0) && (errno == EINTR))
+                continue;
+            if (ret < 0)
+                perror("recv error");
+            else
+                fprintf(stderr, "renderd closed the connection\n");
+            return 0;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+/* Send as many new requests as fit into the pipeline. Only blocks waiting
+ * for work if nothing is outstanding. Returns the number of requests sent,
+ * or -1 on error. *done is set once all work has been fetched.
+ */
+static int submit_batch(int fd, struct protocol_v3_item *pending, int num_pending, int *next_id, int *done)
+{
+    struct {
+        struct protocol_v3 hdr;
+        struct protocol_v3_item items[PIPELINE_MAX];
+    } frame;
+    int n = 0;
+
+    bzero(&frame, sizeof(frame));
+    while (num_pending + n < window) {
+        struct protocol_v3_item *item = &frame.items[n];
+        int block = (num_pending + n == 0);
+        char *path = fetch(block);
+
+        if (!path) {
+            if (block)
+                *done = 1;
+            break;
+        }
+        if (path_to_xyz(path, item->xmlname, &item->x, &item->y, &item->z)) {
+            free(path);
+            continue;
+        }
+        free(path);
+        item->id = (*next_id)++;
+        item->cmd = cmdRenderBulk;
+        printf("Requesting xml(%s) x(%d) y(%d) z(%d)\n", item->xmlname, item->x, item->y, item->z);
+        n++;
+    }
+
+    if (n == 0)
+        return 0;
+
+    frame.hdr.ver = PROTO_VER_BATCH;
+    frame.hdr.count = n;
+    frame.hdr.itemsize = sizeof(struct protocol_v3_item);
+    if (!send_all(fd, &frame, sizeof(frame.hdr) + n * sizeof(struct protocol_v3_item)))
+        return -1;
+
+    memcpy(pending + num_pending, frame.items, n * sizeof(struct protocol_v3_item));
+    return n;
+}
+
+/* Wait for the next frame of responses and remove the answered requests from
+ * pending. Returns the new number of pending requests, or -1 on error.
+ */
+static int receive_batch(int fd, struct protocol_v3_item *pending, int num_pending)
+{
+    struct protocol_v3 hdr;
+    int failed = 0;
+    int i, j;
+
+    if (!recv_all(fd, &hdr, sizeof(hdr)))
+        return -1;
+    if ((hdr.ver != PROTO_VER_BATCH) || (hdr.count < 0) || (hdr.count > PROTO_BATCH_MAX) ||
+            (hdr.itemsize < (int)PROTO_ITEM_MIN) || (hdr.itemsize > PROTO_ITEM_MAX)) {
+        fprintf(stderr, "Bad response from renderd: ver(%d) count(%d) itemsize(%d)\n", hdr.ver, hdr.count, hdr.itemsize);
+        return -1;
+    }
+
+    for (i = 0; i < hdr.count; i++) {
+        char buf[PROTO_ITEM_MAX];
+        struct protocol_v3_item rsp;
+
+        if (!recv_all(fd, buf, hdr.itemsize))
+            return -1;
+        bzero(&rsp, sizeof(rsp));
+        memcpy(&rsp, buf, (hdr.itemsize < (int)sizeof(rsp)) ? hdr.itemsize : sizeof(rsp));
+
+        for (j = 0; j < num_pending; j++) {
+            if (pending[j].id == rsp.id)
+                break;
+        }
+        if (j == num_pending) {
+            fprintf(stderr, "Response for unknown request %d\n", rsp.id);
+            continue;
+        }
+        if (rsp.cmd != cmdDone) {
+            printf("rendering failed for xml(%s) x(%d) y(%d) z(%d)\n",
+                    pending[j].xmlname, pending[j].x, pending[j].y, pending[j].z);
+            failed = 1;
+        }
+        pending[j] = pending[--num_pending];
+    }
+
+    if (failed) {
+        printf("pausing\n");
+        sleep(10);
+    }
+    return num_pending;
+}
+
+static void *thread_main(void *arg)
+{
+    const char *spath = (const char *)arg;
+    int fd;
+    struct sockaddr_un addr;
+    struct protocol_v3_item pending[PIPELINE_MAX];
+    int num_pending = 0;
+    int next_id = 0;
+    int done = 0;
+
+    fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create unix socket\n");
+        exit(2);
+    }
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, spath, sizeof(addr.sun_path));
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "socket connect failed for: %s\n", spath);
+        close(fd);
+        return NULL;
+    }
+
+    while (1) {
+        if (!done) {
+            int n = submit_batch(fd, pending, num_pending, &next_id, &done);
+            if (n < 0)
+                break;
+            num_pending += n;
+        }
+        if (num_pending == 0) {
+            if (done)
+                break;
+            continue;
+        }
+
+        num_pending = receive_batch(fd, pending, num_pending);
+        if (num_pending < 0)
+            break;
+        if (maxLoad)
+            check_load();
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
+void spawn_workers(int num, const char *spath, int max_load)
+{
+    int i;
+
+    // Setup request queue
+    pthread_mutex_init(&qLock, NULL);
+    pthread_cond_init(&qCondNotEmpty, NULL);
+    pthread_cond_init(&qCondNotFull, NULL);
+    maxLoad = max_load;
+
+    printf("Starting %d rendering threads\n", num);
+    workers = calloc(sizeof(pthread_t), num);
+    if (!workers) {
+        perror("Error allocating worker memory");
+        exit(1);
+    }
+    num_workers = num;
+    window = PIPELINE_MAX / num;
+    if (window < 1)
+        window = 1;
+    for(i=0; i<num; i++) {
+        if (pthread_create(&workers[i], NULL, thread_main, (void *)spath)) {
+            perror("Thread creation failed");
+            exit(1);
+        }
+    }
+}
+
+void finish_workers(void)
+{
+    int i;
+
+    printf("Waiting for rendering threads to finish\n");
+    pthread_mutex_lock(&qLock);
+    work_complete = 1;
+    pthread_mutex_unlock(&qLock);
+    pthread_cond_broadcast(&qCondNotEmpty);
+
+    for(i=0; i<num_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef RENDER_SUBMIT_QUEUE_H
+#define RENDER_SUBMIT_QUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Client side queue of metatiles to be rendered, shared by render_list,
+ * render_old and render_expired.
+ *
+ * Paths of metatiles are added with enqueue() and sent to renderd by a number
+ * of worker threads. Each worker keeps its share of the REQ_LIMIT bulk requests
+ * renderd queues outstanding on its connection, using batches of protocol
+ * version 3.
+ */
+
+/* Start num workers connecting to the renderd socket at spath. If maxLoad is
+ * non zero, workers pause while the load average is at or above maxLoad.
+ */
+void spawn_workers(int num, const char *spath, int maxLoad);
+
+/* Queue the metatile at path for rendering, blocks while the queue is full */
+void enqueue(const char *path);
+
+/* Wait until all queued metatiles have been rendered and stop the workers */
+void finish_workers(void);
+
+int get_load_avg(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
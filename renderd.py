@@ -41,7 +41,43 @@ import cStringIO
 
 MAX_ZOOM = 18
 METATILE = 8
+METATILE_MAX = 16
 META_MAGIC = "META"
+META_V2_MAGIC = "MTV2"
+META_VERSION = 2
+META_ENCODING_PNG = 0
+
+# Metatile size of each zoom level, per style which does not use METATILE
+metatile_sizes = {}
+
+def metatile_size(xmlname, z):
+    try:
+        return metatile_sizes[xmlname][z]
+    except (KeyError, IndexError):
+        return METATILE
+
+def parse_metatile_sizes(spec):
+    # "16:0-12,8:13-16,4:17-18" or just "4", as METATILE in renderd.conf
+    sizes = [METATILE] * (MAX_ZOOM + 1)
+    for part in spec.split(","):
+        if ":" in part:
+            (n, zooms) = part.split(":", 1)
+            (minz, maxz) = [int(v) for v in zooms.split("-", 1)]
+        else:
+            (n, minz, maxz) = (part, 0, MAX_ZOOM)
+        n = int(n)
+        if n < 1 or n > METATILE_MAX or n & (n - 1) or minz < 0 or maxz > MAX_ZOOM or minz > maxz:
+            raise ValueError("Invalid metatile sizes: %s" % spec)
+        for z in range(minz, maxz + 1):
+            sizes[z] = n
+    return sizes
+
+def tile_hash(data):
+    # FNV-1a 64, as tile_hash() in store.c
+    h = 14695981039346656037L
+    for c in data:
+        h = ((h ^ ord(c)) * 1099511628211L) & 0xffffffffffffffffL
+    return struct.pack("<Q", h)
 
 class protocol:
     # ENUM values for commandStatus field in protocol packet
@@ -104,8 +140,9 @@ class ProtocolPacketV1(ProtocolPacket):
             self.z = z
             self.xmlname = "default"
             # Calculate Meta-tile value for this x/y
-            self.mx = x & ~(METATILE-1)
-            self.my = y & ~(METATILE-1)
+            size = metatile_size(self.xmlname, z)
+            self.mx = x & ~(size-1)
+            self.my = y & ~(size-1)
             self.dest = dest
 
 
@@ -140,8 +177,9 @@ class ProtocolPacketV2(ProtocolPacket):
             self.z = z
             self.xmlname = xmlname.rstrip('\000') # Remove trailing NULs
             # Calculate Meta-tile value for this x/y
-            self.mx = x & ~(METATILE-1)
-            self.my = y & ~(METATILE-1)
+            size = metatile_size(self.xmlname, z)
+            self.mx = x & ~(size-1)
+            self.my = y & ~(size-1)
             self.dest = dest
 
     def send(self, status):
@@ -263,7 +301,7 @@ class RenderThread:
     def render_request(self, t):
         (xmlname, x, y, z) = t
         # Calculate the meta tile size to use for this zoom level
-        size = min(METATILE, 1 << z)
+        size = min(metatile_size(xmlname, z), 1 << z)
         try:
             m = self.maps[xmlname]
         except KeyError:
@@ -278,7 +316,7 @@ class RenderThread:
         return True;
 
     def xyz_to_meta(self, xmlname, x,y, z):
-        mask = METATILE -1
+        mask = metatile_size(xmlname, z) -1
         x &= ~mask
         y &= ~mask
         hashes = {}
@@ -292,8 +330,9 @@ class RenderThread:
         return meta
 
     def xyz_to_meta_offset(self, xmlname, x,y, z):
-        mask = METATILE -1
-        offset = (x & mask) * METATILE + (y & mask)
+        size = metatile_size(xmlname, z)
+        mask = size -1
+        offset = (x & mask) * size + (y & mask)
         return offset
 
 
@@ -313,25 +352,35 @@ class RenderThread:
         tmp = "%s.tmp.%d" % (meta_path, thread.get_ident())
         f = open(tmp, "w")
 
-        f.write(struct.pack("4s4i", META_MAGIC, METATILE * METATILE, x, y, z))
+        meta_size = metatile_size(xmlname, z)
+        count = meta_size * meta_size
+        f.write(struct.pack("4s4i", META_MAGIC, count, x, y, z))
         offset = len(META_MAGIC) + 4 * 4
-        # Need to pre-compensate the offsets for the size of the offset/size table we are about to write
-        offset += (2 * 4) * (METATILE * METATILE)
+        # Need to pre-compensate the offsets for the size of the offset/size table
+        # and the v2 header with the tile hashes we are about to write
+        offset += (2 * 4) * count
+        offset += struct.calcsize("<4s3iq") + 8 * count
         # Collect all the tile sizes
         sizes = {}
         offsets = {}
+        hashes = {}
         for xx in range(0, size):
             for yy in range(0, size):
                 mt = self.xyz_to_meta_offset(xmlname, x+xx, y+yy, z)
                 sizes[mt] = len(tiles[(xx, yy)])
                 offsets[mt] = offset
+                hashes[mt] = tile_hash(tiles[(xx, yy)])
                 offset += sizes[mt]
         # Write out the offset/size table
-        for mt in range(0, METATILE * METATILE):
+        for mt in range(0, count):
             if mt in sizes:
                 f.write(struct.pack("2i", offsets[mt], sizes[mt]))
             else:
                 f.write(struct.pack("2i", 0, 0))
+        # Write out the v2 header, see struct meta_header_v2 in store.h
+        f.write(struct.pack("<4s3iq", META_V2_MAGIC, META_VERSION, meta_size, META_ENCODING_PNG, int(time.time())))
+        for mt in range(0, count):
+            f.write(hashes.get(mt, "\0" * 8))
         # Write out the tiles
         for xx in range(0, size):
             for yy in range(0, size):
@@ -533,6 +582,8 @@ def read_styles(config):
     for xmlname in config.sections():
         if xmlname != "renderd" and xmlname != "mapnik":
             styles[xmlname] = config.get(xmlname, "xml")
+            if config.has_option(xmlname, "metatile"):
+                metatile_sizes[xmlname] = parse_metatile_sizes(config.get(xmlname, "metatile"))
     return styles
 
 if __name__ == "__main__":
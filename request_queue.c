@@ -0,0 +1,1122 @@
+/* Render request queues of renderd
+ *
+ * The three request queues and the dirty queue each have a lock of their
+ * own, so that the main thread queueing requests and the render threads
+ * taking them only meet when they work on the same queue. queueMask has a
+ * bit set for every queue with requests in it, render threads look there
+ * which queue to take the next request from, and only sleep on qCond while
+ * it is empty. Items being rendered are in no list at all, the index finds
+ * them and renderMs accounts for them, so finishing a metatile takes none of
+ * the queue locks.
+ *
+ * The index of queued metatiles is split into IDX_SHARDS shards, each with a
+ * lock of its own which also protects the duplicates of the items in it.
+ * waitLock protects the waiter lists of client connections along with the
+ * fd of the items on them. Code needing more than one lock takes them in that
+ * order: shard, one queue lock, waitLock. Queue locks are never nested.
+ *
+ * Sending responses to clients, admission control and all statistics (which
+ * use atomic counters) are done without any of the locks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include "render_config.h"
+#include "gen_tile.h"
+#include "daemon.h"
+#include "request_queue.h"
+#include "shm_ring.h"
+
+/* Index of all queued and rendering items, used to find duplicate requests.
+ *
+ * This is an open addressing hash table using robin hood hashing: every slot
+ * keeps the 64 bit key of its item, and on insertion an item takes over the
+ * slot of any item that is closer to its home position than the new one is.
+ * This keeps probe sequences short even at high load, and lets removal shift
+ * the following items back instead of leaving tombstones. The table grows
+ * when it gets too full, so no memory is allocated per insertion.
+ */
+struct item_idx {
+    uint64_t key;
+    struct item *item;
+};
+
+/* Which shard an item is in is decided by the top bits of its key, its slot
+ * in the shard by the bottom ones.
+ */
+#define IDX_SHARD_BITS (4)
+#define IDX_SHARDS (1 << IDX_SHARD_BITS)
+
+struct idx_shard {
+    pthread_mutex_t lock;
+    struct item_idx *table;
+    unsigned int size; // Always a power of 2
+    unsigned int num;
+} __attribute__((aligned(64)));
+
+static struct idx_shard idxShards[IDX_SHARDS];
+
+static void remove_item_idx(struct item *item);
+
+static inline struct idx_shard *shard_of(uint64_t key)
+{
+    return &idxShards[key >> (64 - IDX_SHARD_BITS)];
+}
+
+#define QUEUE_BIT(queue) (1U << (queue))
+
+/* A request queue, rendered in order apart from the affinity of the render
+ * threads
+ */
+struct req_queue {
+    pthread_mutex_t lock;
+    struct item head;
+    int num;
+    long ms; // Sum of the estimates of its items, updated atomically
+    enum queueEnum type;
+} __attribute__((aligned(64)));
+
+static struct req_queue reqQueue, reqPrioQueue, reqBulkQueue;
+static pthread_mutex_t dirtyLock;
+static int dirtyNum;
+static pthread_mutex_t waitLock;
+
+// Render threads sleep on qCond while queueMask is empty
+static unsigned int queueMask;
+static pthread_mutex_t sleepLock;
+static pthread_cond_t qCond;
+static int sleepers;
+
+// Updated with atomic operations, not protected by any lock
+static long noDirtyRender, noReqRender, noReqPrioRender, noReqBulkRender, noReqDroped, noReqBusy, noReqExpired;
+
+/* Admission control
+ *
+ * Every item carries an estimate of its render time, the moving average of
+ * the render times at its zoom level. The estimates of all items in the
+ * request queues and of those being rendered are summed up, so that the wait
+ * for a new request can be estimated without walking the queues. All of it
+ * is read and updated with atomic operations.
+ */
+static long renderTimeZoom[MAX_ZOOM + 1];
+static long renderMs;
+static int numWorkers = 1;
+
+/* Pool of struct item
+ *
+ * Every incoming command needs an item, and most of them are freed again
+ * straight away (duplicates, dropped dirty requests). Items are therefore
+ * never returned to malloc: each thread keeps a small cache of free items,
+ * which is refilled from or flushed to a global free list in batches. The
+ * pool is sized from the queue limits up front and grows by whole slabs if
+ * that turns out not to be enough.
+ */
+#define ITEM_CACHE_MAX (64)
+#define ITEM_SLAB_SIZE (256)
+#define ITEM_POOL_SIZE (3 * REQ_LIMIT + DIRTY_LIMIT + QUEUE_MAX)
+
+struct item_cache {
+    struct item *head;
+    int num;
+};
+
+static __thread struct item_cache itemCache;
+static struct item *itemFreeList;
+static pthread_mutex_t poolLock;
+// Protected by poolLock
+static long itemPoolSize, itemPoolFree, itemPoolRefills, itemPoolFlushes, itemPoolGrowths;
+
+static int item_pool_grow(int num)
+{
+    // call with poolLock held
+    struct item *slab = (struct item *)malloc(sizeof(struct item) * num);
+    if (!slab)
+        return 0;
+    for (int i = 0; i < num; i++) {
+        slab[i].next = itemFreeList;
+        itemFreeList = &slab[i];
+    }
+    itemPoolSize += num;
+    itemPoolFree += num;
+    return num;
+}
+
+struct item *item_alloc(void)
+{
+    struct item *item;
+
+    if (itemCache.num == 0) {
+        // Take half a cache worth of items from the global list
+        pthread_mutex_lock(&poolLock);
+        if ((itemPoolFree < ITEM_CACHE_MAX / 2) && item_pool_grow(ITEM_SLAB_SIZE))
+            itemPoolGrowths++;
+        while (itemFreeList && (itemCache.num < ITEM_CACHE_MAX / 2)) {
+            item = itemFreeList;
+            itemFreeList = item->next;
+            item->next = itemCache.head;
+            itemCache.head = item;
+            itemCache.num++;
+            itemPoolFree--;
+        }
+        itemPoolRefills++;
+        pthread_mutex_unlock(&poolLock);
+        if (itemCache.num == 0)
+            return NULL;
+    }
+    item = itemCache.head;
+    itemCache.head = item->next;
+    itemCache.num--;
+    return item;
+}
+
+void item_free(struct item *item)
+{
+    item->next = itemCache.head;
+    itemCache.head = item;
+    itemCache.num++;
+
+    if (itemCache.num > ITEM_CACHE_MAX) {
+        // Hand half of the cache back to the global list
+        pthread_mutex_lock(&poolLock);
+        while (itemCache.num > ITEM_CACHE_MAX / 2) {
+            item = itemCache.head;
+            itemCache.head = item->next;
+            itemCache.num--;
+            item->next = itemFreeList;
+            itemFreeList = item;
+            itemPoolFree++;
+        }
+        itemPoolFlushes++;
+        pthread_mutex_unlock(&poolLock);
+    }
+}
+
+/* Dirty queue
+ *
+ * Dirty requests are kept in a binary heap ordered by dirtyKey, which the
+ * dirty policy computes when a request is queued or gets more popular.
+ * Requests with equal keys are rendered in the order they were queued.
+ */
+struct dirty_policy {
+    const char *name;
+    long (*key)(const struct item *item);
+};
+
+static long dirty_key_fifo(const struct item *item)
+{
+    return item->queued;
+}
+
+/* Render tiles at the zoom levels most people look at and popular tiles
+ * earlier, but let old requests catch up eventually
+ */
+static long dirty_key_zoom(const struct item *item)
+{
+    int z = (item->req.z < DIRTY_ZOOM_FULL_BONUS) ? DIRTY_ZOOM_FULL_BONUS : item->req.z;
+    int popularity = (item->popularity < DIRTY_POPULARITY_MAX) ? item->popularity : DIRTY_POPULARITY_MAX;
+
+    return item->queued - (long)(MAX_ZOOM - z) * DIRTY_ZOOM_BONUS - (long)popularity * DIRTY_POPULARITY_BONUS;
+}
+
+static const struct dirty_policy dirtyPolicies[] = {
+    { "fifo", dirty_key_fifo },
+    { "zoom", dirty_key_zoom },
+    { NULL, NULL }
+};
+
+static const struct dirty_policy *dirtyPolicy = &dirtyPolicies[1];
+static struct item *dirtyHeap[DIRTY_LIMIT];
+static unsigned long queueSeq;
+
+static inline int dirty_before(const struct item *a, const struct item *b)
+{
+    return (a->dirtyKey < b->dirtyKey) || ((a->dirtyKey == b->dirtyKey) && (a->seq < b->seq));
+}
+
+static inline void dirty_heap_set(int idx, struct item *item)
+{
+    dirtyHeap[idx] = item;
+    item->heapIdx = idx;
+}
+
+static void dirty_heap_up(int idx)
+{
+    // call with dirtyLock held
+    struct item *item = dirtyHeap[idx];
+
+    while (idx > 0) {
+        int parent = (idx - 1) / 2;
+        if (!dirty_before(item, dirtyHeap[parent]))
+            break;
+        dirty_heap_set(idx, dirtyHeap[parent]);
+        idx = parent;
+    }
+    dirty_heap_set(idx, item);
+}
+
+static void dirty_heap_down(int idx)
+{
+    // call with dirtyLock held
+    struct item *item = dirtyHeap[idx];
+
+    while (1) {
+        int child = 2 * idx + 1;
+        if (child >= dirtyNum)
+            break;
+        if ((child + 1 < dirtyNum) && dirty_before(dirtyHeap[child + 1], dirtyHeap[child]))
+            child++;
+        if (!dirty_before(dirtyHeap[child], item))
+            break;
+        dirty_heap_set(idx, dirtyHeap[child]);
+        idx = child;
+    }
+    dirty_heap_set(idx, item);
+}
+
+static void dirty_push(struct item *item)
+{
+    // call with dirtyLock held, dirtyNum must be below DIRTY_LIMIT
+    dirty_heap_set(dirtyNum, item);
+    dirtyNum++;
+    dirty_heap_up(dirtyNum - 1);
+}
+
+static struct item *dirty_pop(void)
+{
+    // call with dirtyLock held
+    struct item *item = dirtyHeap[0];
+
+    dirtyNum--;
+    if (dirtyNum > 0) {
+        dirty_heap_set(0, dirtyHeap[dirtyNum]);
+        dirty_heap_down(0);
+    }
+    return item;
+}
+
+int request_queue_set_dirty_policy(const char *name)
+{
+    for (int i = 0; dirtyPolicies[i].name; i++) {
+        if (!strcmp(dirtyPolicies[i].name, name)) {
+            pthread_mutex_lock(&dirtyLock);
+            dirtyPolicy = &dirtyPolicies[i];
+            for (int j = 0; j < dirtyNum; j++)
+                dirtyHeap[j]->dirtyKey = dirtyPolicy->key(dirtyHeap[j]);
+            for (int j = dirtyNum / 2 - 1; j >= 0; j--)
+                dirty_heap_down(j);
+            pthread_mutex_unlock(&dirtyLock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void req_queue_init(struct req_queue *queue, enum queueEnum type)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->head.next = queue->head.prev = &queue->head;
+    queue->num = 0;
+    queue->ms = 0;
+    queue->type = type;
+}
+
+void request_queue_init(void)
+{
+    req_queue_init(&reqQueue, queueRequest);
+    req_queue_init(&reqPrioQueue, queueRequestPrio);
+    req_queue_init(&reqBulkQueue, queueRequestBulk);
+    pthread_mutex_init(&dirtyLock, NULL);
+    pthread_mutex_init(&waitLock, NULL);
+    pthread_mutex_init(&sleepLock, NULL);
+    pthread_cond_init(&qCond, NULL);
+    pthread_mutex_init(&poolLock, NULL);
+    item_pool_grow(ITEM_POOL_SIZE);
+    for (int i = 0; i < IDX_SHARDS; i++) {
+        pthread_mutex_init(&idxShards[i].lock, NULL);
+        idxShards[i].size = HASHIDX_SIZE / IDX_SHARDS;
+        idxShards[i].num = 0;
+        idxShards[i].table = (struct item_idx *) calloc(idxShards[i].size, sizeof(struct item_idx));
+    }
+}
+
+/* Pick the item to render from list. A thread which last rendered style
+ * xmlname at zoom z prefers another metatile of that style, ideally in the
+ * same zoom band, as long as it is within the first AFFINITY_SCAN items.
+ * The head of the queue may only be passed over AFFINITY_MAX_SKIPS times,
+ * so it does not starve while another style is busy.
+ */
+static struct item *pick_item(struct item *list, const char *xmlname, int z)
+{
+    struct item *head = list->next;
+    struct item *item, *style_match = NULL;
+    int i;
+
+    if (!xmlname || (head->skipped >= AFFINITY_MAX_SKIPS))
+        return head;
+
+    for (item = head, i = 0; (item != list) && (i < AFFINITY_SCAN); item = item->next, i++) {
+        if (strcmp(item->req.xmlname, xmlname))
+            continue;
+        if ((item->req.z / AFFINITY_ZOOM_BAND) == (z / AFFINITY_ZOOM_BAND)) {
+            style_match = item;
+            break;
+        }
+        if (!style_match)
+            style_match = item;
+    }
+
+    if (!style_match)
+        return head;
+    if (style_match != head)
+        head->skipped++;
+    return style_match;
+}
+
+struct item *fetch_request(void)
+{
+    return fetch_request_affinity(NULL, 0);
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Wake a render thread sleeping in wait_for_work(), if there is one. The bit
+ * in queueMask is set before sleepers is read here, and wait_for_work() counts
+ * itself in sleepers before reading queueMask, so at least one of the two
+ * sees the other.
+ */
+static void wake_worker(void)
+{
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&sleepLock);
+        pthread_cond_signal(&qCond);
+        pthread_mutex_unlock(&sleepLock);
+    }
+}
+
+static unsigned int wait_for_work(void)
+{
+    unsigned int mask = __atomic_load_n(&queueMask, __ATOMIC_SEQ_CST);
+
+    if (mask)
+        return mask;
+    pthread_mutex_lock(&sleepLock);
+    __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!(mask = __atomic_load_n(&queueMask, __ATOMIC_SEQ_CST)))
+        pthread_cond_wait(&qCond, &sleepLock);
+    __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&sleepLock);
+    return mask;
+}
+
+/* Add item to the end of queue, unless that is full. Requeued items go back
+ * to the front, the limit does not apply to them as they were in it before.
+ * The caller wakes a render thread once it has let go of its other locks, a
+ * render thread woken while they are held would only block on them.
+ */
+static int queue_add(struct req_queue *queue, struct item *item, int requeue)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (!requeue && (queue->num >= REQ_LIMIT)) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    if (requeue) {
+        item->prev = &queue->head;
+        item->next = queue->head.next;
+    } else {
+        item->next = &queue->head;
+        item->prev = queue->head.prev;
+    }
+    item->prev->next = item;
+    item->next->prev = item;
+    item->originatedQueue = queue->type;
+    __atomic_store_n(&item->inQueue, queue->type, __ATOMIC_RELAXED);
+    __sync_fetch_and_add(&queue->ms, item->estimate);
+    if (__atomic_fetch_add(&queue->num, 1, __ATOMIC_RELAXED) == 0)
+        __atomic_fetch_or(&queueMask, QUEUE_BIT(queue->type), __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+static struct item *queue_take(struct req_queue *queue, const char *xmlname, int z)
+{
+    struct item *item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    // Another render thread may have emptied it since queueMask was read
+    if (queue->num > 0) {
+        item = pick_item(&queue->head, xmlname, z);
+        item->next->prev = item->prev;
+        item->prev->next = item->next;
+        __atomic_store_n(&item->inQueue, queueRender, __ATOMIC_RELAXED);
+        __sync_fetch_and_sub(&queue->ms, item->estimate);
+        if (__atomic_sub_fetch(&queue->num, 1, __ATOMIC_RELAXED) == 0)
+            __atomic_fetch_and(&queueMask, ~QUEUE_BIT(queue->type), __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+/* Add item to the dirty queue, unless that is full. A requeued item keeps
+ * its key, so it is near the top of the heap again.
+ */
+static int dirty_add(struct item *item, int requeue)
+{
+    pthread_mutex_lock(&dirtyLock);
+    if (dirtyNum >= DIRTY_LIMIT) {
+        pthread_mutex_unlock(&dirtyLock);
+        return 0;
+    }
+    if (!requeue)
+        item->dirtyKey = dirtyPolicy->key(item);
+    item->originatedQueue = queueDirty;
+    __atomic_store_n(&item->inQueue, queueDirty, __ATOMIC_RELAXED);
+    dirty_push(item);
+    if (dirtyNum == 1)
+        __atomic_fetch_or(&queueMask, QUEUE_BIT(queueDirty), __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&dirtyLock);
+    return 1;
+}
+
+static struct item *dirty_take(void)
+{
+    struct item *item = NULL;
+
+    pthread_mutex_lock(&dirtyLock);
+    if (dirtyNum > 0) {
+        item = dirty_pop();
+        __atomic_store_n(&item->inQueue, queueRender, __ATOMIC_RELAXED);
+        if (dirtyNum == 0)
+            __atomic_fetch_and(&queueMask, ~QUEUE_BIT(queueDirty), __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&dirtyLock);
+    return item;
+}
+
+/* Waiter lists of client connections, all protected by waitLock */
+static void waiter_link(struct waiter_list *waiters, struct item *item)
+{
+    item->waitNext = waiters->head;
+    if (waiters->head)
+        waiters->head->waitPrev = &item->waitNext;
+    waiters->head = item;
+    item->waitPrev = &waiters->head;
+}
+
+static void waiter_unlink(struct item *item)
+{
+    if (!item->waitPrev)
+        return;
+    *item->waitPrev = item->waitNext;
+    if (item->waitNext)
+        item->waitNext->waitPrev = item->waitPrev;
+    item->waitNext = NULL;
+    item->waitPrev = NULL;
+}
+
+/* Is anybody still waiting for the item or one of its duplicates?
+ * Duplicates are only attached with both the shard lock and waitLock held,
+ * so either of them is enough to walk the list.
+ */
+static int has_waiters(const struct item *item, long now)
+{
+    // call with waitLock held
+    for (; item; item = item->duplicates) {
+        if ((item->fd != FD_INVALID) && ((item->deadline == 0) || (item->deadline > now)))
+            return 1;
+    }
+    return 0;
+}
+
+static int attach_duplicate(struct item *item, struct item *dupe, struct waiter_list *waiters)
+{
+    // call with the shard lock of item held. Fails if the item is expiring,
+    // nobody would answer dupe then.
+    pthread_mutex_lock(&waitLock);
+    if (__atomic_load_n(&item->inQueue, __ATOMIC_RELAXED) == queueDropped) {
+        pthread_mutex_unlock(&waitLock);
+        return 0;
+    }
+    dupe->inQueue = queueDuplicate;
+    dupe->duplicates = item->duplicates;
+    if (waiters && (dupe->fd != FD_INVALID))
+        waiter_link(waiters, dupe);
+    item->duplicates = dupe;
+    pthread_mutex_unlock(&waitLock);
+    return 1;
+}
+
+/* Answer the clients waiting for item and its duplicates with rsp and return
+ * them all to the pool. The item must have been removed from the index, so
+ * that no more duplicates can be attached to it.
+ */
+static void answer_item(struct item *item, enum protoCmd rsp)
+{
+    struct protocol *req;
+
+    pthread_mutex_lock(&waitLock);
+    for (struct item *dupe = item; dupe; dupe = dupe->duplicates)
+        waiter_unlink(dupe);
+    pthread_mutex_unlock(&waitLock);
+
+    while (item) {
+        struct item *prev = item;
+        req = &item->req;
+        if ((item->fd != FD_INVALID) && ((req->cmd == cmdRender) || (req->cmd == cmdRenderPrio) || (req->cmd == cmdRenderBulk)))
+            send_reply(item->fd, req, item->id, rsp);
+        item = item->duplicates;
+        item_free(prev);
+    }
+}
+
+static void drop_item(struct item *item)
+{
+    struct idx_shard *shard = shard_of(item->key);
+
+    __sync_fetch_and_add(&noReqDroped, 1);
+    pthread_mutex_lock(&shard->lock);
+    remove_item_idx(item);
+    pthread_mutex_unlock(&shard->lock);
+    // Whoever asked for it since is told right away
+    answer_item(item, cmdNotDone);
+}
+
+/* If nobody is waiting for an interactive request any more, rather than
+ * taking a render slot from someone who is, move it to the dirty queue so the
+ * metatile still gets refreshed eventually, or drop it if that is full.
+ * Returns 0 if the item is still wanted.
+ */
+static int expire_item(struct item *item, long now)
+{
+    // The item has already been taken out of its queue
+    pthread_mutex_lock(&waitLock);
+    if (has_waiters(item, now)) {
+        pthread_mutex_unlock(&waitLock);
+        return 0;
+    }
+    // No duplicate may be attached between the check and here, or nobody
+    // would answer it
+    for (struct item *dupe = item; dupe; dupe = dupe->duplicates) {
+        waiter_unlink(dupe);
+        dupe->fd = FD_INVALID;
+    }
+    __atomic_store_n(&item->inQueue, queueDropped, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&waitLock);
+
+    // The render thread goes on to look for work itself, nobody to wake
+    __sync_fetch_and_add(&noReqExpired, 1);
+    if (!dirty_add(item, 0))
+        drop_item(item);
+    return 1;
+}
+
+struct item *fetch_request_affinity(const char *xmlname, int z)
+{
+    struct item *item = NULL;
+    long *counter = NULL;
+
+    while (!item) {
+        unsigned int mask = wait_for_work();
+
+        if (mask & QUEUE_BIT(queueRequestPrio)) {
+            item = queue_take(&reqPrioQueue, xmlname, z);
+            counter = &noReqPrioRender;
+        } else if (mask & QUEUE_BIT(queueRequest)) {
+            item = queue_take(&reqQueue, xmlname, z);
+            counter = &noReqRender;
+        } else if (mask & QUEUE_BIT(queueDirty)) {
+            // The dirty policy decides, not the affinity of the thread
+            item = dirty_take();
+            counter = &noDirtyRender;
+        } else {
+            item = queue_take(&reqBulkQueue, xmlname, z);
+            counter = &noReqBulkRender;
+        }
+
+        if (item && ((item->originatedQueue == queueRequest) || (item->originatedQueue == queueRequestPrio)) && expire_item(item, now_ms()))
+            item = NULL;
+    }
+
+    __sync_fetch_and_add(&renderMs, item->estimate);
+    __sync_fetch_and_add(counter, 1);
+
+    return item;
+}
+
+void requeue_request(struct item *item)
+{
+    struct req_queue *queue;
+    long *counter;
+
+    switch (item->originatedQueue) {
+        case queueRequestPrio:  queue = &reqPrioQueue;  counter = &noReqPrioRender;  break;
+        case queueRequest:      queue = &reqQueue;      counter = &noReqRender;      break;
+        case queueRequestBulk:  queue = &reqBulkQueue;  counter = &noReqBulkRender;  break;
+        default:                queue = NULL;           counter = &noDirtyRender;    break;
+    }
+
+    // It has not been rendered after all
+    __sync_fetch_and_sub(counter, 1);
+
+    __sync_fetch_and_sub(&renderMs, item->estimate);
+    item->retries++;
+    if (queue) {
+        // Put it at the front of its queue, so that it is next in line again
+        queue_add(queue, item, 1);
+    } else if (!dirty_add(item, 1)) {
+        // The dirty queue filled up in the meantime
+        drop_item(item);
+        return;
+    }
+    wake_worker();
+}
+
+void clear_requests(struct waiter_list *waiters)
+{
+    struct item *item;
+
+    pthread_mutex_lock(&waitLock);
+    while ((item = waiters->head)) {
+        waiters->head = item->waitNext;
+        item->fd = FD_INVALID;
+        item->waitNext = NULL;
+        item->waitPrev = NULL;
+    }
+    pthread_mutex_unlock(&waitLock);
+}
+
+
+static uint64_t calcHashKey(const struct item *item) {
+    // FNV-1a over the style name, then mix in the metatile position
+    uint64_t key = 14695981039346656037ULL;
+    for (int i = 0; item->req.xmlname[i] != 0; i++) {
+        key ^= (unsigned char)item->req.xmlname[i];
+        key *= 1099511628211ULL;
+    }
+    key ^= ((uint64_t)(item->req.z & 0xFF) << 56) ^ ((uint64_t)(item->mx & 0xFFFFFFF) << 28) ^ (uint64_t)(item->my & 0xFFFFFFF);
+    // Finalizer from MurmurHash3, so that all bits affect the slot
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline int same_metatile(const struct item *a, const struct item *b) {
+    return (a->mx == b->mx) && (a->my == b->my) && (a->req.z == b->req.z)
+        && !strcmp(a->req.xmlname, b->req.xmlname);
+}
+
+/* The index functions are called with the lock of the shard of the item held */
+static inline unsigned int probe_distance(uint64_t key, unsigned int slot, unsigned int size) {
+    return (slot - (unsigned int)key) & (size - 1);
+}
+
+static void insert_slot(struct item_idx *table, unsigned int size, uint64_t key, struct item *item) {
+    unsigned int mask = size - 1;
+    unsigned int slot = key & mask;
+    unsigned int dist = 0;
+
+    while (table[slot].item != NULL) {
+        unsigned int existing = (slot - (unsigned int)table[slot].key) & mask;
+        if (existing < dist) {
+            // Robin hood: take the slot from the item which is closer to home
+            struct item_idx tmp = table[slot];
+            table[slot].key = key;
+            table[slot].item = item;
+            key = tmp.key;
+            item = tmp.item;
+            dist = existing;
+        }
+        slot = (slot + 1) & mask;
+        dist++;
+    }
+    table[slot].key = key;
+    table[slot].item = item;
+}
+
+static void resize_item_idx(struct idx_shard *shard, unsigned int size) {
+    struct item_idx *old = shard->table;
+    unsigned int oldSize = shard->size;
+    struct item_idx *table = (struct item_idx *)calloc(size, sizeof(struct item_idx));
+
+    if (!table) {
+        syslog(LOG_ERR, "Failed to resize request index to %u entries", size);
+        return;
+    }
+    for (unsigned int i = 0; i < oldSize; i++) {
+        if (old[i].item)
+            insert_slot(table, size, old[i].key, old[i].item);
+    }
+    shard->table = table;
+    shard->size = size;
+    free(old);
+}
+
+static void insert_item_idx(struct item *item) {
+    struct idx_shard *shard = shard_of(item->key);
+
+    // Keep the load factor below 3/4
+    if ((shard->num + 1) * 4 > shard->size * 3)
+        resize_item_idx(shard, shard->size * 2);
+    insert_slot(shard->table, shard->size, item->key, item);
+    shard->num++;
+}
+
+static int find_slot(const struct idx_shard *shard, const struct item *item) {
+    unsigned int mask = shard->size - 1;
+    unsigned int slot = item->key & mask;
+    unsigned int dist = 0;
+
+    while (shard->table[slot].item != NULL) {
+        // Every item further along is closer to its home, so ours can't be there
+        if (probe_distance(shard->table[slot].key, slot, shard->size) < dist)
+            break;
+        if ((shard->table[slot].key == item->key) && same_metatile(shard->table[slot].item, item))
+            return slot;
+        slot = (slot + 1) & mask;
+        dist++;
+    }
+    return -1;
+}
+
+static void remove_item_idx(struct item * item) {
+    struct idx_shard *shard = shard_of(item->key);
+    struct item_idx *table = shard->table;
+    unsigned int mask = shard->size - 1;
+    unsigned int next;
+    int slot = find_slot(shard, item);
+
+    if (slot < 0) {
+        //item not in index;
+        return;
+    }
+    // Shift the following items back until one is in its home slot
+    next = (slot + 1) & mask;
+    while ((table[next].item != NULL) && (probe_distance(table[next].key, next, shard->size) != 0)) {
+        table[slot] = table[next];
+        slot = next;
+        next = (next + 1) & mask;
+    }
+    table[slot].item = NULL;
+    table[slot].key = 0;
+    shard->num--;
+}
+
+static struct item * lookup_item_idx(struct item * item) {
+    struct idx_shard *shard = shard_of(item->key);
+    int slot = find_slot(shard, item);
+    return (slot < 0) ? NULL : shard->table[slot].item;
+}
+
+static void send_frame(int fd, const struct protocol *req, int id, enum protoCmd rsp, int retry_after)
+{
+    // Send header and item with a single call, so that responses from
+    // different render threads do not get interleaved
+    struct {
+        struct protocol_v3 hdr;
+        struct protocol_v3_item item;
+    } frame;
+    int ret;
+
+    bzero(&frame, sizeof(frame));
+    frame.hdr.ver = PROTO_VER_BATCH;
+    frame.hdr.count = 1;
+    frame.hdr.itemsize = sizeof(frame.item);
+    frame.item.id = id;
+    frame.item.cmd = rsp;
+    frame.item.x = req->x;
+    frame.item.y = req->y;
+    frame.item.z = req->z;
+    strcpy(frame.item.xmlname, req->xmlname);
+    frame.item.retry_after = retry_after;
+    if (fd <= SHM_RING_FD(0)) {
+        // A client of the shared memory ring, it gives up if its ring is full
+        shm_ring_reply(SHM_RING_SLOT(fd), &frame.item);
+        return;
+    }
+    ret = send(fd, &frame, sizeof(frame), 0);
+    if (ret != sizeof(frame))
+        perror("send error during send_reply");
+}
+
+void send_reply(int fd, const struct protocol *req, int id, enum protoCmd rsp)
+{
+    if (req->ver == PROTO_VER_BATCH) {
+        send_frame(fd, req, id, rsp, 0);
+    } else {
+        struct protocol resp = *req;
+        int ret;
+
+        resp.cmd = rsp;
+        ret = send(fd, &resp, sizeof(resp), 0);
+        if (ret != sizeof(resp))
+            perror("send error during send_reply");
+    }
+}
+
+void send_busy(int fd, const struct protocol *req, int id, int retry_after)
+{
+    send_frame(fd, req, id, cmdBusy, retry_after);
+}
+
+void send_response(struct item *item, enum protoCmd rsp)
+{
+    struct idx_shard *shard = shard_of(item->key);
+
+    // Once it is out of the index nobody can attach duplicates any more
+    pthread_mutex_lock(&shard->lock);
+    remove_item_idx(item);
+    pthread_mutex_unlock(&shard->lock);
+
+    __sync_fetch_and_sub(&renderMs, item->estimate);
+    answer_item(item, rsp);
+}
+
+
+static enum protoCmd pending(struct item *test, struct waiter_list *waiters)
+{
+    // check the index of queued and rendering items to see if this request
+    // is already queued
+    // If so, add this new request as a duplicate
+    // call with the shard lock of test held
+    struct item *item;
+    enum queueEnum queue;
+
+    item = lookup_item_idx(test);
+    if (item == NULL)
+        return cmdRender;
+
+    // The item moves between queues with only their locks held. Should it
+    // just have moved, the request is answered as if it had come a moment
+    // earlier or later, or waits for the item in the dirty queue.
+    queue = __atomic_load_n(&item->inQueue, __ATOMIC_RELAXED);
+    if ((queue == queueRender) || (queue == queueRequest) || (queue == queueRequestPrio))
+        return attach_duplicate(item, test, waiters) ? cmdIgnore : cmdNotDone;
+    if ((queue == queueDirty) && (test->popularity > 0)) {
+        // More people want it, move it up the dirty queue. It only enters and
+        // leaves that with dirtyLock held.
+        pthread_mutex_lock(&dirtyLock);
+        if (__atomic_load_n(&item->inQueue, __ATOMIC_RELAXED) == queueDirty) {
+            item->popularity += test->popularity;
+            item->dirtyKey = dirtyPolicy->key(item);
+            dirty_heap_up(item->heapIdx);
+        }
+        pthread_mutex_unlock(&dirtyLock);
+    }
+    if (((queue == queueDirty) || (queue == queueRequestBulk)) && (test->req.cmd == cmdRenderBulk) && waiters && (test->fd != FD_INVALID)) {
+        // Bulk clients are in no hurry, they wait for it as well
+        return attach_duplicate(item, test, waiters) ? cmdIgnore : cmdNotDone;
+    }
+    return cmdNotDone;
+}
+
+/* Expected time in ms until a new request of type cmd is finished, if it
+ * takes estimate ms to render. Requests being rendered are assumed to be
+ * half way through.
+ */
+static long expected_wait(enum protoCmd cmd, long estimate)
+{
+    long ahead = __atomic_load_n(&reqPrioQueue.ms, __ATOMIC_RELAXED);
+
+    if (cmd != cmdRenderPrio)
+        ahead += __atomic_load_n(&reqQueue.ms, __ATOMIC_RELAXED);
+    return (ahead + __atomic_load_n(&renderMs, __ATOMIC_RELAXED) / 2) / __atomic_load_n(&numWorkers, __ATOMIC_RELAXED) + estimate;
+}
+
+enum protoCmd request_queue_add(struct item *item, struct waiter_list *waiters, int *retry_after)
+{
+    const struct protocol *req = &item->req;
+    struct idx_shard *shard;
+    enum protoCmd pend;
+    long busy = 0;
+    int answered, queued = 0;
+
+    item->key = calcHashKey(item);
+    item->received = now_ms();
+    item->deadline = item->timeout ? item->received + item->timeout : 0;
+    item->waitNext = NULL;
+    item->waitPrev = NULL;
+
+    shard = shard_of(item->key);
+    pthread_mutex_lock(&shard->lock);
+
+    // Check for a matching request in the current rendering or dirty queues
+    pend = pending(item, waiters);
+    if (pend == cmdNotDone) {
+        // We found a match in the dirty queue, can not wait for it
+        pthread_mutex_unlock(&shard->lock);
+        item_free(item);
+        return cmdNotDone;
+    }
+    if (pend == cmdIgnore) {
+        // Found a match in render queue, item added as duplicate
+        pthread_mutex_unlock(&shard->lock);
+        return cmdIgnore;
+    }
+
+    // Holding the shard lock, nobody else can queue the same metatile
+    item->estimate = __atomic_load_n(&renderTimeZoom[req->z], __ATOMIC_RELAXED);
+    if ((item->timeout > 0) && ((req->cmd == cmdRender) || (req->cmd == cmdRenderPrio))) {
+        busy = expected_wait(req->cmd, item->estimate) - item->timeout;
+        if (busy > 0) {
+            // The client would give up before we are done, tell it right
+            // away and render the metatile in the background
+            *retry_after = (busy < ADMISSION_RETRY_MIN) ? ADMISSION_RETRY_MIN : busy;
+            __sync_fetch_and_add(&noReqBusy, 1);
+        }
+    }
+
+    item->retries = 0;
+    item->skipped = 0;
+    item->queued = time(NULL);
+    item->seq = __sync_fetch_and_add(&queueSeq, 1);
+    // A render thread may take it as soon as it is queued
+    answered = (item->fd != FD_INVALID);
+    if (waiters && answered) {
+        pthread_mutex_lock(&waitLock);
+        waiter_link(waiters, item);
+        pthread_mutex_unlock(&waitLock);
+    }
+
+    // New request, add it to render or dirty queue
+    if ((busy <= 0) && (req->cmd == cmdRender))
+        queued = queue_add(&reqQueue, item, 0);
+    else if ((busy <= 0) && (req->cmd == cmdRenderPrio))
+        queued = queue_add(&reqPrioQueue, item, 0);
+    else if (req->cmd == cmdRenderBulk)
+        queued = queue_add(&reqBulkQueue, item, 0);
+    if (!queued) {
+        // No response after render, except to bulk clients which wait for
+        // their requests however long they take
+        if (answered && ((req->cmd != cmdRenderBulk) || !waiters)) {
+            pthread_mutex_lock(&waitLock);
+            waiter_unlink(item);
+            item->fd = FD_INVALID;
+            pthread_mutex_unlock(&waitLock);
+            answered = 0;
+        }
+        queued = dirty_add(item, 0);
+    }
+    if (!queued) {
+        // The queue is severely backlogged. Drop request
+        pthread_mutex_unlock(&shard->lock);
+        if (answered) {
+            pthread_mutex_lock(&waitLock);
+            waiter_unlink(item);
+            pthread_mutex_unlock(&waitLock);
+        }
+        __sync_fetch_and_add(&noReqDroped, 1);
+        item_free(item);
+        return (busy > 0) ? cmdBusy : cmdNotDone;
+    }
+
+    /* In addition to the linked list, add item to a hash table index
+     * for faster lookup of pending requests. It may already be rendering,
+     * but it can not be finished before it is in there: send_response()
+     * and drop_item() need the shard lock first.
+     */
+    insert_item_idx(item);
+    pthread_mutex_unlock(&shard->lock);
+    wake_worker();
+
+    if (busy > 0)
+        return cmdBusy;
+    // The item may be rendered and gone already, do not touch it any more
+    return answered ? cmdIgnore : cmdNotDone;
+}
+
+void request_queue_render_time(int z, long ms)
+{
+    long avg;
+
+    if ((z < 0) || (z > MAX_ZOOM))
+        return;
+    // Moving average over roughly the last eight metatiles. Should two render
+    // threads update it at once, one of their times gets lost, which does
+    // not matter for an estimate.
+    avg = __atomic_load_n(&renderTimeZoom[z], __ATOMIC_RELAXED);
+    __atomic_store_n(&renderTimeZoom[z], avg ? (7 * avg + ms) / 8 : ms, __ATOMIC_RELAXED);
+}
+
+void request_queue_set_workers(int num)
+{
+    __atomic_store_n(&numWorkers, (num > 0) ? num : 1, __ATOMIC_RELAXED);
+}
+
+int request_queue_waiting(void)
+{
+    return __atomic_load_n(&reqQueue.num, __ATOMIC_RELAXED) + __atomic_load_n(&reqPrioQueue.num, __ATOMIC_RELAXED)
+        + __atomic_load_n(&reqBulkQueue.num, __ATOMIC_RELAXED);
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+    time_t ta = *(const time_t *)a, tb = *(const time_t *)b;
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+void request_queue_counters(stats_struct *stats, int *reqLen, int *reqPrioLen, int *reqBulkLen, int *dirtyLen)
+{
+    stats->noDirtyRender = __atomic_load_n(&noDirtyRender, __ATOMIC_RELAXED);
+    stats->noReqRender = __atomic_load_n(&noReqRender, __ATOMIC_RELAXED);
+    stats->noReqPrioRender = __atomic_load_n(&noReqPrioRender, __ATOMIC_RELAXED);
+    stats->noReqBulkRender = __atomic_load_n(&noReqBulkRender, __ATOMIC_RELAXED);
+    stats->noReqDroped = __atomic_load_n(&noReqDroped, __ATOMIC_RELAXED);
+    stats->noReqBusy = __atomic_load_n(&noReqBusy, __ATOMIC_RELAXED);
+    stats->noReqExpired = __atomic_load_n(&noReqExpired, __ATOMIC_RELAXED);
+
+    // Only changed with the lock of their queue held, but a slightly stale
+    // value will do
+    *reqLen = __atomic_load_n(&reqQueue.num, __ATOMIC_RELAXED);
+    *reqPrioLen = __atomic_load_n(&reqPrioQueue.num, __ATOMIC_RELAXED);
+    *reqBulkLen = __atomic_load_n(&reqBulkQueue.num, __ATOMIC_RELAXED);
+    *dirtyLen = __atomic_load_n(&dirtyNum, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&poolLock);
+    stats->itemPoolSize = itemPoolSize;
+    stats->itemPoolFree = itemPoolFree;
+    stats->itemPoolRefills = itemPoolRefills;
+    stats->itemPoolFlushes = itemPoolFlushes;
+    stats->itemPoolGrowths = itemPoolGrowths;
+    pthread_mutex_unlock(&poolLock);
+}
+
+void request_queue_stats(stats_struct *stats, int *reqLen, int *reqPrioLen, int *reqBulkLen, int *dirtyLen)
+{
+    time_t ages[DIRTY_LIMIT];
+    time_t now;
+    int num;
+
+    request_queue_counters(stats, reqLen, reqPrioLen, reqBulkLen, dirtyLen);
+
+    pthread_mutex_lock(&dirtyLock);
+    for (int i = 0; i < dirtyNum; i++)
+        ages[i] = dirtyHeap[i]->queued;
+    num = dirtyNum;
+    pthread_mutex_unlock(&dirtyLock);
+
+    // The oldest requests are at the front after sorting, so the age
+    // percentiles are counted from there
+    qsort(ages, num, sizeof(ages[0]), cmp_time);
+    now = time(NULL);
+    stats->dirtyAgeP50 = num ? now - ages[num / 2] : 0;
+    stats->dirtyAgeP90 = num ? now - ages[num / 10] : 0;
+    stats->dirtyAgeP99 = num ? now - ages[num / 100] : 0;
+    stats->dirtyAgeMax = num ? now - ages[0] : 0;
+}
@@ -0,0 +1,92 @@
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include "gen_tile.h"
+#include "daemon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Render request queues of renderd
+ *
+ * Requests are kept in four queues which are served in the order
+ * prio > request > dirty > bulk, plus the list of requests currently being
+ * rendered. The dirty queue is ordered by a configurable policy, the others
+ * are FIFO. A request for a metatile which is already queued or being
+ * rendered is attached to the existing item as a duplicate, so that all
+ * clients are answered once the metatile has been rendered.
+ *
+ * Render threads use fetch_request_affinity() to prefer metatiles of the
+ * style they rendered last, within the highest priority queue that has work.
+ * Interactive requests whose clients have all disconnected or passed their
+ * deadline are moved to the dirty queue instead of being rendered right away.
+ *
+ * fetch_request(), send_response() and delete_request() are declared in
+ * gen_tile.h as they are used by the render threads.
+ */
+
+void request_queue_init(void);
+
+/* Get an item from the item pool, or NULL if out of memory.
+ * Items are returned to the pool by send_response() or request_queue_add(),
+ * or with item_free() if they never get queued.
+ */
+struct item *item_alloc(void);
+void item_free(struct item *item);
+
+/* Queue a new request. The item must have req, mx, my, fd, popularity and
+ * timeout filled in. If the client is going to get a response, the item is
+ * put on waiters, the list of requests of the client connection. Returns cmdIgnore if the client will get a response once
+ * the item has been rendered, cmdNotDone if it will not (the item has then
+ * been returned to the pool or moved to the dirty queue). Returns cmdBusy if
+ * the request could not be finished within its timeout, retry_after is then
+ * set to the number of milliseconds the client should wait before trying
+ * again.
+ */
+enum protoCmd request_queue_add(struct item *item, struct waiter_list *waiters, int *retry_after);
+
+/* Feed the render time of a metatile at zoom z into the estimates used by
+ * admission control
+ */
+void request_queue_render_time(int z, long ms);
+
+/* Number of threads rendering locally or on slaves */
+void request_queue_set_workers(int num);
+
+/* Send response rsp for request req to fd, using the protocol version of the
+ * request. id is the request id of version 3 clients.
+ */
+void send_reply(int fd, const struct protocol *req, int id, enum protoCmd rsp);
+
+/* Tell a version 3 client to retry request req after retry_after ms */
+void send_busy(int fd, const struct protocol *req, int id, int retry_after);
+
+/* Forget about a client connection, no responses will be sent for the
+ * requests on its waiter list
+ */
+void clear_requests(struct waiter_list *waiters);
+
+/* Number of render requests waiting in the queues, not counting dirty ones */
+int request_queue_waiting(void);
+
+/* Select how the dirty queue is ordered: "fifo" or "zoom", which prefers
+ * low zoom levels and popular metatiles. Returns 0 for an unknown policy.
+ */
+int request_queue_set_dirty_policy(const char *name);
+
+/* Copy the queue and item pool related counters into stats, together with
+ * the current queue lengths. Does not take any of the queue locks.
+ */
+void request_queue_counters(stats_struct *stats, int *reqLen, int *reqPrioLen, int *reqBulkLen, int *dirtyLen);
+
+/* Like request_queue_counters(), and also works out the age of the dirty
+ * requests, which needs the lock of the dirty queue
+ */
+void request_queue_stats(stats_struct *stats, int *reqLen, int *reqPrioLen, int *reqBulkLen, int *dirtyLen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,305 @@
+/* Shared memory transport between mod_tile and renderd, see shm_ring.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shm_ring.h"
+
+// The ring created by this process, responses of renderd go there
+static struct shm_ring *serverRing;
+
+static void futex_wait(uint32_t *addr, uint32_t val, int timeout)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+#ifdef __linux__
+    // Not FUTEX_PRIVATE_FLAG, the word is shared between processes
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    // Without futexes poll the ring every millisecond
+    if (ts.tv_sec || (ts.tv_nsec > 1000000L)) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000000L;
+    }
+    if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+        nanosleep(&ts, NULL);
+#endif
+}
+
+static void futex_wake(uint32_t *addr)
+{
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void queue_init(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size)
+{
+    q->head = 0;
+    q->tail = 0;
+    q->wake = 0;
+    q->sleeping = 0;
+    for (uint32_t i = 0; i < size; i++)
+        cells[i].seq = i;
+}
+
+/* A cell is free for the producer at position pos if its seq is pos, and
+ * holds an item for the consumer at pos if its seq is pos + 1. Popping the
+ * item makes it free for the producer going round the ring next time.
+ */
+static int queue_push(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size, int slot, const struct protocol_v3_item *item)
+{
+    uint32_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct shm_ring_cell *cell;
+
+    while (1) {
+        int32_t diff;
+
+        cell = &cells[pos & (size - 1)];
+        diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // The consumer has not caught up yet, the ring is full
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    cell->slot = slot;
+    cell->item = *item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Either the consumer sees the new item before going to sleep, or we see
+    // that it is sleeping and wake it up
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&q->wake, 1, __ATOMIC_RELEASE);
+        futex_wake(&q->wake);
+    }
+    return 1;
+}
+
+static int queue_ready(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size)
+{
+    uint32_t pos = q->tail;
+
+    return __atomic_load_n(&cells[pos & (size - 1)].seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+static int queue_pop(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size, int *slot, struct protocol_v3_item *item)
+{
+    uint32_t pos = q->tail;
+    struct shm_ring_cell *cell = &cells[pos & (size - 1)];
+
+    if (!queue_ready(q, cells, size))
+        return 0;
+    if (slot)
+        *slot = cell->slot;
+    *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + size, __ATOMIC_RELEASE);
+    q->tail = pos + 1;
+    return 1;
+}
+
+static void queue_wait(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size, int timeout)
+{
+    uint32_t wake = __atomic_load_n(&q->wake, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!queue_ready(q, cells, size))
+        futex_wait(&q->wake, wake, timeout);
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/* Pop the next item, waiting until deadline (in ms of now_ms()) */
+static int queue_pop_wait(struct shm_ring_queue *q, struct shm_ring_cell *cells, uint32_t size, int *slot, struct protocol_v3_item *item, long deadline)
+{
+    while (1) {
+        long now;
+
+        if (queue_pop(q, cells, size, slot, item))
+            return 1;
+        now = now_ms();
+        if (now >= deadline)
+            return 0;
+        queue_wait(q, cells, size, deadline - now);
+    }
+}
+
+struct shm_ring *shm_ring_create(const char *name)
+{
+    struct shm_ring *ring;
+    int fd;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+        return NULL;
+    // Apache must be able to use the ring, whatever our umask is
+    if ((fchmod(fd, 0666) < 0) || (ftruncate(fd, sizeof(struct shm_ring)) < 0)) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    ring = (struct shm_ring *)mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    ring->version = SHM_RING_VERSION;
+    ring->server = getpid();
+    queue_init(&ring->queue, ring->cells, SHM_RING_SIZE);
+    for (int i = 0; i < SHM_RING_CLIENTS; i++) {
+        ring->clients[i].owner = 0;
+        ring->clients[i].generation = 0;
+        queue_init(&ring->clients[i].queue, ring->clients[i].cells, SHM_RING_RESPONSES);
+    }
+    __atomic_store_n(&ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    serverRing = ring;
+    return ring;
+}
+
+void shm_ring_destroy(struct shm_ring *ring, const char *name)
+{
+    if (ring == serverRing)
+        serverRing = NULL;
+    munmap(ring, sizeof(struct shm_ring));
+    shm_unlink(name);
+}
+
+int shm_ring_next(struct shm_ring *ring, int *slot, struct protocol_v3_item *item, int timeout)
+{
+    return queue_pop_wait(&ring->queue, ring->cells, SHM_RING_SIZE, slot, item, now_ms() + timeout);
+}
+
+int shm_ring_reply(int slot, const struct protocol_v3_item *item)
+{
+    struct shm_ring_client *client;
+
+    if (!serverRing || (slot < 0) || (slot >= SHM_RING_CLIENTS))
+        return 0;
+    client = &serverRing->clients[slot];
+    return queue_push(&client->queue, client->cells, SHM_RING_RESPONSES, slot, item);
+}
+
+struct shm_ring *shm_ring_attach(const char *name)
+{
+    struct shm_ring *ring;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    if ((fstat(fd, &st) < 0) || (st.st_size != (off_t)sizeof(struct shm_ring))) {
+        // Created by a renderd with different ring sizes
+        close(fd);
+        return NULL;
+    }
+    ring = (struct shm_ring *)mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+        return NULL;
+
+    if ((__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC) ||
+            (ring->version != SHM_RING_VERSION) || !shm_ring_alive(ring)) {
+        munmap(ring, sizeof(struct shm_ring));
+        return NULL;
+    }
+    return ring;
+}
+
+void shm_ring_detach(struct shm_ring *ring)
+{
+    munmap(ring, sizeof(struct shm_ring));
+}
+
+int shm_ring_alive(struct shm_ring *ring)
+{
+    // renderd usually runs as a different user, EPERM still means it is there
+    return (kill(ring->server, 0) == 0) || (errno == EPERM);
+}
+
+static int claim_slot(struct shm_ring *ring, int slot, pid_t owner, uint32_t *generation)
+{
+    struct shm_ring_client *client = &ring->clients[slot];
+    struct protocol_v3_item stale;
+
+    if (!__atomic_compare_exchange_n(&client->owner, &owner, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    *generation = __atomic_add_fetch(&client->generation, 1, __ATOMIC_RELAXED);
+    // Throw away responses meant for the previous owner
+    while (queue_pop(&client->queue, client->cells, SHM_RING_RESPONSES, NULL, &stale))
+        ;
+    return 1;
+}
+
+int shm_ring_claim(struct shm_ring *ring, uint32_t *generation)
+{
+    int i;
+
+    for (i = 0; i < SHM_RING_CLIENTS; i++) {
+        if ((__atomic_load_n(&ring->clients[i].owner, __ATOMIC_RELAXED) == 0) && claim_slot(ring, i, 0, generation))
+            return i;
+    }
+
+    // All slots are taken, look for those of processes which died
+    for (i = 0; i < SHM_RING_CLIENTS; i++) {
+        pid_t owner = __atomic_load_n(&ring->clients[i].owner, __ATOMIC_RELAXED);
+        if (owner && (kill(owner, 0) < 0) && (errno == ESRCH) && claim_slot(ring, i, owner, generation))
+            return i;
+    }
+    return -1;
+}
+
+void shm_ring_release(struct shm_ring *ring, int slot)
+{
+    struct protocol_v3_item item;
+
+    // If the ring is full renderd answers our requests to the next owner,
+    // which tells them apart by the generation in their ids
+    memset(&item, 0, sizeof(item));
+    item.cmd = SHM_RING_RELEASE;
+    shm_ring_submit(ring, slot, &item);
+    __atomic_store_n(&ring->clients[slot].owner, 0, __ATOMIC_RELEASE);
+}
+
+int shm_ring_submit(struct shm_ring *ring, int slot, const struct protocol_v3_item *item)
+{
+    return queue_push(&ring->queue, ring->cells, SHM_RING_SIZE, slot, item);
+}
+
+int shm_ring_response(struct shm_ring *ring, int slot, struct protocol_v3_item *item, int timeout)
+{
+    struct shm_ring_client *client = &ring->clients[slot];
+
+    return queue_pop_wait(&client->queue, client->cells, SHM_RING_RESPONSES, NULL, item, now_ms() + timeout);
+}
@@ -0,0 +1,118 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+#include "render_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shared memory transport between mod_tile and renderd on the same host
+ *
+ * renderd creates a segment in /dev/shm holding one request ring and one
+ * response ring for each of SHM_RING_CLIENTS clients. A client (a pooled
+ * mod_tile connection) claims a client slot, pushes protocol version 3 items
+ * into the request ring and waits for the responses in the response ring of
+ * its slot. No system calls are needed unless the other side is asleep, in
+ * which case it is woken through a futex in the ring.
+ *
+ * All rings are bounded queues with a sequence number per cell, so that any
+ * number of processes can push concurrently while a single consumer pops.
+ * The socket protocol stays the fallback whenever no segment can be attached.
+ *
+ * renderd answers the request of a ring client through the pseudo file
+ * descriptor SHM_RING_FD(slot), which send_reply() routes into the response
+ * ring of the slot.
+ */
+
+#define SHM_RING_MAGIC 0x74696c65
+#define SHM_RING_VERSION 1
+
+#define SHM_RING_FD(slot) (-2 - (slot))
+#define SHM_RING_SLOT(fd) (-2 - (fd))
+
+/* A client tells renderd that it gives up its slot with this command, so
+ * that the requests it was waiting for are not answered to the next owner.
+ */
+#define SHM_RING_RELEASE cmdIgnore
+
+struct shm_ring_cell {
+    uint32_t seq;
+    int32_t slot;
+    struct protocol_v3_item item;
+};
+
+struct shm_ring_queue {
+    uint32_t head __attribute__((aligned(64))); // Next cell to push, shared by the producers
+    uint32_t tail __attribute__((aligned(64))); // Next cell to pop, only used by the consumer
+    uint32_t wake; // Futex word, bumped to wake up the consumer
+    uint32_t sleeping; // Set while the consumer waits on wake
+};
+
+struct shm_ring_client {
+    pid_t owner; // Process using the slot, 0 if it is free
+    uint32_t generation; // Incremented whenever the slot is claimed
+    struct shm_ring_queue queue;
+    struct shm_ring_cell cells[SHM_RING_RESPONSES];
+};
+
+struct shm_ring {
+    uint32_t magic;
+    uint32_t version;
+    pid_t server; // renderd process serving the ring
+    struct shm_ring_queue queue;
+    struct shm_ring_cell cells[SHM_RING_SIZE];
+    struct shm_ring_client clients[SHM_RING_CLIENTS];
+};
+
+/* renderd: create the segment name (as for shm_open) and remember it for
+ * shm_ring_reply(). Returns NULL on failure.
+ */
+struct shm_ring *shm_ring_create(const char *name);
+
+/* renderd: remove the segment again */
+void shm_ring_destroy(struct shm_ring *ring, const char *name);
+
+/* renderd: take the next request from the ring, waiting up to timeout ms.
+ * Returns 1 with the client slot and item filled in, or 0 if there was none.
+ */
+int shm_ring_next(struct shm_ring *ring, int *slot, struct protocol_v3_item *item, int timeout);
+
+/* renderd: post a response to the client in slot of the ring created by
+ * shm_ring_create(). Returns 0 if its response ring is full.
+ */
+int shm_ring_reply(int slot, const struct protocol_v3_item *item);
+
+/* Client: map an existing segment. Returns NULL if there is none, or if the
+ * renderd that created it is no longer running.
+ */
+struct shm_ring *shm_ring_attach(const char *name);
+void shm_ring_detach(struct shm_ring *ring);
+
+/* Client: is the renderd that created the ring still running? */
+int shm_ring_alive(struct shm_ring *ring);
+
+/* Client: claim a free slot, or -1 if all are taken. *generation is set to
+ * the generation of the slot, which clients use to make their request ids
+ * unique across owners.
+ */
+int shm_ring_claim(struct shm_ring *ring, uint32_t *generation);
+void shm_ring_release(struct shm_ring *ring, int slot);
+
+/* Client: queue a request for slot. Returns 0 if the ring is full. */
+int shm_ring_submit(struct shm_ring *ring, int slot, const struct protocol_v3_item *item);
+
+/* Client: take the next response of slot, waiting up to timeout ms.
+ * Returns 1 if item has been filled in, or 0 on timeout.
+ */
+int shm_ring_response(struct shm_ring *ring, int slot, struct protocol_v3_item *item, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
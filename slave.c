@@ -0,0 +1,620 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "render_config.h"
+#include "daemon.h"
+#include "gen_tile.h"
+#include "protocol.h"
+#include "slave.h"
+
+#define SLAVE_BUF_SIZE 4096
+
+struct slave_request {
+    struct item *item;
+    int id;
+    time_t sent;
+};
+
+/* A connection to a slave. Only the sender thread sends on, opens and closes
+ * the socket. The receiver reads from it and, if the connection fails, marks
+ * it broken and takes back its requests; the sender closes it later on.
+ */
+struct slave_conn {
+    int fd;
+    int broken;
+    int next_id;
+    int num_inflight;
+    struct slave_request inflight[SLAVE_WINDOW_MAX];
+
+    // Partially received response frame
+    int batch;
+    int itemsize;
+    size_t len;
+    char buf[SLAVE_BUF_SIZE];
+};
+
+struct slave {
+    renderd_config *config;
+    int id;
+    char name[PATH_MAX];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int failures;    // Consecutive failures, 0 if the slave is healthy
+    time_t retry_at; // End of the current backoff period
+    int window;      // Requests we may have outstanding, granted by the slave
+    int outstanding;
+    struct slave_conn conns[SLAVE_CONNECTIONS];
+    int wake_fds[2]; // Tells the receiver about new connections
+
+    long dispatched;
+    long failed;
+    long timeouts;
+    long requeued;
+};
+
+/* Completed or failed request, handled by the receiver once it has dropped
+ * the slave lock
+ */
+struct slave_result {
+    struct item *item;
+    enum protoCmd rsp;
+};
+
+#define SLAVE_RESULTS_MAX (SLAVE_CONNECTIONS * SLAVE_WINDOW_MAX)
+
+static struct slave slaves[MAX_SLAVES];
+static int num_slaves;
+
+static int slave_connect(struct slave *s)
+{
+    renderd_config *sConfig = s->config;
+    struct timeval tv;
+    int fd;
+
+    if (sConfig->ipport > 0) {
+        struct sockaddr_in addrI;
+        struct hostent *server;
+
+        server = gethostbyname(sConfig->iphostname);
+        if (server == NULL) {
+            syslog(LOG_WARNING, "Could not resolve hostname: %s", sConfig->iphostname);
+            return FD_INVALID;
+        }
+        fd = socket(PF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            syslog(LOG_WARNING, "Could not obtain socket: %i", errno);
+            return FD_INVALID;
+        }
+        bzero(&addrI, sizeof(addrI));
+        addrI.sin_family = AF_INET;
+        bcopy((char *) server->h_addr, (char *) &addrI.sin_addr.s_addr, server->h_length);
+        addrI.sin_port = htons(sConfig->ipport);
+        if (connect(fd, (struct sockaddr *) &addrI, sizeof(addrI)) < 0) {
+            syslog(LOG_WARNING, "Could not connect to render slave %s", s->name);
+            close(fd);
+            return FD_INVALID;
+        }
+    } else {
+        struct sockaddr_un addrU;
+
+        fd = socket(PF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            syslog(LOG_WARNING, "Could not obtain socket: %i", errno);
+            return FD_INVALID;
+        }
+        bzero(&addrU, sizeof(addrU));
+        addrU.sun_family = AF_UNIX;
+        strncpy(addrU.sun_path, sConfig->socketname, sizeof(addrU.sun_path) - 1);
+        if (connect(fd, (struct sockaddr *) &addrU, sizeof(addrU)) < 0) {
+            syslog(LOG_WARNING, "Could not connect to render slave %s", s->name);
+            close(fd);
+            return FD_INVALID;
+        }
+    }
+
+    // Requests are small, so sending only blocks if the slave is stuck
+    tv.tv_sec = SLAVE_RENDER_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    syslog(LOG_INFO, "Connected to render slave %s on fd %i", s->name, fd);
+    return fd;
+}
+
+/* Must be called with the slave lock held */
+static void slave_succeeded(struct slave *s)
+{
+    if (s->failures) {
+        syslog(LOG_INFO, "Render slave %s is back", s->name);
+        s->failures = 0;
+        pthread_cond_broadcast(&s->cond);
+    }
+}
+
+/* Must be called with the slave lock held */
+static void slave_failed(struct slave *s)
+{
+    int backoff = SLAVE_BACKOFF_MIN;
+    int i;
+
+    s->failures++;
+    s->failed++;
+    for (i = 1; (i < s->failures) && (backoff < SLAVE_BACKOFF_MAX); i++)
+        backoff *= 2;
+    if (backoff > SLAVE_BACKOFF_MAX)
+        backoff = SLAVE_BACKOFF_MAX;
+    s->retry_at = time(NULL) + backoff;
+    pthread_cond_broadcast(&s->cond);
+
+    syslog(LOG_ERR, "Render slave %s failed %i times in a row, not using it for %i seconds",
+            s->name, s->failures, backoff);
+}
+
+/* Give up on a connection. Its outstanding requests are added to results to
+ * be put back into the queue. Must be called with the slave lock held.
+ */
+static void slave_conn_fail(struct slave *s, struct slave_conn *c, struct slave_result *results, int *num_results)
+{
+    int i;
+
+    shutdown(c->fd, SHUT_RDWR);
+    c->broken = 1;
+    for (i = 0; i < c->num_inflight; i++) {
+        results[*num_results].item = c->inflight[i].item;
+        results[*num_results].rsp = cmdIgnore;
+        (*num_results)++;
+    }
+    s->outstanding -= c->num_inflight;
+    c->num_inflight = 0;
+    slave_failed(s);
+}
+
+/* Block until the slave is healthy and has granted us room for another
+ * request. Once a backoff period is over, a single request is sent to probe
+ * the slave. Must be called with the slave lock held.
+ */
+static void slave_wait_credit(struct slave *s)
+{
+    while (1) {
+        if (s->failures) {
+            time_t now = time(NULL);
+
+            if (now < s->retry_at) {
+                struct timespec ts;
+                ts.tv_sec = s->retry_at;
+                ts.tv_nsec = 0;
+                pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+                continue;
+            }
+            if (s->outstanding == 0)
+                return;
+        } else if (s->outstanding < s->window) {
+            return;
+        }
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+}
+
+/* Close broken connections and return the open connection with the fewest
+ * outstanding requests, opening new connections as needed. Returns NULL if
+ * the slave can not be reached. Must be called with the slave lock held, it
+ * is dropped while connecting.
+ */
+static struct slave_conn *slave_pick_conn(struct slave *s)
+{
+    struct slave_conn *best = NULL, *unused = NULL;
+    int i, fd;
+
+    for (i = 0; i < SLAVE_CONNECTIONS; i++) {
+        struct slave_conn *c = &s->conns[i];
+
+        if (c->broken) {
+            close(c->fd);
+            c->fd = FD_INVALID;
+            c->broken = 0;
+        }
+        if (c->fd == FD_INVALID) {
+            if (!unused)
+                unused = c;
+        } else if (!best || (c->num_inflight < best->num_inflight)) {
+            best = c;
+        }
+    }
+
+    // Spread the requests over all connections, but do not let a slave
+    // which only accepts some of them stop us from using the others
+    if (!unused || (best && best->num_inflight == 0))
+        return best;
+
+    pthread_mutex_unlock(&s->lock);
+    fd = slave_connect(s);
+    pthread_mutex_lock(&s->lock);
+    if (fd == FD_INVALID) {
+        if (!best)
+            slave_failed(s);
+        return best;
+    }
+
+    unused->fd = fd;
+    unused->batch = 0;
+    unused->len = 0;
+    write(s->wake_fds[1], "", 1);
+    return unused;
+}
+
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *) buf;
+
+    while (len > 0) {
+        int ret = send(fd, p, len, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 1;
+}
+
+/**
+ * Sender side of a slave. Pulls requests from the central queue as long as
+ * the slave has granted us credit for them, and forwards them to the slave
+ * together with a request for an updated window.
+ */
+static void *slave_sender(void *arg)
+{
+    struct slave *s = (struct slave *) arg;
+
+    while (1) {
+        struct {
+            struct protocol_v3 hdr;
+            struct protocol_v3_item items[2];
+        } frame;
+        struct slave_conn *c;
+        struct item *item;
+        int fd;
+
+        pthread_mutex_lock(&s->lock);
+        slave_wait_credit(s);
+        c = slave_pick_conn(s);
+        pthread_mutex_unlock(&s->lock);
+        if (!c)
+            continue;
+
+        item = fetch_request();
+
+        pthread_mutex_lock(&s->lock);
+        if (c->broken || (c->fd == FD_INVALID) ||
+                (s->failures && (s->outstanding || (time(NULL) < s->retry_at)))) {
+            // The slave failed while we were waiting for work. Hand the
+            // request back without counting it as an attempt.
+            pthread_mutex_unlock(&s->lock);
+            item->retries--;
+            requeue_request(item);
+            continue;
+        }
+
+        bzero(&frame, sizeof(frame));
+        frame.hdr.ver = PROTO_VER_BATCH;
+        frame.hdr.count = 2;
+        frame.hdr.itemsize = sizeof(struct protocol_v3_item);
+        frame.items[0].id = c->next_id++;
+        frame.items[0].cmd = cmdRender;
+        frame.items[0].x = item->req.x;
+        frame.items[0].y = item->req.y;
+        frame.items[0].z = item->req.z;
+        strcpy(frame.items[0].xmlname, item->req.xmlname);
+
+        c->inflight[c->num_inflight].item = item;
+        c->inflight[c->num_inflight].id = frame.items[0].id;
+        c->inflight[c->num_inflight].sent = time(NULL);
+        c->num_inflight++;
+        s->outstanding++;
+        s->dispatched++;
+
+        frame.items[1].id = c->next_id++;
+        frame.items[1].cmd = cmdCredit;
+        frame.items[1].x = s->outstanding;
+        fd = c->fd;
+        pthread_mutex_unlock(&s->lock);
+
+        syslog(LOG_DEBUG, "DEBUG: Dispatching request to render slave %s on fd %i", s->name, fd);
+        // Only this thread closes the connection, so fd stays valid while
+        // the lock is dropped
+        if (!send_all(fd, &frame, sizeof(frame))) {
+            syslog(LOG_ERR, "Failed to send request to render slave %s: %s", s->name, strerror(errno));
+            // The receiver notices the shut down connection and puts the
+            // outstanding requests back into the queue
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    return NULL;
+}
+
+/* Handle the complete responses in the connection buffer. Returns 0 if the
+ * slave sent garbage. Must be called with the slave lock held.
+ */
+static int slave_process_buffer(struct slave *s, struct slave_conn *c, struct slave_result *results, int *num_results)
+{
+    size_t pos = 0;
+
+    while (1) {
+        const char *p = c->buf + pos;
+        size_t avail = c->len - pos;
+
+        if (c->batch > 0) {
+            struct protocol_v3_item rsp;
+            int i;
+
+            if (avail < (size_t)c->itemsize)
+                break;
+            bzero(&rsp, sizeof(rsp));
+            memcpy(&rsp, p, (c->itemsize < (int)sizeof(rsp)) ? c->itemsize : sizeof(rsp));
+            pos += c->itemsize;
+            c->batch--;
+
+            if (rsp.cmd == cmdCredit) {
+                s->window = rsp.x;
+                if (s->window > SLAVE_WINDOW_MAX)
+                    s->window = SLAVE_WINDOW_MAX;
+                if (s->window < 1)
+                    s->window = 1;
+                pthread_cond_broadcast(&s->cond);
+                continue;
+            }
+
+            for (i = 0; i < c->num_inflight; i++) {
+                if (c->inflight[i].id == rsp.id)
+                    break;
+            }
+            if (i == c->num_inflight) {
+                syslog(LOG_ERR, "Render slave %s replied to unknown request %i", s->name, rsp.id);
+                continue;
+            }
+
+            results[*num_results].item = c->inflight[i].item;
+            results[*num_results].rsp = rsp.cmd;
+            (*num_results)++;
+            c->inflight[i] = c->inflight[--c->num_inflight];
+            s->outstanding--;
+            pthread_cond_broadcast(&s->cond);
+
+            if (rsp.cmd == cmdDone) {
+                slave_succeeded(s);
+            } else {
+                syslog(LOG_ERR, "Request from render slave %s did not complete correctly", s->name);
+                slave_failed(s);
+            }
+        } else {
+            struct protocol_v3 hdr;
+
+            if (avail < sizeof(hdr))
+                break;
+            memcpy(&hdr, p, sizeof(hdr));
+            if ((hdr.ver != PROTO_VER_BATCH) || (hdr.count < 0) || (hdr.count > PROTO_BATCH_MAX) ||
+                    (hdr.itemsize < (int)PROTO_ITEM_MIN) || (hdr.itemsize > PROTO_ITEM_MAX)) {
+                syslog(LOG_ERR, "Bad response from render slave %s: ver(%d) count(%d) itemsize(%d)",
+                        s->name, hdr.ver, hdr.count, hdr.itemsize);
+                return 0;
+            }
+            pos += sizeof(hdr);
+            c->batch = hdr.count;
+            c->itemsize = hdr.itemsize;
+        }
+    }
+
+    if (pos > 0) {
+        memmove(c->buf, c->buf + pos, c->len - pos);
+        c->len -= pos;
+    }
+    return 1;
+}
+
+/* Read everything available on the connection. Returns 0 if the connection
+ * failed. Must be called with the slave lock held.
+ */
+static int slave_read(struct slave *s, struct slave_conn *c, struct slave_result *results, int *num_results)
+{
+    while (1) {
+        int ret = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+        if (ret > 0) {
+            c->len += ret;
+            if (!slave_process_buffer(s, c, results, num_results))
+                return 0;
+        } else if (ret == 0) {
+            syslog(LOG_ERR, "Connection to render slave %s closed", s->name);
+            return 0;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            syslog(LOG_ERR, "Failed to receive from render slave %s: %s", s->name, strerror(errno));
+            return 0;
+        }
+    }
+}
+
+/**
+ * Receiver side of a slave. Waits for responses on all connections to the
+ * slave and answers the clients, or puts the requests back into the queue if
+ * the slave failed them or did not reply within SLAVE_RENDER_TIMEOUT.
+ */
+static void *slave_receiver(void *arg)
+{
+    struct slave *s = (struct slave *) arg;
+    struct slave_result results[SLAVE_RESULTS_MAX];
+
+    while (1) {
+        struct pollfd pfds[SLAVE_CONNECTIONS + 1];
+        struct slave_conn *polled[SLAVE_CONNECTIONS + 1];
+        int num_pfds = 1, num_results = 0;
+        time_t now;
+        int i, j;
+
+        pfds[0].fd = s->wake_fds[0];
+        pfds[0].events = POLLIN;
+        polled[0] = NULL;
+        pthread_mutex_lock(&s->lock);
+        for (i = 0; i < SLAVE_CONNECTIONS; i++) {
+            struct slave_conn *c = &s->conns[i];
+            if ((c->fd != FD_INVALID) && !c->broken) {
+                pfds[num_pfds].fd = c->fd;
+                pfds[num_pfds].events = POLLIN;
+                polled[num_pfds] = c;
+                num_pfds++;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        // Wake up once a second to check for requests which timed out
+        if (poll(pfds, num_pfds, 1000) < 0) {
+            if (errno != EINTR)
+                syslog(LOG_ERR, "Failed to poll render slave %s: %s", s->name, strerror(errno));
+            continue;
+        }
+        if (pfds[0].revents) {
+            char buf[64];
+            while (read(s->wake_fds[0], buf, sizeof(buf)) > 0);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        for (i = 1; i < num_pfds; i++) {
+            struct slave_conn *c = polled[i];
+
+            // The fd can only have been closed if the connection broke
+            if (!pfds[i].revents || c->broken)
+                continue;
+            if (!slave_read(s, c, results, &num_results))
+                slave_conn_fail(s, c, results, &num_results);
+        }
+
+        now = time(NULL);
+        for (i = 0; i < SLAVE_CONNECTIONS; i++) {
+            struct slave_conn *c = &s->conns[i];
+
+            if ((c->fd == FD_INVALID) || c->broken)
+                continue;
+            for (j = 0; j < c->num_inflight; j++) {
+                if (now - c->inflight[j].sent > SLAVE_RENDER_TIMEOUT) {
+                    s->timeouts++;
+                    syslog(LOG_ERR, "Render slave %s did not reply within %i seconds", s->name, SLAVE_RENDER_TIMEOUT);
+                    slave_conn_fail(s, c, results, &num_results);
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        for (i = 0; i < num_results; i++) {
+            struct item *item = results[i].item;
+
+            if (results[i].rsp == cmdDone) {
+                send_response(item, cmdDone);
+            } else if (item->retries < SLAVE_MAX_RETRIES) {
+                __sync_fetch_and_add(&s->requeued, 1);
+                requeue_request(item);
+            } else {
+                syslog(LOG_ERR, "Giving up on request xml(%s) z(%i) x(%i) y(%i) after %i attempts",
+                        item->req.xmlname, item->req.z, item->req.x, item->req.y, item->retries + 1);
+                send_response(item, cmdNotDone);
+            }
+        }
+    }
+    return NULL;
+}
+
+void slaves_start(renderd_config *config_slaves, int num)
+{
+    pthread_t thread;
+    int i, j;
+
+    for (i = 1; i < num; i++) {
+        struct slave *s = &slaves[num_slaves];
+
+        if (config_slaves[i].num_threads == 0)
+            continue;
+
+        s->config = &config_slaves[i];
+        s->id = i;
+        if (s->config->ipport > 0)
+            snprintf(s->name, sizeof(s->name), "%s:%i", s->config->iphostname, s->config->ipport);
+        else
+            snprintf(s->name, sizeof(s->name), "%s", s->config->socketname);
+        // Until the slave tells us otherwise, keep each of its render
+        // threads busy
+        s->window = s->config->num_threads;
+        if (s->window > SLAVE_WINDOW_MAX)
+            s->window = SLAVE_WINDOW_MAX;
+        for (j = 0; j < SLAVE_CONNECTIONS; j++)
+            s->conns[j].fd = FD_INVALID;
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        if (pipe(s->wake_fds) || fcntl(s->wake_fds[0], F_SETFL, O_NONBLOCK) < 0) {
+            fprintf(stderr, "failed to create pipe for render slave\n");
+            exit(7);
+        }
+        num_slaves++;
+
+        if (pthread_create(&thread, NULL, slave_receiver, (void *) s) ||
+                pthread_detach(thread) ||
+                pthread_create(&thread, NULL, slave_sender, (void *) s) ||
+                pthread_detach(thread)) {
+            fprintf(stderr, "error spawning render slave thread\n");
+            exit(7);
+        }
+    }
+}
+
+int slaves_get_stats(struct slave_stats *stats, int max)
+{
+    int i;
+
+    for (i = 0; (i < num_slaves) && (i < max); i++) {
+        struct slave *s = &slaves[i];
+
+        pthread_mutex_lock(&s->lock);
+        stats[i].id = s->id;
+        stats[i].up = (s->failures == 0);
+        stats[i].window = s->window;
+        stats[i].outstanding = s->outstanding;
+        stats[i].dispatched = s->dispatched;
+        stats[i].failed = s->failed;
+        stats[i].timeouts = s->timeouts;
+        stats[i].requeued = s->requeued;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return i;
+}
+
+void slaves_write_stats(FILE *statfile)
+{
+    struct slave_stats stats[MAX_SLAVES];
+    int num = slaves_get_stats(stats, MAX_SLAVES);
+
+    for (int i = 0; i < num; i++) {
+        fprintf(statfile, "Slave%iUp: %i\n", stats[i].id, stats[i].up);
+        fprintf(statfile, "Slave%iWindow: %i\n", stats[i].id, stats[i].window);
+        fprintf(statfile, "Slave%iOutstanding: %i\n", stats[i].id, stats[i].outstanding);
+        fprintf(statfile, "Slave%iDispatched: %li\n", stats[i].id, stats[i].dispatched);
+        fprintf(statfile, "Slave%iFailed: %li\n", stats[i].id, stats[i].failed);
+        fprintf(statfile, "Slave%iTimeouts: %li\n", stats[i].id, stats[i].timeouts);
+        fprintf(statfile, "Slave%iRequeued: %li\n", stats[i].id, stats[i].requeued);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef SLAVE_H
+#define SLAVE_H
+
+#include <stdio.h>
+
+#include "daemon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Dispatch of requests to remote render slaves
+ *
+ * The master renderd runs a sender and a receiver thread for each slave, and
+ * keeps up to SLAVE_CONNECTIONS connections open to it. The sender takes
+ * requests from the central queue just like a local render thread and sends
+ * each one on the connection with the fewest requests outstanding, together
+ * with a cmdCredit. The slave answers the cmdCredit with a window, the number
+ * of requests the master may have outstanding on it, and the sender only
+ * takes another request while there is room left in that window.
+ *
+ * The receiver polls all connections of the slave, hands finished metatiles
+ * back to their clients and gives up on a connection once one of its requests
+ * has not been answered within SLAVE_RENDER_TIMEOUT.
+ *
+ * When a slave fails (connection refused, timeout, closed connection or an
+ * error reply) the requests outstanding on the connection are put back into
+ * their queues so that another renderer can pick them up, up to
+ * SLAVE_MAX_RETRIES times each. The sender then stops taking requests for an
+ * exponentially growing backoff period, after which it probes the slave with
+ * a single request.
+ */
+
+/* Start the sender and receiver threads for the slaves config_slaves[1..num-1] */
+void slaves_start(renderd_config *config_slaves, int num);
+
+struct slave_stats {
+    int id; // Index of the renderd section of the slave
+    int up;
+    int window;
+    int outstanding;
+    long dispatched;
+    long failed;
+    long timeouts;
+    long requeued;
+};
+
+/* Fill in the counters of up to max slaves, returns the number of slaves */
+int slaves_get_stats(struct slave_stats *stats, int max);
+
+/* Write per slave counters to the stats file */
+void slaves_write_stats(FILE *statfile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
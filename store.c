@@ -1,7 +1,7 @@
 /* Meta-tile optimised file storage
  *
  * Instead of storing each individual tile as a file,
- * bundle the 8x8 meta tile into a special meta-file.
+ * bundle the NxN meta tile into a special meta-file.
  * This reduces the Inode usage and more efficient
  * utilisation of disk space.
  */
@@ -16,6 +16,8 @@
 #include <utime.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 
 #include "store.h"
@@ -23,14 +25,247 @@
 #include "dir_utils.h"
 #include "protocol.h"
 
+/* 64 bit FNV-1a, stored little endian */
+void tile_hash(const unsigned char *data, size_t len, unsigned char hash[META_HASH_SIZE])
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211ULL;
+    }
+    for (i = 0; i < META_HASH_SIZE; i++) {
+        hash[i] = h & 0xff;
+        h >>= 8;
+    }
+}
+
 #ifdef METATILE
+/* What the header of a metatile says about it */
+struct meta_info {
+    int size; // Tiles across
+    int encoding;
+    time_t rendered; // 0 if unknown
+    const unsigned char (*hash)[META_HASH_SIZE]; // NULL if the file has none
+};
+
+/* Check the header of a metatile, of which the first len bytes are at m,
+ * and that it has the size the style uses at its zoom level. Returns 0 if
+ * it is not a metatile the tile can be read from.
+ */
+static int meta_parse(const char *path, const struct meta_layout *m, size_t len, int size, struct meta_info *info)
+{
+    size_t index_end;
+    const struct meta_header_v2 *v2;
+
+    if ((len < sizeof(struct meta_layout)) || memcmp(m->magic, META_MAGIC, strlen(META_MAGIC))) {
+        fprintf(stderr, "Meta file %s header magic mismatch\n", path);
+        return 0;
+    }
+    if ((m->count <= 0) || (m->count > METATILE_MAX * METATILE_MAX)) {
+        fprintf(stderr, "Meta file %s header bad count %d\n", path, m->count);
+        return 0;
+    }
+    index_end = sizeof(struct meta_layout) + m->count * sizeof(struct entry);
+    if (len < index_end) {
+        fprintf(stderr, "Meta file %s too small to contain header\n", path);
+        return 0;
+    }
+
+    info->size = 0;
+    info->encoding = metaEncodingPNG;
+    info->rendered = 0;
+    info->hash = NULL;
+    v2 = (const struct meta_header_v2 *)((const char *)m + index_end);
+    if ((len >= index_end + sizeof(struct meta_header_v2)) && !memcmp(v2->magic, META_V2_MAGIC, strlen(META_V2_MAGIC))) {
+        if (v2->version != META_VERSION) {
+            fprintf(stderr, "Meta file %s has an unknown version %d header\n", path, v2->version);
+            return 0;
+        }
+        if (v2->size * v2->size != m->count) {
+            fprintf(stderr, "Meta file %s header bad count %d for size %d\n", path, m->count, v2->size);
+            return 0;
+        }
+        info->size = v2->size;
+        info->encoding = v2->encoding;
+        info->rendered = v2->rendered;
+        if (len >= index_end + META_V2_SIZE(m->count))
+            info->hash = v2->hash;
+    } else {
+        // Version 1 files are square and hold PNG tiles
+        while (info->size * info->size < m->count)
+            info->size++;
+    }
+    if (info->size != size) {
+        // Left over from before the size of the style was changed
+        fprintf(stderr, "Meta file %s has %dx%d tiles instead of %dx%d\n", path, info->size, info->size, size, size);
+        return 0;
+    }
+    return 1;
+}
+
+/* Metatiles mapped into memory, shared by all threads of the process. A
+ * mapping is kept until it is pushed out of the cache and no view refers to
+ * it any more. renderd replaces metatiles by renaming a new file over them,
+ * so a mapped file is never truncated under our feet.
+ */
+struct meta_map {
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    unsigned char *addr;
+    size_t len;
+    int refs; // One for the cache, one for each view
+    unsigned long used;
+};
+
+static struct meta_map *metaMaps[META_MAP_CACHE];
+static unsigned long metaMapClock;
+static pthread_mutex_t metaMapLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with metaMapLock held
+static void meta_map_put(struct meta_map *mm)
+{
+    if (--mm->refs == 0) {
+        munmap(mm->addr, mm->len);
+        free(mm);
+    }
+}
+
+static struct meta_map *meta_map_get(const char *path)
+{
+    struct meta_map *mm;
+    struct stat st;
+    int fd, i, victim = 0;
+
+    if (stat(path, &st) < 0)
+        return NULL;
+
+    pthread_mutex_lock(&metaMapLock);
+    for (i = 0; i < META_MAP_CACHE; i++) {
+        mm = metaMaps[i];
+        if (mm && (mm->ino == st.st_ino) && (mm->dev == st.st_dev) &&
+                (mm->mtime == st.st_mtime) && !strcmp(mm->path, path)) {
+            mm->refs++;
+            mm->used = ++metaMapClock;
+            pthread_mutex_unlock(&metaMapLock);
+            return mm;
+        }
+    }
+    pthread_mutex_unlock(&metaMapLock);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(struct meta_layout))) {
+        close(fd);
+        return NULL;
+    }
+    mm = (struct meta_map *)malloc(sizeof(struct meta_map));
+    if (!mm) {
+        close(fd);
+        return NULL;
+    }
+    mm->addr = (unsigned char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mm->addr == MAP_FAILED) {
+        free(mm);
+        return NULL;
+    }
+    strncpy(mm->path, path, sizeof(mm->path) - 1);
+    mm->path[sizeof(mm->path) - 1] = 0;
+    mm->dev = st.st_dev;
+    mm->ino = st.st_ino;
+    mm->mtime = st.st_mtime;
+    mm->len = st.st_size;
+    mm->refs = 2;
+
+    // Replace an older version of the same metatile, or the least recently used
+    pthread_mutex_lock(&metaMapLock);
+    for (i = 0; i < META_MAP_CACHE; i++) {
+        if (!metaMaps[i] || !strcmp(metaMaps[i]->path, path)) {
+            victim = i;
+            break;
+        }
+        if (metaMaps[i]->used < metaMaps[victim]->used)
+            victim = i;
+    }
+    if (metaMaps[victim])
+        meta_map_put(metaMaps[victim]);
+    metaMaps[victim] = mm;
+    mm->used = ++metaMapClock;
+    pthread_mutex_unlock(&metaMapLock);
+    return mm;
+}
+
+int tile_view_get(const char *xmlconfig, int x, int y, int z, struct tile_view *view)
+{
+    char path[PATH_MAX];
+    struct meta_map *mm;
+    const struct meta_layout *m;
+    const struct entry *e;
+    struct meta_info info;
+    int meta_offset;
+
+    view->map = NULL;
+    meta_offset = xyz_to_meta(path, sizeof(path), HASH_PATH, xmlconfig, x, y, z);
+    mm = meta_map_get(path);
+    if (!mm)
+        return -1;
+    view->map = mm;
+
+    m = (const struct meta_layout *)mm->addr;
+    if (!meta_parse(path, m, mm->len, metatile_size(xmlconfig, z), &info)) {
+        tile_view_release(view);
+        return -4;
+    }
+    e = &m->index[meta_offset];
+    if ((e->offset < 0) || (e->size < 0) || ((size_t)e->offset + e->size > mm->len)) {
+        fprintf(stderr, "Meta file %s has a bad index\n", path);
+        tile_view_release(view);
+        return -6;
+    }
+    view->data = mm->addr + e->offset;
+    view->size = e->size;
+    view->offset = e->offset;
+    view->path = mm->path;
+    view->hash = info.hash ? info.hash[meta_offset] : NULL;
+    view->encoding = info.encoding;
+    view->rendered = info.rendered;
+    return e->size;
+}
+
+int tile_view_same_file(const struct tile_view *view, int fd)
+{
+    struct stat st;
+
+    if (!view->map || (fstat(fd, &st) < 0))
+        return 0;
+    return (st.st_ino == view->map->ino) && (st.st_dev == view->map->dev) &&
+            (st.st_size == (off_t)view->map->len);
+}
+
+void tile_view_release(struct tile_view *view)
+{
+    if (!view->map)
+        return;
+    pthread_mutex_lock(&metaMapLock);
+    meta_map_put(view->map);
+    pthread_mutex_unlock(&metaMapLock);
+    view->map = NULL;
+}
+
 int read_from_meta(const char *xmlconfig, int x, int y, int z, unsigned char *buf, size_t sz)
 {
     char path[PATH_MAX];
     int meta_offset, fd;
     unsigned int pos;
-    char header[4096];
+    // Large enough for the header of a metatile of METATILE_MAX size
+    char header[8192];
     struct meta_layout *m = (struct meta_layout *)header;
+    struct meta_info info;
     size_t file_offset, tile_size;
 
     meta_offset = xyz_to_meta(path, sizeof(path), HASH_PATH, xmlconfig, x, y, z);
@@ -52,42 +287,30 @@ int read_from_meta(const char *xmlconfig, int x, int y, int z, unsigned char *bu
             break;
         }
     }
-    if (pos < sizeof(struct meta_layout)) {
-        fprintf(stderr, "Meta file %s too small to contain header\n", path);
-        close(fd);
-        return -3;
-    }
-    if (memcmp(m->magic, META_MAGIC, strlen(META_MAGIC))) {
-        fprintf(stderr, "Meta file %s header magic mismatch\n", path);
+    // The size of the metatile is that of its style at z (due to xyz_to_meta above)
+    if (!meta_parse(path, m, pos, metatile_size(xmlconfig, z), &info)) {
         close(fd);
         return -4;
     }
-#if 1
-    // Currently this code only works with fixed metatile sizes (due to xyz_to_meta above)
-    if (m->count != (METATILE * METATILE)) {
-        fprintf(stderr, "Meta file %s header bad count %d != %d\n", path, m->count, METATILE * METATILE);
-        close(fd);
-        return -5;
-    }
-#else
-    if (m->count < 0 || m->count > 256) {
-        fprintf(stderr, "Meta file %s header bad count %d\n", path, m->count);
-        close(fd);
-        return -5;
-    }
-#endif
     file_offset = m->index[meta_offset].offset;
     tile_size   = m->index[meta_offset].size;
 
+    if (tile_size > sz) {
+        fprintf(stderr, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
+        tile_size = sz;
+    }
+    if (file_offset + tile_size <= pos) {
+        // Tiles shared by several others, like those of open sea, are
+        // stored right after the index and were read with the header
+        memcpy(buf, header + file_offset, tile_size);
+        close(fd);
+        return tile_size;
+    }
     if (lseek(fd, file_offset, SEEK_SET) < 0) {
         fprintf(stderr, "Meta file %s seek error %d\n", path, m->count);
         close(fd);
         return -6;
     }
-    if (tile_size > sz) {
-        fprintf(stderr, "Truncating tile %zd to fit buffer of %zd\n", tile_size, sz);
-        tile_size = sz;
-    }
     pos = 0;
     while (pos < tile_size) {
         size_t len = tile_size - pos;
@@ -156,9 +379,12 @@ void process_meta(const char *xmlconfig, int x, int y, int z)
     int fd;
     int ox, oy, limit;
     size_t offset, pos;
+    const int size = metatile_size(xmlconfig, z);
+    const int count = size * size;
     const int buf_len = 10 * MAX_SIZE; // To store all tiles in this .meta
     unsigned char *buf;
     struct meta_layout *m;
+    struct meta_header_v2 *v2;
     char meta_path[PATH_MAX];
     char tmp[PATH_MAX];
     struct stat s;
@@ -168,11 +394,12 @@ void process_meta(const char *xmlconfig, int x, int y, int z)
         return;
 
     m = (struct meta_layout *)buf;
-    offset = sizeof(struct meta_layout) + (sizeof(struct entry) * (METATILE * METATILE));
+    v2 = (struct meta_header_v2 *)&m->index[count];
+    offset = sizeof(struct meta_layout) + (sizeof(struct entry) * count) + META_V2_SIZE(count);
     memset(buf, 0, offset);
 
     limit = (1 << z);
-    limit = MIN(limit, METATILE);
+    limit = MIN(limit, size);
 
     for (ox=0; ox < limit; ox++) {
         for (oy=0; oy < limit; oy++) {
@@ -191,16 +418,25 @@ void process_meta(const char *xmlconfig, int x, int y, int z)
             } else {
                  m->index[mt].offset = offset;
                  m->index[mt].size = len;
+                 tile_hash(buf + offset, len, v2->hash[mt]);
                  offset += len;
             }
         }
     }
-    m->count = METATILE * METATILE;
+    m->count = count;
     memcpy(m->magic, META_MAGIC, strlen(META_MAGIC));
     m->x = x;
     m->y = y;
     m->z = z;
 
+    // The tiles were rendered when they were last written
+    xyz_to_path(meta_path, sizeof(meta_path), HASH_PATH, xmlconfig, x, y, z);
+    memcpy(v2->magic, META_V2_MAGIC, strlen(META_V2_MAGIC));
+    v2->version = META_VERSION;
+    v2->size = size;
+    v2->encoding = metaEncodingPNG;
+    v2->rendered = (stat(meta_path, &s) == 0) ? s.st_mtime : time(NULL);
+
     xyz_to_meta(meta_path, sizeof(meta_path), HASH_PATH, xmlconfig, x, y, z);
     if (mkdirp(meta_path)) {
         fprintf(stderr, "Error creating directories for: %s\n", meta_path);
@@ -326,7 +562,7 @@ void process_unpack(const char *name)
 
 
     limit = (1 << z);
-    limit = MIN(limit, METATILE);
+    limit = MIN(limit, metatile_size(xmlconfig, z));
 
     for (ox=0; ox < limit; ox++) {
         for (oy=0; oy < limit; oy++) {
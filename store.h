@@ -6,6 +6,8 @@ extern "C" {
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 #include "render_config.h"
 int tile_read(const char *xmlconfig, int x, int y, int z, unsigned char *buf, int sz);
 
@@ -19,17 +21,68 @@ struct entry {
 
 struct meta_layout {
     char magic[4];
-    int count; // METATILE ^ 2
+    int count; // size ^ 2, METATILE ^ 2 unless configured otherwise
     int x, y, z; // lowest x,y of this metatile, plus z
     struct entry index[]; // count entries
-    // Followed by the tile data
+    // Followed by struct meta_header_v2 and the tile data
     // The index offsets are measured from the start of the file
 };
 
+/* Version 2 of the format describes the metatile in a block right after the
+ * index: the format version, the number of tiles across, how the tiles are
+ * encoded, when the metatile was rendered and a hash of each tile, which
+ * mod_tile uses as the ETag. The tile offsets skip over the block, so
+ * version 1 readers still read the files of METATILE size, and files without
+ * the block are read as version 1.
+ */
+#define META_V2_MAGIC "MTV2"
+#define META_VERSION 2
+#define META_HASH_SIZE 8
+
+enum metaEncoding { metaEncodingPNG, metaEncodingJPEG, metaEncodingWebP };
+
+// Packed, as it follows the index at an offset which is no multiple of 8
+struct meta_header_v2 {
+    char magic[4];
+    int version;
+    int size; // Tiles across, count is size * size
+    int encoding; // enum metaEncoding, the same for all tiles
+    int64_t rendered; // Seconds since the epoch
+    unsigned char hash[][META_HASH_SIZE]; // count hashes, in the order of the index
+} __attribute__((packed));
+
+#define META_V2_SIZE(count) (sizeof(struct meta_header_v2) + (count) * META_HASH_SIZE)
+
+/* Hash of the content of a tile, as stored in struct meta_header_v2 */
+void tile_hash(const unsigned char *data, size_t len, unsigned char hash[META_HASH_SIZE]);
+
 
 int read_from_file(const char *xmlconfig, int x, int y, int z, unsigned char *buf, size_t sz);
 
 #ifdef METATILE
+/* A tile in a metatile mapped into memory. The mapping stays valid until
+ * tile_view_release(), even if the metatile is replaced in the meantime.
+ */
+struct tile_view {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;    // Of the tile in the metatile
+    const char *path; // Of the metatile
+    const unsigned char *hash; // From the metatile, NULL if it has none
+    int encoding;     // enum metaEncoding
+    time_t rendered;  // From the metatile, 0 if it has no version 2 header
+    struct meta_map *map;
+};
+
+/* Returns the size of the tile, -1 if the metatile is missing, -4 if its
+ * header is damaged or it has a size other than metatile_size() of the style,
+ * or -6 if its index is damaged.
+ */
+int tile_view_get(const char *xmlconfig, int x, int y, int z, struct tile_view *view);
+void tile_view_release(struct tile_view *view);
+/* Whether fd is open on the very metatile file the view is mapped from */
+int tile_view_same_file(const struct tile_view *view, int fd);
+
 int read_from_meta(const char *xmlconfig, int x, int y, int z, unsigned char *buf, size_t sz);
 void process_meta(const char *xmlconfig, int x, int y, int z);
 void process_pack(const char *name);